@@ -0,0 +1,56 @@
+/*
+ * aquos.h: TV handles for threaded programs, from libaquos.a ('make
+ * libaquos.a', link with -lpthread).
+ *
+ * Any number of threads may submit frames to a handle at once; none of
+ * them takes a lock or waits on another. The handle's own thread owns
+ * the port, writes the frames in order and calls each one's done()
+ * with the TV's reply. done() runs on that thread, so it should be
+ * quick; aquosfd() can be polled instead, and reads as the number of
+ * frames completed since it was last read.
+ */
+#ifndef AQUOS_H
+#define AQUOS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* done() results. */
+#define AQUOS_OK      0
+#define AQUOS_ERR     1
+#define AQUOS_UNKNOWN 2 /* any other reply, such as a query's answer */
+#define AQUOS_NONE    3 /* no reply in time */
+
+struct aquos;
+
+/* ns is from submission to the reply. */
+typedef void (*aquosdone)(void *arg, int resp, const char *reply,
+                          long long ns);
+
+/*
+ * Open and lock port ("/dev/ttyUSB0", or "tcp:[addr:]port"), with the
+ * settings from ~/.aquosctl/config. Returns NULL if it can't be had.
+ */
+struct aquos *aquosopen(const char *port);
+
+/*
+ * Queue an 8 character frame ("VOLM20  ") for the TV. Returns 0, or -1
+ * with errno EINVAL if frame isn't 8 printable characters, EAGAIN if
+ * the handle's queue is full, or EPIPE if it is closing. done may be
+ * NULL.
+ */
+int aquossubmit(struct aquos *h, const char *frame, aquosdone done,
+                void *arg);
+
+/* An eventfd counting completions, for poll() and read(). */
+int aquosfd(struct aquos *h);
+
+/* Finish what is queued, then close the port and free h. */
+void aquosclose(struct aquos *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AQUOS_H */
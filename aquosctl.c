@@ -15,6 +15,8 @@
  *       formatting of channel numbers may need tweaking.
  */
 
+#define _GNU_SOURCE /* CPU_SET, sched_setaffinity */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -23,6 +25,34 @@
 #include <errno.h>
 #include <termios.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <getopt.h>
+#include <sched.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+
+#include "aquos.h"
 
 /* Linux com0 is /dev/ttyS0. */
 #define	DEFAULT_PORT "/dev/ttyS0"
@@ -51,6 +81,137 @@
 #define CMD_CC       23
 #define CMD_3D       24
 #define CMD_BUTTON   25
+#define CMD_LEARN    26
+#define CMD_SWEEP    27
+#define CMD_SURVEY   28
+#define CMD_COMPILE  29
+#define CMD_PLAY     30
+#define CMD_RAW      31
+#define CMD_HEALTH   32
+#define CMD_BROKER   33
+#define CMD_BENCH    34
+#define CMD_SERVE    35
+#define CMD_RELOAD   36
+#define CMD_MIRROR   37
+#define CMD_FLEET    38
+#define CMD_SIMULATE 39
+#define CMD_SLO      40
+
+/* sendcommand() results; RESP_OK is EXIT_SUCCESS. */
+#define RESP_OK      0
+#define RESP_ERR     1
+#define RESP_UNKNOWN 2
+#define RESP_NONE    3  /* no response before the deadline */
+
+/* transact() timeout: derived from the latencies seen on this port. */
+#define TIMEOUT_ADAPTIVE -1
+
+/* Most frames a single command encodes to (dcabl1 sends two). */
+#define MAX_FRAMES   2
+
+/* Learned position/clock/phase limits, see checkrange(). */
+#define MAX_RANGES  256
+#define RANGES_FILE "ranges"
+#define CONTEXT_FILE "context"
+
+#define CONFIG_FILE  "config"
+
+/*
+ * Reply latency estimates, one log-bucketed histogram per (port, opcode):
+ * values below 16us get a bucket each, above that there are four buckets
+ * per power of two, up to about a minute.
+ */
+#define LATENCY_FILE "latency"
+#define LAT_BUCKETS  112
+#define MAX_LATENCY  64
+
+/* Link health, see recordhealth(). */
+#define HEALTH_FILE     "health"
+#define HEALTH_LOG      "health.log"
+#define HEALTH_LEVELS   3  /* degraded levels above normal */
+#define HEALTH_SETTLE   16 /* frames between level changes */
+
+/* serve's latency objectives and shift alarms, see slorecord(). */
+#define SLO_TARGETS 16     /* slo lines */
+#define SLO_CODES   32     /* opcodes watched */
+#define SLO_WINDOW  300000 /* ms judged, by default */
+#define SLO_SLICES  10     /* a window's parts; the oldest goes whole */
+#define SLO_MIN     20     /* replies in a window before it is judged */
+#define SLO_WARMUP  64     /* replies that learn an opcode's baseline */
+#define SLO_ALPHA   0.02   /* baseline EWMA weight after that */
+#define SLO_SLACK   1.0    /* CUSUM allowance, in baseline deviations */
+#define SLO_SHIFT   16.0   /* CUSUM sum that flags a shift, likewise */
+#define SLO_CLIP    4.0    /* most one reply adds, so a stray can't alone */
+#define ADMIN_WATCHERS 8   /* admin clients taking alerts */
+#define ADMIN_READ  1000   /* ms an admin client has to send its line */
+
+/* Port arbitration between aquosctl processes, see lockport(). */
+#define LOCK_DIR   "/var/lock"
+#define LOCK_GRACE 500 /* ms a ticket may go unclaimed before it's skipped */
+
+/* Port broker, see broker(). */
+#define BROKER_SOCKET  "/tmp/aquosctl.broker"
+#define BROKER_PORTS   32
+#define BROKER_CLIENTS 256
+
+/* Master and followers, see mirror(). */
+#define MIRROR_PORTS 33 /* the master and 32 followers */
+#define MIRROR_TRIES 2  /* sets of a follower per change */
+#define MIRROR_SKIP  3  /* rounds the master isn't asked what it can't say */
+
+/* Fleet inventory and selectors, see loadfleet(). */
+#define FLEET_FILE  "inventory"
+#define FLEET_HASH  4096 /* tag slots to start, a power of two; doubled */
+#define FLEET_OPS   128  /* a compiled selector's length */
+#define FLEET_DEPTH 16   /* sets it may hold at once while evaluating */
+#define FLEET_BATCH 128  /* ports open at once while sending */
+
+/* Simulated TVs, see simulate(). */
+#define SIM_MAX     20000 /* TVs in one process */
+#define SIM_LATENCY 20    /* ms, the median TV's turn at a frame */
+#define SIM_SPREAD  30    /* percent of that, one standard deviation */
+#define SIM_JITTER  20    /* percent each reply strays from its TV's turn */
+#define SIM_EVENTS  256   /* taken from epoll_wait() at once */
+
+/* Handles for threaded programs, see aquosopen(). */
+#define AQUOS_RING 1024 /* frames a handle queues, a power of two */
+
+/*
+ * Verbose logging, see logmsg(). Each thread formats records into its
+ * own ring and a writer thread drains them, so a slow stderr, file or
+ * syslog never holds up the send path.
+ */
+#define LOG_SLOTS  1024 /* records per thread, a power of two */
+#define LOG_TEXT   240
+#define LOG_IDLE   2    /* ms the writer lingers after records before it blocks */
+
+#define LOGTO_STDERR 0
+#define LOGTO_FILE   1
+#define LOGTO_SYSLOG 2
+
+/* Serve mode's HTTP front end, see serve(). */
+#define HTTP_LISTEN   "127.0.0.1:8080"
+#define HTTP_CLIENTS  256
+#define HTTP_PIPELINE 32   /* requests in progress per connection */
+#define HTTP_BODY     4096
+
+/* Serve mode's MQTT front end, see mqttstart(). */
+#define MQTT_PREFIX  "aquos"
+#define MQTT_RETRY   5000  /* ms between reconnect attempts */
+#define MQTT_BUFFER  65536
+#define MQTT_PACKET  1024  /* largest publish we build */
+#define MQTT_QOS2    32    /* QoS 2 packet ids remembered until PUBREL */
+
+#define MQTT_DOWN       0
+#define MQTT_CONNECTING 1
+#define MQTT_WAITACK    2  /* CONNECT sent */
+#define MQTT_UP         3
+
+/* Frames the port engine may have awaiting replies, see enginerun(). */
+#define WINDOW_MAX 16
+
+/* --realtime, see realtime(). */
+#define REALTIME_STACK (256 * 1024) /* stack pre-faulted for the send path */
 
 #ifdef NEWER_PROTOCOL
 #define CMD_TABLE_VERSION "12/17/10"
@@ -58,42 +219,34 @@
 #define CMD_TABLE_VERSION "12/16/05"
 #endif
 
+/* args of NULL are made by cmdargs() from the command's words and range. */
 static struct lookuptab {
 	char *cmd; int opcode;
 		char *args;
 		char *desc;
 } cmdtab[] = {
 	{"poenable", CMD_POENABLE,
-#ifdef NEWER_PROTOCOL
-		"{ on | on-ip | off }",
-#else
-		"{ on | off }",
-#endif
+		NULL,
 		"Enable/Disable power on command."
 	},
 	{"power", CMD_POWER,
-		"{ on | off }",
+		NULL,
 		"Turn TV on/off."
 	},
 	{"input", CMD_INPUT,
+		NULL,
 #ifdef NEWER_PROTOCOL
-		"[ tv | 1 - 8 ]",
 		"Select TV, INPUT1-8; blank to toggle."
 #else
-		"[ tv | 1 - 7 ]",
 		"Select TV, INPUT1-7; blank to toggle."
 #endif
 	},
 	{"avmode", CMD_AVMODE,
-#ifdef NEWER_PROTOCOL
-		"[standard|movie|game|user|dyn-fixed|dyn|pc|xvycc|standard-3d|movie-3d|game-3d|auto]",
-#else
-		"[standard|movie|game|user|dyn-fixed|dyn|pc|xvycc]",
-#endif
+		NULL,
 		"AV mode selection; blank to toggle."
 	},
 	{"vol",	CMD_VOLUME,
-		"{ 0 - 60 }",
+		NULL,
 		"Set volume (0-60)."
 	},
 	{"hpos", CMD_HPOS,
@@ -105,43 +258,35 @@ static struct lookuptab {
 		"Vertical Position. Ranges are on the position setting screen."
 	},
 	{"clock", CMD_CLOCK,
-		"{ 0 - 180 }",
+		NULL,
 		"Only in PC mode."
 	},
 	{"phase", CMD_PHASE,
-		"{ 1 - 40 }",
+		NULL,
 		"Only in PC mode."
 	},
 	{"viewmode", CMD_VIEWMODE,
-#ifdef NEWER_PROTOCOL
-		"{sidebar|sstretch|zoom|stretch|normal|zoom-pc|stretch-pc|dotbydot|full}",
-#else
-		"{sidebar|sstretch|zoom|stretch|normal|zoom-pc|stretch-pc|dotbydot|full|auto|original}",
-#endif
+		NULL,
 		"View modes (vary depending on input signal type -- see manual)."
 	},
 	{"mute", CMD_MUTE,
-		"[ on | off ]",
+		NULL,
 		"Mute on/off; blank to toggle."
 	},
 	{"surround", CMD_SURROUND,
-#ifdef NEWER_PROTOCOL
-		"[ on | off ]",
-#else
-		"[ normal | off | 3d-hall | 3d-movie | 3d-standard | 3d-stadium ]",
-#endif
+		NULL,
 		"Surround mode; blank to toggle."
 	},
 	{"audiosel", CMD_AUDIOSEL,
-		"<none>",
+		NULL,
 		"Audio selection toggle."
 	},
 	{"sleep", CMD_SLEEP,
-		"{ off or 0 | 30 | 60 | 90 | 120 }",
+		NULL,
 		"Sleep timer off or 30/60/90/120 minutes."
 	},
 	{"achan", CMD_ACHAN,
-		"{ 1 - 135 }",
+		NULL,
 		"Analog channel selection. Over-the-air: 2-69, Cable: 1-135."
 	},
 	{"dchan", CMD_DCHAN,
@@ -153,24 +298,24 @@ static struct lookuptab {
 		"Digital cable (type one)."
 	},
 	{"dcabl2", CMD_DCABL2,
-		"{ 0 - 16383 }",
+		NULL,
 		"Digital cable (type two), channels 0-16383."
 	},
 	{"chup", CMD_CHUP,
-		"<none>",
+		NULL,
 		"Channel up. Will switch to TV input if not already selected."
 	},
 	{"chdn", CMD_CHDN,
-		"<none>",
+		NULL,
 		"Channel down. Will switch to TV input if not already selected."
 	},
 	{"cc", CMD_CC,
-		"<none>",
+		NULL,
 		"Closed Caption toggle."
 	},
 #ifdef NEWER_PROTOCOL
 	{"3d", CMD_3D,
-		"{ off | 2d3d | sbs | tab | 3d2d-sbs | 3d2d-tab | 3d-auto | 2d-auto }",
+		NULL,
 		"3D mode selection."
 	},
 	{"button", CMD_BUTTON,
@@ -178,19 +323,1145 @@ static struct lookuptab {
 		"Simulate remote control button press."
 	},
 #endif
+#ifndef AQUOS_TINY
+	{"learn", CMD_LEARN,
+		"{ hpos | vpos | clock | phase }",
+		"Find the exact range for the current View Mode and input by bisection."
+	},
+	{"sweep", CMD_SWEEP,
+		"{ hpos | vpos | clock | phase } {first} {last} [--step n] [--dwell t]",
+		"Step through values every t (default 200ms); space marks, q stops."
+	},
+	{"survey", CMD_SURVEY,
+		"{ channels {dchan|dcabl1|achan} {ch} ... | inputs [n ...] } [--confirm]",
+		"Measure time to OK (and to confirmed state) for each target."
+	},
+	{"compile", CMD_COMPILE,
+		"{ scene.txt } [ -o scene.bin ]",
+		"Validate a scene once and store its ready-to-send frames."
+	},
+	{"play", CMD_PLAY,
+		"{ scene.bin } [ --verify={each|batch} ]",
+		"Send the frames of a compiled scene, reading back what they set."
+	},
+	{"raw", CMD_RAW,
+		"[ frame ... ]",
+		"Send 8 character frames (e.g. 'POWR1   ') from argv, or stdin."
+	},
+	{"health", CMD_HEALTH,
+		"<none>",
+		"Show link health scores and degraded levels for all ports."
+	},
+	{"broker", CMD_BROKER,
+		"[ port ... ]",
+		"Hold ports open and lend them to other aquosctl runs (-p port if none)."
+	},
+	{"serve", CMD_SERVE,
+		"[ --http [addr:]port ] [ --mqtt host[:port] ]",
+		"Hold the port and take commands over HTTP (JSON) and/or MQTT."
+	},
+	{"bench", CMD_BENCH,
+		"[ log | jitter | http | window | encode | parse | script | fleet | submit | slo ]",
+		"Run micro-benchmarks (all of them if none are named)."
+	},
+	{"reload", CMD_RELOAD,
+		"<none>",
+		"Make a running serve on the port reload its config file."
+	},
+	{"mirror", CMD_MIRROR,
+		"{ follower port } ...",
+		"Keep followers on the input, volume and channel of the -p TV."
+	},
+	{"fleet", CMD_FLEET,
+		"{ selector } [ command [arg ...] ]",
+		"Send a command to the inventory's TVs the selector picks, or list them."
+	},
+	{"simulate", CMD_SIMULATE,
+		"{ count } [ --tcp port ] [ --latency ms[/spread%] ] [ --faults err%[,drop%] ] [ --seed n ]",
+		"Play count TVs on ptys or TCP ports, listing them as an inventory."
+	},
+	{"slo", CMD_SLO,
+		"[ --watch ]",
+		"Show a running serve's reply times against its slo lines, or follow its alerts."
+	},
+#endif /* AQUOS_TINY */
+};
+
+/* One command/parameter pair on the wire, less the trailing CR. */
+struct frame {
+	char command[5];
+	char param[5];
+};
+
+/* A numeric setting for encodebulk(): vol 20, input 3, dchan 7.1, ... */
+struct bulkitem {
+	int opcode;
+	int value;
+	int sub;    /* dchan/dcabl1 subchannel, else unused */
+};
+
+/* How encodebulk() lays out each numeric opcode's parameter. */
+#define BULK_LEFT   0 /* "%-4d" */
+#define BULK_PAIR   1 /* "%02d%02d", value then sub */
+#define BULK_CABLE1 2 /* "%03d " twice: DC2U value, then DC2L sub */
+#define BULK_CABLE2 3 /* "%04d", DC10 below 10000 and DC11 above */
+
+static struct bulktab {
+	int  opcode;
+	char *command;
+	int  min, max;
+	int  style;
+} bulktab[] = {
+	{CMD_VOLUME, "VOLM", 0, 60,    BULK_LEFT},
+	{CMD_HPOS,   "HPOS", 0, 999,   BULK_LEFT},
+	{CMD_VPOS,   "VPOS", 0, 999,   BULK_LEFT},
+	{CMD_CLOCK,  "CLCK", 0, 180,   BULK_LEFT},
+	{CMD_PHASE,  "PHSE", 0, 40,    BULK_LEFT},
+#ifdef NEWER_PROTOCOL
+	{CMD_INPUT,  "IAVD", 1, 8,     BULK_LEFT},
+#else
+	{CMD_INPUT,  "IAVD", 1, 7,     BULK_LEFT},
+#endif
+	{CMD_ACHAN,  "DCCH", 1, 135,   BULK_LEFT},
+	{CMD_DCHAN,  "DA2P", 0, 99,    BULK_PAIR},
+	{CMD_DCABL1, "DC2U", 0, 999,   BULK_CABLE1},
+	{CMD_DCABL2, "DC10", 0, 16383, BULK_CABLE2},
+};
+
+/*
+ * Compiled scene file: a header followed by fixed size records holding
+ * the exact bytes to write, so play can mmap it and stream frames
+ * without parsing. Fields are in host byte order.
+ */
+#define SCENE_MAGIC   "AQSC"
+#define SCENE_VERSION 1
+
+#define EXPECT_OK   0 /* wait for OK */
+#define EXPECT_NONE 1 /* no response (CHUP, CHDW) */
+
+struct scenehdr {
+	char     magic[4];
+	uint16_t version;
+	uint16_t recsize;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct scenerec {
+	char     frame[9]; /* command, parameter and CR */
+	uint8_t  expect;
+	uint16_t line;     /* scene line, for error messages */
+	uint32_t gap;      /* microseconds to wait before the next frame */
+};
+
+/*
+ * Every keyword argument the TV commands take, one per line: the
+ * command, the frame it becomes, the protocol revisions that have it and
+ * what the TV answers. encodecommand() parses from this list, usage()
+ * and /commands print it and noreply() is built from it, so a word
+ * added here exists everywhere at once. A word of "" is the blank
+ * argument, "*" stands for any; a command's words stay together, and
+ * the first that matches wins.
+ */
+#define PROTO_OLD 1 /* 12/16/05 */
+#define PROTO_NEW 2 /* 12/17/10 */
+#define PROTO_ALL (PROTO_OLD | PROTO_NEW)
+#ifdef NEWER_PROTOCOL
+#define PROTO_THIS PROTO_NEW
+#else
+#define PROTO_THIS PROTO_OLD
+#endif
+
+#define WORDS(X) \
+	X(CMD_POENABLE, "RSPW", "on",           "1   ", ALL, OK)   \
+	X(CMD_POENABLE, "RSPW", "on-ip",        "2   ", NEW, OK)   \
+	X(CMD_POENABLE, "RSPW", "off",          "0   ", ALL, OK)   \
+	X(CMD_POWER,    "POWR", "on",           "1   ", ALL, OK)   \
+	X(CMD_POWER,    "POWR", "off",          "0   ", ALL, OK)   \
+	X(CMD_INPUT,    "ITGD", "",             "0   ", ALL, OK)   \
+	X(CMD_INPUT,    "ITVD", "tv",           "0   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "",             "0   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "standard",     "1   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "movie",        "2   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "game",         "3   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "user",         "4   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "dyn-fixed",    "5   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "dyn",          "6   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "pc",           "7   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "xvycc",        "8   ", ALL, OK)   \
+	X(CMD_AVMODE,   "AVMD", "standard-3d",  "14  ", NEW, OK)   \
+	X(CMD_AVMODE,   "AVMD", "movie-3d",     "15  ", NEW, OK)   \
+	X(CMD_AVMODE,   "AVMD", "game-3d",      "16  ", NEW, OK)   \
+	X(CMD_AVMODE,   "AVMD", "auto",         "100 ", NEW, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "",             "0   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "sidebar",      "1   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "sstretch",     "2   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "zoom",         "3   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "stretch",      "4   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "normal",       "5   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "zoom-pc",      "6   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "stretch-pc",   "7   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "dotbydot",     "8   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "full",         "9   ", ALL, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "auto",         "10  ", NEW, OK)   \
+	X(CMD_VIEWMODE, "WIDE", "original",     "11  ", NEW, OK)   \
+	X(CMD_MUTE,     "MUTE", "",             "0   ", ALL, OK)   \
+	X(CMD_MUTE,     "MUTE", "on",           "1   ", ALL, OK)   \
+	X(CMD_MUTE,     "MUTE", "off",          "2   ", ALL, OK)   \
+	X(CMD_SURROUND, "ACSU", "",             "0   ", ALL, OK)   \
+	X(CMD_SURROUND, "ACSU", "normal",       "1   ", NEW, OK)   \
+	X(CMD_SURROUND, "ACSU", "on",           "1   ", OLD, OK)   \
+	X(CMD_SURROUND, "ACSU", "off",          "2   ", ALL, OK)   \
+	X(CMD_SURROUND, "ACSU", "3d-hall",      "4   ", NEW, OK)   \
+	X(CMD_SURROUND, "ACSU", "3d-movie",     "5   ", NEW, OK)   \
+	X(CMD_SURROUND, "ACSU", "3d-standard",  "6   ", NEW, OK)   \
+	X(CMD_SURROUND, "ACSU", "3d-stadium",   "7   ", NEW, OK)   \
+	X(CMD_AUDIOSEL, "ACHA", "*",            "0   ", ALL, OK)   \
+	X(CMD_SLEEP,    "OFTM", "off",          "0   ", ALL, OK)   \
+	X(CMD_SLEEP,    "OFTM", "0",            "0   ", ALL, OK)   \
+	X(CMD_SLEEP,    "OFTM", "30",           "1   ", ALL, OK)   \
+	X(CMD_SLEEP,    "OFTM", "60",           "2   ", ALL, OK)   \
+	X(CMD_SLEEP,    "OFTM", "90",           "3   ", ALL, OK)   \
+	X(CMD_SLEEP,    "OFTM", "120",          "4   ", ALL, OK)   \
+	X(CMD_CHUP,     "CHUP", "*",            "0   ", ALL, NONE) \
+	X(CMD_CHDN,     "CHDW", "*",            "0   ", ALL, NONE) \
+	X(CMD_CC,       "CLCP", "*",            "0   ", ALL, OK)   \
+	X(CMD_3D,       "TDCH", "off",          "0   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "2d3d",         "1   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "sbs",          "2   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "tab",          "3   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "3d2d-sbs",     "4   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "3d2d-tab",     "5   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "3d-auto",      "6   ", NEW, OK)   \
+	X(CMD_3D,       "TDCH", "2d-auto",      "7   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "0",            "0   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "1",            "1   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "2",            "2   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "3",            "3   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "4",            "4   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "5",            "5   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "6",            "6   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "7",            "7   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "8",            "8   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "9",            "9   ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", ".",            "10  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "ent",          "11  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "enter",        "11  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "power",        "12  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "display",      "13  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "power-source", "14  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "rew",          "15  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "play",         "16  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "ff",           "17  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "pause",        "18  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "prev",         "19  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "stop",         "20  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "next",         "21  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "rec",          "22  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "option",       "23  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "sleep",        "24  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "cc",           "27  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "avmode",       "28  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "viewmode",     "29  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "flashback",    "30  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "mute",         "31  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "vol-",         "32  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "voldn",        "32  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "vol+",         "33  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "volup",        "33  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "chup",         "34  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "chdn",         "35  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "input",        "36  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "menu",         "38  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "startcenter",  "39  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "up",           "41  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "down",         "42  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "left",         "43  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "right",        "44  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "return",       "45  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "exit",         "46  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "fav",          "47  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "favorite",     "47  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "favoritech",   "47  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "3d-surround",  "48  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "audio",        "49  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "a",            "50  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "red",          "50  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "b",            "51  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "green",        "51  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "c",            "52  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "blue",         "52  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "d",            "53  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "yellow",       "53  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "freeze",       "54  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "favapp1",      "55  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "favapp2",      "56  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "favapp3",      "57  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "3d",           "58  ", NEW, OK)   \
+	X(CMD_BUTTON,   "RCKY", "netflix",      "59  ", NEW, OK)
+
+/* Checked as it compiles: a bad line is a build error, not a bad frame. */
+#define WORDCHECK(op, code, word, param, proto, expect)                   \
+	_Static_assert(op > CMD_NONE && op < CMD_LEARN &&                     \
+	               sizeof(code) == 5 && sizeof(param) == 5 &&             \
+	               sizeof(word) <= 16 && (PROTO_##proto & PROTO_ALL) != 0 && \
+	               (EXPECT_##expect == EXPECT_OK ||                       \
+	                EXPECT_##expect == EXPECT_NONE),                      \
+	               "bad protocol word " code " \"" word "\"");
+WORDS(WORDCHECK)
+
+static struct wordtab {
+	int  opcode;
+	char *code;
+	char *word;
+	char *param; /* padded to 4 */
+	int  proto;
+	int  expect;
+} wordtab[] = {
+#define WORDENTRY(op, code, word, param, proto, expect) \
+	{op, code, word, param, PROTO_##proto, EXPECT_##expect},
+	WORDS(WORDENTRY)
+};
+
+/* The codes the TV never answers, for noreply(). */
+#define NOREPLY_OK(code)
+#define NOREPLY_NONE(code) code,
+#define WORDNOREPLY(op, code, word, param, proto, expect) \
+	NOREPLY_##expect(code)
+static char *noreplytab[] = { WORDS(WORDNOREPLY) };
+
+#ifndef AQUOS_TINY
+/*
+ * Settings play --verify reads back, with the value the scene leaves
+ * each at and the record that set it. Tuning any channel code replaces
+ * the others, so they share a group; CHUP and CHDW step an analog one.
+ * DC2U and DC2L are the two halves of one cable channel: they are read
+ * back and sent again together.
+ */
+#define VERIFY_EACH   1 /* query after every frame that sets one */
+#define VERIFY_BATCH  2 /* query them all once, at the end */
+#define VERIFY_ROUNDS 3 /* of query and resend, at most */
+
+#define KEY_UNSET   0
+#define KEY_SET     1
+#define KEY_UNKNOWN 2 /* changed, but not to anything we can predict */
+
+static struct verifykey {
+	char *code;   /* sets it, and reads it back with "?   " */
+	int  group;
+	int  pair;    /* offset to the other half of the setting, or 0 */
+	int  state;
+	int  expect;
+	long rec;     /* record to send again, or -1 for code and expect */
+	int  line;
+} verifykeys[] = {
+	{ .code = "POWR", .group = 0 },
+	{ .code = "IAVD", .group = 1 },
+	{ .code = "VOLM", .group = 2 },
+	{ .code = "DCCH", .group = 3 },
+	{ .code = "DA2P", .group = 3 },
+	{ .code = "DC2U", .group = 3, .pair = 1 },
+	{ .code = "DC2L", .group = 3, .pair = -1 },
+	{ .code = "DC10", .group = 3 },
+	{ .code = "DC11", .group = 3 },
+};
+
+#define VERIFY_KEYS (sizeof(verifykeys) / sizeof(verifykeys[0]))
+
+int  verifyqueries = 0, verifyresent = 0;
+#endif /* AQUOS_TINY */
+
+/*
+ * A scene (or any command script) mapped for openscript()/scriptline().
+ * The text is mapped privately over a zeroed page, so fields can be cut
+ * in place and the last line is terminated even without a newline.
+ */
+#define SCRIPT_FIELDS 3 /* command and up to two args; more are ignored */
+
+struct script {
+	char   *text;
+	size_t size;     /* of the file */
+	size_t mapped;
+	char   *next;    /* where the next line starts */
+	int    line;
+};
+
+/*
+ * Ranges accepted by HPOS/VPOS/CLCK/PHSE depend on the model, View Mode
+ * and input signal, so they are learned from the TV's OK/ERR responses
+ * and kept in the state directory. lo_bad/hi_bad are the closest
+ * rejected values seen (or the static limits), lo_ok/hi_ok the widest
+ * accepted ones (-1 if nothing has been accepted yet).
+ */
+struct range {
+	char model[32];
+	char view[8];
+	char signal[8];
+	char cmd[5];
+	int  lo_ok, hi_ok;
+	int  lo_bad, hi_bad;
+};
+
+#ifndef AQUOS_TINY
+static struct rangetab {
+	char *cmd; int min, max;
+} rangetab[] = {
+	{"HPOS", 0, 999},
+	{"VPOS", 0, 999},
+	{"CLCK", 0, 180},
+	{"PHSE", 0, 40},
+};
+#endif
+
+struct latency {
+	char     command[5];
+	uint32_t total;     /* samples in count[] */
+	uint32_t timeouts;
+	uint32_t count[LAT_BUCKETS];
+};
+
+/* An slo line: the percentile'th reply time to code stays under ms. */
+struct slotarget {
+	char   code[5];    /* "*" for every opcode */
+	double percentile;
+	int    ms;
+	int    port;       /* the line named this port */
+};
+
+/*
+ * Settings from the config file in the state directory, "key value" per
+ * line. Times are in milliseconds.
+ */
+struct config {
+	double timeout_percentile; /* latency percentile the deadline is based on */
+	double timeout_factor;     /* safety factor applied to it */
+	int    timeout_floor;
+	int    timeout_ceiling;
+	int    timeout_default;    /* until timeout_samples replies are seen */
+	int    timeout_samples;
+	int    latency_window;     /* samples kept before old ones are halved */
+	double health_alpha;       /* EWMA weight of each new frame */
+	int    health_latency;     /* reply time that starts to cost score */
+	double health_degrade;     /* score below which a port degrades */
+	double health_recover;     /* score above which it recovers */
+	int    health_gap;         /* extra gap between frames per level */
+	int    lock_timeout;       /* longest wait for the port */
+	char   lock_dir[PATH_MAX];
+	char   broker_socket[PATH_MAX];
+	char   log[PATH_MAX];  /* stderr, syslog or a file name */
+	int    realtime_priority; /* SCHED_FIFO priority with --realtime */
+	char   http_listen[64];   /* serve's [addr:]port */
+	char   http_token[64];    /* commands need it; "" takes X-Aquosctl */
+	char   mqtt_server[256];  /* broker host[:port] for serve */
+	char   mqtt_prefix[64];   /* topics are <prefix>/<name>/... */
+	char   mqtt_name[64];     /* defaults to the port's file name */
+	int    mqtt_keepalive;    /* seconds */
+	int    mqtt_metrics;      /* ms between metrics publishes */
+	int    window;            /* most frames in flight; 1 is stop-and-wait */
+	char   admin_socket[108]; /* serve's; "" for one in the state directory */
+	int    slo_window;        /* reply times judged against slo lines */
+	int    nslo;
+	struct slotarget slo[SLO_TARGETS];
+} cfg = {
+	99.0, 1.5, 20, 10000, 1000, 16, 1000,
+	0.1, 250, 60.0, 80.0, 100,
+	30000, LOCK_DIR, BROKER_SOCKET, "stderr", 50, HTTP_LISTEN, "",
+	"", MQTT_PREFIX, "", 60, 10000, 1, "", SLO_WINDOW, 0, {{"", 0, 0, 0}}
+};
+
+struct config cfgdefaults; /* cfg before the config file, for reloads */
+
+#ifndef AQUOS_TINY
+/* Config file keys, so a reload can tell what it changed. */
+#define CFGKEY(key, field) \
+	{ key, offsetof(struct config, field), sizeof(((struct config *) 0)->field) }
+
+static struct cfgkey {
+	char   *key;
+	size_t offset, size;
+} cfgkeys[] = {
+	CFGKEY("timeout-percentile", timeout_percentile),
+	CFGKEY("timeout-factor",     timeout_factor),
+	CFGKEY("timeout-floor",      timeout_floor),
+	CFGKEY("timeout-ceiling",    timeout_ceiling),
+	CFGKEY("timeout-default",    timeout_default),
+	CFGKEY("timeout-samples",    timeout_samples),
+	CFGKEY("latency-window",     latency_window),
+	CFGKEY("health-alpha",       health_alpha),
+	CFGKEY("health-latency",     health_latency),
+	CFGKEY("health-degrade",     health_degrade),
+	CFGKEY("health-recover",     health_recover),
+	CFGKEY("health-gap",         health_gap),
+	CFGKEY("lock-timeout",       lock_timeout),
+	CFGKEY("lock-dir",           lock_dir),
+	CFGKEY("broker-socket",      broker_socket),
+	CFGKEY("log",                log),
+	CFGKEY("realtime-priority",  realtime_priority),
+	CFGKEY("http-listen",        http_listen),
+	CFGKEY("http-token",         http_token),
+	CFGKEY("mqtt-server",        mqtt_server),
+	CFGKEY("mqtt-prefix",        mqtt_prefix),
+	CFGKEY("mqtt-name",          mqtt_name),
+	CFGKEY("mqtt-keepalive",     mqtt_keepalive),
+	CFGKEY("mqtt-metrics",       mqtt_metrics),
+	CFGKEY("window",             window),
+	CFGKEY("admin-socket",       admin_socket),
+	CFGKEY("slo-window",         slo_window),
+	CFGKEY("slo",                slo),
+};
+#endif /* AQUOS_TINY */
+
+/* A run's worth of timings, bucketed as for latencies (latencybucket()). */
+struct timings {
+	uint32_t  total;
+	long long worst;
+	uint32_t  count[LAT_BUCKETS];
+};
+
+struct timings jitter; /* how late timed writes started */
+
+long long writedue = 0;  /* monotime() the next frame is due, 0 for now */
+
+/* A frame queued for the port engine; done() gets the reply. */
+struct job {
+	char       frame[10]; /* command and param; the CR is added on write */
+	long long  queued;
+	long long  sent;
+	int        timeout;   /* ms the TV has once it gets to this frame */
+	int        resync;
+	int        piped;     /* written with others still in flight */
+	void       (*done)(struct job *, int, char *);
+	void       *owner;
+	int        index;     /* frame number within the owner's command */
+	struct job *next;
+};
+
+struct engine {
+	struct job    *head, *tail; /* waiting */
+	struct job    *first, *last; /* written, replies pending, oldest first */
+	int           queued, inflight;
+	int           window;       /* frames allowed in flight now */
+	int           oks;          /* replies since the window last changed */
+	long long     ready;        /* no write before this (health gap) */
+	long long     since;        /* last reply; the TV answers in order */
+	char          reply[256];
+	int           replylen;
+	unsigned long frames, errors, timeouts;
+	struct timings wire;        /* queued to written */
+	struct timings turn;        /* TV's turn at a frame to its reply */
+	struct {
+		char      code[4];
+		long long ns;
+	}             settled[WINDOW_MAX]; /* for slorecord(), see slosettled() */
+	int           nsettled;
+} engine;
+
+/*
+ * mirror: settings read from the master and set on the followers, each
+ * with how its value is written.
+ */
+static struct mirrorkey {
+	char *code;
+	char *format;
+} mirrorkeys[] = {
+	{"IAVD", "%-4d"}, {"VOLM", "%-4d"}, {"DCCH", "%-4d"}, {"DA2P", "%04d"},
+};
+
+#define MIRROR_KEYS (sizeof(mirrorkeys) / sizeof(mirrorkeys[0]))
+
+/* A mirrored TV, with at most one frame out at a time. */
+struct mirrorport {
+	char      *name;
+	int       fd;
+	char      frame[10];         /* written, not yet answered; "" if idle */
+	int       key;               /* frame's mirrorkeys index */
+	unsigned  framegen;          /* and the change it was written for */
+	long long sent;
+	char      in[64];
+	int       inlen;
+	int       value[MIRROR_KEYS]; /* last read or set; -1 if unknown */
+	int       want[MIRROR_KEYS];  /* master's, still to set; -1 if none */
+	int       tries[MIRROR_KEYS]; /* the master's: rounds left to skip */
+	unsigned  gen[MIRROR_KEYS];   /* the change want belongs to */
+};
+
+/*
+ * The fleet: every TV's port, and for each tag (a word such as
+ * "maintenance", or "floor=3") the set of TVs that have it, one bit per
+ * TV in inventory order. Selectors are compiled to postfix fleetops and
+ * evaluated over whole sets, 64 TVs a word.
+ */
+struct fleet {
+	int      count, alloc; /* TVs, and room in each set */
+	char     **ports;
+	char     **tagtext;    /* each TV's tags as written */
+	char     **tags;       /* hashsize slots, kept at most half full */
+	uint64_t **bits;
+	int      ntags, hashsize;
+	uint64_t *stack;       /* FLEET_DEPTH sets for resolveselector() */
+};
+
+#define FLEET_TAG  0 /* push a tag's set */
+#define FLEET_NONE 1 /* push an empty set (a tag no TV has) */
+#define FLEET_ALL  2
+#define FLEET_NOT  3
+#define FLEET_AND  4
+#define FLEET_OR   5
+
+struct fleetop {
+	int op;
+	int tag; /* slot in tags, for FLEET_TAG */
+};
+
+/*
+ * A TV handle for threaded programs (aquos.h). Submitters claim a slot
+ * of the ring by advancing head with a compare-and-swap, fill it and
+ * publish it through the slot's seq, so they never wait on each other;
+ * the handle's thread alone takes slots at tail and touches the port.
+ * seq is the position a slot is free for, and that plus one once it is
+ * filled.
+ */
+struct aquosslot {
+	_Atomic unsigned long seq;
+	char                  frame[10];
+	aquosdone             done;
+	void                  *arg;
+	long long             queued, sent;
+};
+
+struct aquos {
+	_Alignas(64) _Atomic unsigned long head;
+	_Alignas(64) unsigned long tail;
+	_Atomic int           sleeping; /* the thread may be in poll() */
+	_Atomic int           closing;
+	int                   fd, lock;
+	int                   window;
+	int                   wake;     /* eventfd: a frame queued, or closing */
+	int                   events;   /* eventfd: completions, see aquosfd() */
+	pthread_t             thread;
+	struct aquosslot      slot[AQUOS_RING];
+};
+
+/* A change on the master, on its way to the followers. */
+struct mirrorchange {
+	int       from, to;       /* from is -1 for the first read */
+	long long before;         /* master's last read showing from */
+	long long seen;           /* and the one showing to */
+	int       pending, set, matched, failed;
+	unsigned  gen;            /* bumped by each change */
+};
+
+/*
+ * simulate: the TV codes a simulated TV takes, their limits and the
+ * value a new TV starts at; -1 marks codes that only act (toggles,
+ * remote keys) and can't be read back.
+ */
+static struct simcode {
+	char *code;
+	int  min, max, initial;
+} simcodes[] = {
+	{"POWR", 0, 1,    1},   {"RSPW", 0, 2,    0},   {"ITGD", 0, 0,    -1},
+	{"ITVD", 0, 0,    -1},  {"IAVD", 1, 8,    1},   {"AVMD", 0, 100,  1},
+	{"VOLM", 0, 60,   20},  {"HPOS", 0, 999,  30},  {"VPOS", 0, 999,  20},
+	{"CLCK", 0, 180,  90},  {"PHSE", 0, 40,   20},  {"WIDE", 0, 10,   1},
+	{"MUTE", 0, 2,    2},   {"ACSU", 0, 7,    0},   {"ACHA", 0, 0,    -1},
+	{"OFTM", 0, 4,    0},   {"DCCH", 1, 135,  5},   {"DA2P", 0, 9999, 101},
+	{"DC2U", 0, 999,  1},   {"DC2L", 0, 999,  0},   {"DC10", 0, 9999, 0},
+	{"DC11", 0, 6383, 0},   {"CLCP", 0, 0,    -1},  {"TDCH", 0, 7,    0},
+	{"RCKY", 0, 59,   -1},
+};
+
+#define SIM_CODES (sizeof(simcodes) / sizeof(simcodes[0]))
+
+/* A simulated TV, behind a pty or a loopback TCP listener. */
+struct simtv {
+	int       fd;              /* pty master, or listener */
+	int       slave;           /* held so the master never hangs up; -1 */
+	uint32_t  turn;            /* us from a frame to its reply, typically */
+	uint16_t  err, drop;       /* chances in 65536 a frame gets ERR, or nothing */
+	long long busy;            /* until its last reply is due */
+	int       value[SIM_CODES];
+};
+
+/* A stream of frames to a TV: its pty, or one TCP connection to it. */
+struct simline {
+	int      fd;               /* -1 if free */
+	int      tv;
+	uint32_t gen;              /* bumped on close; stale replies are dropped */
+	char     in[32];
+	int      inlen;
+};
+
+/* A reply held until its TV's turn at the frame is over. */
+struct simreply {
+	long long due;
+	int       line;
+	uint32_t  gen;
+	char      text[8];
+};
+
+struct sim {
+	struct simtv    *tvs;
+	int             ntvs;
+	struct simline  *lines;
+	int             nlines, linesize, *spare, nspare;
+	struct simreply *heap;     /* soonest first */
+	int             nheap, heapsize;
+	int             epoll;
+	uint64_t        rng;
+	unsigned long   frames, replies, errors, drops, connections;
+	struct timings  late;      /* replies written after they were due */
+} sim;
+
+/*
+ * An HTTP request and, once its frames are back, its response. Requests
+ * on a connection are answered in the order they came (pipelining).
+ */
+struct httpreq {
+	struct httpconn *conn;   /* NULL once the client has gone */
+	struct httpreq  *next;
+	char            method[8], target[256], name[16];
+	int             http10, close, query, done, status, pending, nframes;
+	int             hostok;  /* Host named the address we listen on */
+	int             allowed; /* may send commands: token, or X-Aquosctl */
+	struct frame    frames[MAX_FRAMES];
+	struct job      jobs[MAX_FRAMES];
+	int             resp[MAX_FRAMES];
+	char            reply[MAX_FRAMES][32];
+	double          ms[MAX_FRAMES];
+	char            body[HTTP_BODY];
+};
+
+struct httpconn {
+	int             fd, inlen, outlen, nreq, closing;
+	struct httpreq  *head, *tail;
+	char            in[8192];
+	char            out[HTTP_BODY * 4];
+};
+
+struct httpconn *httpconns[HTTP_CLIENTS];
+int  nhttp = 0;
+int  httpfd = -1;
+struct sockaddr_in httpbound; /* what httpfd listens on */
+volatile sig_atomic_t serving_stopped = 0;
+
+/*
+ * A config reload in serve: read and checked on its own thread, then
+ * published through reloaded for the serve loop to swap in.
+ */
+struct reload {
+	struct config cfg;
+	char          path[PATH_MAX];
+	char          error[256];   /* the first bad line */
+	int           errors;
+	long long     started, parsed;
+};
+
+_Atomic(struct reload *) reloaded = NULL;
+volatile sig_atomic_t reload_wanted = 0;
+int  reloading = 0;
+int  reloadpipe[2] = { -1, -1 };  /* wakes the serve loop */
+int  adminfd = -1;                /* serve's admin socket */
+int  adminclient = -1;            /* waiting for its reload's result */
+long long admindue = 0;           /* when it goes if its line isn't in */
+char adminline[64];               /* what it has sent so far */
+int  adminlen = 0;
+int  frontends_fixed = 0;         /* serve named them; reloads leave them */
+
+/* An MQTT command or query, with its frames at the port. */
+struct mqttcmd {
+	char         name[16], args[64], reply[32];
+	int          query, nframes, pending, session;
+	struct frame frames[MAX_FRAMES];
+	struct job   jobs[MAX_FRAMES];
+	int          resp[MAX_FRAMES];
+	double       ms;
+};
+
+struct mqtt {
+	int           fd, state;
+	int           session;      /* bumped on each disconnect */
+	char          server[256];
+	struct addrinfo *ai;        /* server, resolved by mqttstart() */
+	char          base[128];    /* <prefix>/<name> */
+	char          in[MQTT_BUFFER], out[MQTT_BUFFER];
+	int           inlen, outlen;
+	unsigned int  qos2[MQTT_QOS2]; /* ids run, PUBREL not yet seen */
+	int           nqos2;
+	long long     retry, metrics, lastsent;
+	long long     pingsent;     /* PINGREQ awaiting its PINGRESP, or 0 */
+	unsigned long received, published, packets, writes, dropped;
+} mqtt;
+unsigned long requests = 0;
+
+/*
+ * A thread's log ring. Only the owning thread moves head and only the
+ * writer moves tail, so neither side takes a lock; a full ring drops
+ * the record and counts it rather than waiting for the writer.
+ */
+struct logrec {
+	long long when; /* CLOCK_REALTIME, ns */
+	int       len;
+	char      text[LOG_TEXT];
+};
+
+struct logring {
+	_Alignas(64) _Atomic unsigned int head;
+	unsigned int          tailseen; /* owner's last look at tail */
+	_Alignas(64) _Atomic unsigned int tail;
+	_Atomic unsigned long dropped;
+	unsigned long         reported; /* drops the writer has logged */
+	struct logring        *next;
+	struct logrec         slot[LOG_SLOTS];
+};
+
+_Atomic(struct logring *) logrings = NULL;
+__thread struct logring *logown = NULL;
+pthread_once_t logonce = PTHREAD_ONCE_INIT;
+pthread_t logthread;
+int  logstarted = 0;
+_Atomic int logstopping = 0;
+_Atomic int logsleeping = 0; /* the writer is waiting on logevent */
+int  logevent = -1;          /* eventfd that wakes the writer */
+_Atomic int logdest = LOGTO_STDERR;
+_Atomic int logfd = STDERR_FILENO;
+
+/*
+ * Per-port link health: EWMAs over frames of reply time (ms) and of the
+ * rates of timeouts, ERRs and resyncs (input flushed after a late or
+ * garbled reply). A port whose score drops below health_degrade steps
+ * up a degraded level, adding health_gap between frames per level;
+ * once clean it steps back down one level at a time.
+ */
+struct health {
+	double latency;
+	double timeouts;
+	double errors;
+	double resyncs;
+	double score;   /* 0-100 */
+	int    level;   /* 0 is normal */
+	int    settle;  /* frames since the level last changed */
+} health = {
+	0, 0, 0, 0, 100, 0, 0
+};
+
+/*
+ * serve's watch on reply times, per opcode: a window of SLO_SLICES
+ * histograms, with sum[] the whole of it so a percentile is one pass,
+ * and a two-sided CUSUM of bucket numbers (quarter octaves, so a ratio
+ * and not a difference) against a slowly learned baseline. The CUSUM
+ * flags a step within tens of replies, long before it shows in a
+ * window's percentile.
+ */
+struct slocode {
+	char          code[5];
+	uint32_t      slice[SLO_SLICES][LAT_BUCKETS];
+	uint32_t      sum[LAT_BUCKETS];
+	uint32_t      total;
+	unsigned long seen;        /* since the baseline was last (re)learned */
+	double        mean, dev;   /* baseline and its mean deviation, buckets */
+	double        up, down;    /* CUSUM sums */
+	double        upsum, downsum; /* of the buckets since each left 0 */
+	int           uplen, downlen;
+	double        from, to;    /* a flagged shift's levels */
+	int           shifted;     /* +1 or -1 until slotick() reports it */
+	unsigned char over[SLO_TARGETS]; /* per cfg.slo line: in breach */
 };
 
+struct slo {
+	struct slocode codes[SLO_CODES];
+	int            ncodes;
+	int            slice;      /* being filled */
+	long long      rotate;     /* when the next slice starts */
+	int            flagged;    /* a shift awaits slotick() */
+	unsigned long  untracked;  /* replies to opcodes past SLO_CODES */
+	unsigned long  alerts;
+} slo;
+
+int  watchers[ADMIN_WATCHERS]; /* admin clients following alerts */
+int  nwatchers = 0;
+
+int  healthloaded = 0;
+int  healthdirty = 0;
+long long lastframe = 0; /* when the last reply (or timeout) came */
+int  probing = 0;        /* ERRs are expected (learn, sweep) */
+
+int  lockfd = -1;        /* held (flock) while we own the port */
+int  ticketfd = -1;
+long ticket = -1;
+
+struct latency latency[MAX_LATENCY];
+int  nlatency = 0;
+int  latencyloaded = 0;
+int  latencydirty = 0;
+int  stale = 0; /* a reply timed out and may turn up late */
+int  rawfailed = 0; /* a frame raw queued failed (see rawok()) */
+
+struct range ranges[MAX_RANGES];
+int  nranges = 0;
+int  rangesloaded = 0;
+char ctxview[8] = "?";   /* View Mode (WIDE) last set or queried. */
+char ctxsignal[8] = "?"; /* Input last set or queried. */
+
 int fd;
 int nosend = 0;
 int verbose = 0;
+int clamp = 0;
+char model[32] = "any";
+char portname[256] = DEFAULT_PORT;
 
 /* Prototypes */
 void openport(char []);
+int  portopen(char []);
+int  encodecommand(char [], int, char [], char [], char [], struct frame *);
+void addframe(struct frame *, int *, char [], char []);
+struct wordtab *findwords(int, int *);
+char *cmdargs(int);
+struct bulktab *findbulk(int);
+long encodebulk(struct bulkitem *, int, char [], size_t, int *);
+void noteframe(struct frame *, int);
 int  sendcommand(char [], char []);
+int  transact(char [], char [], char [], int, int);
+int  settlereply(char [], char [], char [], long long, int, int, int, int);
+void loadconfig(void);
+int  parseconfig(char [], struct config *, char [], size_t);
+struct latency *findlatency(char [], int);
+void loadlatency(void);
+void savelatency(void);
+int  latencybucket(long long);
+long long bucketlimit(int);
+int  bucketpercentile(uint32_t *, uint32_t, double);
+void recordlatency(char [], long long, int);
+int  replytimeout(char []);
+void loadhealth(void);
+void savehealth(void);
+void recordhealth(int, long long, int);
+int  showhealth(void);
+void setupport(int);
+int  openlock(char [], char [], int);
+int  trustedpeer(int);
+int  brokerclient(char []);
+int  broker(char [], int, char *[]);
+int  claimport(char [], char [], int *);
+int  mirror(char [], int, char *[]);
+void mirrornext(struct mirrorport *, int);
+void mirrorreply(struct mirrorport *, int, char [], struct mirrorport [], int);
+void mirrorsettled(int, struct mirrorchange *);
+int  loadfleet(char [], struct fleet *);
+int  fleetadd(struct fleet *, char [], char []);
+int  fleettag(struct fleet *, char [], int);
+int  fleetgrow(struct fleet *);
+uint32_t fleethash(char []);
+int  compileselector(struct fleet *, char [], struct fleetop [], char [],
+         size_t);
+int  selectorlevel(struct fleet *, char **, struct fleetop [], int *, int *,
+         int, int);
+int  resolveselector(struct fleet *, struct fleetop [], int, uint64_t []);
+int  fleet(char [], int, char *[]);
+int  fleetsend(char [], char *[], int, struct frame [], int);
+int  simulate(char [], int, char *[]);
+int  simopen(char [], struct simtv *, int, int, char [], int);
+int  simaddline(int, int);
+void simdropline(int);
+void simread(int);
+int  simframe(struct simtv *, char [], char []);
+int  simcode(char []);
+struct aquos *aquosattach(int, int);
+void *aquosthread(void *);
+int  aquostake(struct aquos *, struct aquosslot *);
+int  aquosready(struct aquos *);
+void aquosfinish(struct aquosslot *, int, char *);
+uint32_t simrandom(void);
+void simpush(struct simreply *);
+void simpop(struct simreply *);
+void lockport(char []);
+void unlockport(void);
+int  readtickets(long *, long *);
+void writetickets(long, long);
+int  querycommand(char [], char [], int);
+int  readreply(char [], int, int);
+long long monotime(void);
+void sleepuntil(long long);
+long long parsetime(char []);
+int  sweep(char [], int, char *[]);
+int  survey(char [], int, char *[]);
+void histogram(char [], double *, int);
+int  cmpdouble(const void *, const void *);
+int  openscript(char [], struct script *);
+void *readscript(int, struct script *);
+int  scriptline(struct script *, char *[], int []);
+void closescript(struct script *);
+int  compilescene(char [], int, char *[]);
+int  playscene(char [], int, char *[]);
+void verifystart(struct scenerec *, uint32_t);
+int  verifynote(struct scenerec *, long);
+int  verifycheck(char [], char [], struct scenerec *, int);
+int  noreply(char []);
+int  badframe(char []);
+int  rawok(char [], int);
+int  rawframe(char [], char []);
+int  rawqueue(char [], char []);
+void rawdone(struct job *, int, char *);
+ssize_t rawinput(char [], size_t);
+int  raw(char [], int, char *[]);
+void restoretty(void);
 int  checkcmd(char []);
+char *statepath(char []);
+FILE *statebegin(char [], char [], size_t, int *);
+void statecommit(FILE *, char [], char [], int);
+void loadcontext(void);
+void savecontext(void);
+void setcontext(char [], char []);
+struct range *findrange(char [], int);
+void loadranges(void);
+void saveranges(void);
+int  checkrange(char [], char [], char []);
+void recordrange(char [], int, int);
+int  proberange(char [], int, int *);
+int  learnrange(char [], char []);
+void logopen(char []);
+void logmsg(const char *, ...) __attribute__((format(printf, 1, 2)));
+struct logring *logring(void);
+void logstart(void);
+void *logwriter(void *);
+void logwake(void);
+int  logdrain(void);
+void logstop(void);
+int  bench(char [], int, char *[]);
+void benchlog(void);
+void realtime(char [], int);
+long long parseat(char []);
+void awaitdue(void);
+void addtiming(struct timings *, long long);
+long long timingpercentile(struct timings *, double);
+void showjitter(void);
+void benchjitter(void);
+void submitjob(struct job *);
+int  enginepoll(struct pollfd *);
+int  enginecansend(void);
+long long jobdeadline(struct job *);
+void enginerun(int);
+void enginereplies(void);
+void enginewindow(int, int);
+void enginedrain(int);
+int  serve(char [], int, char *[]);
+void stopserving(int);
+void wantreload(int);
+void reloadstart(void);
+void *reloadthread(void *);
+void reloadapply(char []);
+void adminpath(char [], size_t);
+int  adminlisten(char []);
+void adminrun(int);
+int  adminwatchpoll(struct pollfd *);
+void adminwatch(struct pollfd *);
+void adminreply(char []);
+int  adminconnect(char []);
+int  slowatch(char [], int, char **);
+char *sloline(struct config *, char []);
+void slorecord(char [], long long);
+void slosettled(void);
+void slotick(long long);
+void sloalert(const char *, ...) __attribute__((format(printf, 1, 2)));
+void sloreport(int);
+int  reload(char []);
+int  httpaddr(char [], struct sockaddr_in *);
+int  httplisten(char [], char []);
+int  httploopback(struct sockaddr_in *);
+int  httphost(char []);
+int  httpconnect(char []);
+void httpaccept(void);
+int  httppoll(struct pollfd *);
+void httprun(struct pollfd *);
+void httpparse(struct httpconn *);
+void httpdispatch(struct httpreq *);
+void httpdone(struct job *, int, char *);
+void httpstatus(struct httpreq *);
+void httpcommands(struct httpreq *);
+int  jsonescape(char [], int, char []);
+void httpfinish(struct httpreq *, int, char []);
+void httpanswer(struct httpconn *, int, char []);
+int  httpflush(struct httpconn *);
+void httpclose(struct httpconn *);
+int  mqttstart(char []);
+int  mqttpoll(struct pollfd *);
+void mqttconnect(void);
+void mqttrun(int);
+void mqttflush(void);
+void mqttdrop(void);
+int  mqttbytes(char [], int);
+int  mqttheader(char [], int, int);
+int  mqttstring(char [], char [], int);
+void mqttconnectpacket(char []);
+void mqttpublish(char [], char [], int, int);
+int  mqttparse(void);
+void mqttmessage(char [], char [], int);
+void mqttdone(struct job *, int, char *);
+void mqttresult(struct mqttcmd *, char []);
+void mqttstate(struct mqttcmd *);
+void mqttmetrics(void);
+void benchhttp(void);
+void benchwindow(void);
+void benchencode(void);
+void benchparse(void);
+void benchscript(void);
+void benchfleet(void);
+void benchsubmit(void);
+void benchslo(void);
+void *benchproducer(void *);
+void *benchresponder(void *);
+void benchdone(struct job *, int, char *);
+int  globalwords(int, char *[], int, const char *, const struct option *);
+void globalsfirst(int, char *[], const char *, const struct option *);
 void usage(char []);
 void leave(int);
 
+#ifdef AQUOS_TINY
+/*
+ * The embedded build (make aquosctl-tiny) keeps only the TV command
+ * table and the path that sends it. The state directory, ranges,
+ * latency and health files, the port lock and the extended commands
+ * compile away to these no-ops, and the handful of stdio calls left go
+ * through tinyprintf() and friends straight to write(2), so a static
+ * link pulls in no stdio of its own.
+ */
+#define loadconfig()
+#define logopen(p)
+#define loadhealth()
+#define lockport(p)
+#define brokerclient(p)         (-1)
+#define noteframe(f, r)         ((void) (r))
+#define checkrange(p, c, a)     EXIT_SUCCESS
+#define replytimeout(c)         cfg.timeout_default
+#define recordlatency(c, ns, t)
+#define recordhealth(r, ns, s)
+#define sleepuntil(t)
+#define awaitdue()
+#define realtime(p, c)          ((void) (c))
+#define parseat(s)              (-1LL)
+
+#undef stdout
+#undef stderr
+#define stdout                  1
+#define stderr                  2
+#define printf(...)             tinyprintf(1, __VA_ARGS__)
+#define fprintf                 tinyprintf
+#define sprintf(b, ...)         tinysnprintf(b, INT_MAX, __VA_ARGS__)
+#define snprintf                tinysnprintf
+#define puts(s)                 tinyprintf(1, "%s\n", s)
+#define sscanf                  tinysscanf
+#define getopt_long(c, v, o, l, i) tinygetopt(c, v, o)
+#define optarg                  tinyoptarg
+#define optind                  tinyoptind
+
+int  tinyformat(char [], size_t, const char *, va_list);
+int  tinyprintf(int, const char *, ...);
+int  tinysnprintf(char [], size_t, const char *, ...);
+int  tinysscanf(const char *, const char *, ...);
+int  tinygetopt(int, char *[], const char *);
+#endif /* AQUOS_TINY */
+
+#ifndef AQUOS_LIBRARY
 int
 main (
 int  argc,
@@ -199,25 +1470,51 @@ int  argc,
 {
 	extern char *optarg;
 	extern int  optind;
+	struct frame frames[MAX_FRAMES];
 	int         ch = 0,
-	            chan = 0,
-	            subchan = 0;
-	char        cmd[5] = "",
-	            param[5] = "",
-	            *progname = argv[0],
+	            wait = -1,
+	            rt = 0,
+	            rtcpu = -1,
+	            opcode,
+	            i, n;
+	char        *progname = argv[0],
 	            oparg[16] = "",
 	            arg[16] = "",
 	            arg2[16] = "",
-	            port[32] = DEFAULT_PORT;
-
-	(void) signal(SIGALRM, leave);
+	            port[256] = DEFAULT_PORT,
+	            *log = NULL,
+	            *at = NULL;
+#ifndef AQUOS_TINY
+	static struct option longopts[] = {
+		{"realtime", optional_argument, NULL, 'R'},
+		{"at",       required_argument, NULL, 'A'},
+		{NULL,       0,                 NULL, 0}
+	};
+#endif
 
 	if (argc == 1) {
 		usage(progname);
 	}
 
-	while ((ch = getopt(argc, argv, "vhnp:")) != -1) {
+	/*
+	 * Global options may come anywhere on the line, as they always
+	 * could; they are moved ahead of the command and the rest (sweep's
+	 * --step, compile's -o) is left for the command to parse itself.
+	 */
+#ifndef AQUOS_TINY
+	globalsfirst(argc, argv, "cm:vhnp:w:L:", longopts);
+#else
+	globalsfirst(argc, argv, "cm:vhnp:w:L:", NULL);
+#endif
+	while ((ch = getopt_long(argc, argv, "+cm:vhnp:w:L:", longopts,
+	                         NULL)) != -1) {
 		switch(ch) {
+			case 'c':
+				clamp = 1; /* clamp to learned ranges instead of failing */
+				break;
+			case 'm':
+				snprintf(model, sizeof(model), "%s", optarg);
+				break;
 			case 'n':
 				nosend = 1; /* for debugging protocol formatting */
 				break;
@@ -229,7 +1526,20 @@ int  argc,
 					fprintf(stderr,"no port specified\n");
 					usage(progname);
 				}
-				strcpy(port, optarg);
+				snprintf(port, sizeof(port), "%s", optarg);
+				break;
+			case 'w':
+				wait = atoi(optarg); /* ms to wait for a busy port */
+				break;
+			case 'L':
+				log = optarg; /* where verbose logging goes */
+				break;
+			case 'R':
+				rt = 1; /* lock memory, SCHED_FIFO, optionally pin */
+				if (optarg != NULL) rtcpu = atoi(optarg);
+				break;
+			case 'A':
+				at = optarg; /* when the first frame goes out */
 				break;
 
 			case 'h':
@@ -239,56 +1549,63 @@ int  argc,
 	}
 	argc -= optind;
 	argv += optind;
+	snprintf(portname, sizeof(portname), "%s", port);
+	loadconfig();
+	if (wait >= 0) cfg.lock_timeout = wait;
+	if (log != NULL) snprintf(cfg.log, sizeof(cfg.log), "%s", log);
+	logopen(progname);
 
-    if (verbose == 1) printf("port=%s\n", port);
+	if (verbose == 1) logmsg("port=%s", port);
 /*
 	printf("argc=%d\n", argc);
 	printf("argv[0]=%s\n", argv[0]);
 	printf("argv[1]=%s\n", argv[1]);
 */
 
-	if (argc >= 1) strcpy(oparg, argv[0]);
-	if (argc >= 2) strcpy(arg, argv[1]);
-	if (argc >= 3) strcpy(arg2, argv[2]);
+	/* Longer arguments (file names) are taken from argv directly. */
+	if (argc >= 1) snprintf(oparg, sizeof(oparg), "%s", argv[0]);
+	if (argc >= 2) snprintf(arg, sizeof(arg), "%s", argv[1]);
+	if (argc >= 3) snprintf(arg2, sizeof(arg2), "%s", argv[2]);
+
+	opcode = checkcmd(oparg);
+
+	if (nosend == 0 && opcode != CMD_COMPILE && opcode != CMD_HEALTH &&
+	    opcode != CMD_BROKER && opcode != CMD_BENCH && opcode != CMD_RELOAD &&
+	    opcode != CMD_FLEET && opcode != CMD_SIMULATE && opcode != CMD_SLO) {
+		openport(port);
+	}
 
-	if (nosend == 0) openport(port);
+	if (rt == 1) realtime(progname, rtcpu);
+	if (at != NULL && (writedue = parseat(at)) < 0) {
+		fprintf(stderr, "%s: bad time '%s' (HH:MM[:SS.sss] ahead, or +delay)\n",
+			progname, at);
+		return(EXIT_FAILURE);
+	}
 
-	switch(checkcmd(oparg)) {
+	switch(opcode) {
 		case CMD_NONE:
 			fprintf(stderr, "%s: bad command '%s'\n", progname, oparg);
 			return(EXIT_FAILURE);
 			break;
 
-		case CMD_POENABLE:
-			if (strcmp(arg, "off") == 0) {
-				sprintf(param, "%-4s", "0"); /* Disable power on cmd */
-			}
-			else if (strcmp(arg, "on") == 0) {
-				sprintf(param, "%-4s", "1"); /* Enable power on cmd */
+#ifndef AQUOS_TINY
+		case CMD_LEARN:
+			if (nosend == 1) {
+				fprintf(stderr, "%s: learn needs the TV; can't use -n.\n",
+					progname);
+				return(EXIT_FAILURE);
 			}
-#ifdef NEWER_PROTOCOL
-			else if (strcmp(arg, "on-ip") == 0) {
-				sprintf(param, "%-4s", "2"); /* Enable power on cmd */
+			if (strcmp(arg, "hpos") == 0) {
+				return(learnrange(progname, "HPOS"));
 			}
-#endif /* NEWER_PROTOCOL */
-			else {
-				fprintf(stderr, 
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
-
-				return(EXIT_FAILURE);
+			else if (strcmp(arg, "vpos") == 0) {
+				return(learnrange(progname, "VPOS"));
 			}
-
-			sendcommand("RSPW", param);
-			break;
-
-		case CMD_POWER:
-			if (strcmp(arg, "off") == 0) {
-				sprintf(param, "%-4s", "0");
+			else if (strcmp(arg, "clock") == 0) {
+				return(learnrange(progname, "CLCK"));
 			}
-			else if (strcmp(arg, "on") == 0) {
-				sprintf(param, "%-4s", "1");
+			else if (strcmp(arg, "phase") == 0) {
+				return(learnrange(progname, "PHSE"));
 			}
 			else {
 				fprintf(stderr,
@@ -298,320 +1615,166 @@ int  argc,
 
 				return(EXIT_FAILURE);
 			}
-
-			sendcommand("POWR", param);
 			break;
 
-		case CMD_INPUT:
-			if (strcmp(arg, "") == 0) {		/* toggle video */
-				sprintf(param, "%-4s", "0");
-				sendcommand("ITGD", param);
-			}
-			else if (strcmp(arg, "tv") == 0) { /* select TV */
-				sprintf(param, "%-4s", "0");
-				sendcommand("ITVD", param);
-			}
-#ifdef NEWER_PROTOCOL
-			else if ((atoi(arg) >= 1 && atoi(arg) <= 8) &&
-#else
-			else if ((atoi(arg) >= 1 && atoi(arg) <= 7) &&
-#endif
-			         (strcmp(arg2, "") == 0)) { /* input select */
-				sprintf(param, "%-4s", arg);
-				sendcommand("IAVD", param);
-			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter(s) for command %s.\n",
-					progname, oparg
-				);
+		case CMD_SWEEP:
+			return(sweep(progname, argc - 1, argv + 1));
 
-				return(EXIT_FAILURE);
-			}
+		case CMD_SURVEY:
+			return(survey(progname, argc - 1, argv + 1));
 
-			break;
+		case CMD_COMPILE:
+			return(compilescene(progname, argc - 1, argv + 1));
 
-		case CMD_AVMODE:
-			if (strcmp(arg, "") == 0) { /* toggle */
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "standard") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-			else if (strcmp(arg, "movie") == 0) {
-				sprintf(param, "%-4s", "2");
-			}
-			else if (strcmp(arg, "game") == 0) {
-				sprintf(param, "%-4s", "3");
-			}
-			else if (strcmp(arg, "user") == 0) {
-				sprintf(param, "%-4s", "4");
-			}
-			else if (strcmp(arg, "dyn-fixed") == 0) {
-				sprintf(param, "%-4s", "5");
-			}
-			else if (strcmp(arg, "dyn") == 0) {
-				sprintf(param, "%-4s", "6");
-			}
-			else if (strcmp(arg, "pc") == 0) {
-				sprintf(param, "%-4s", "7");
-			}
-			else if (strcmp(arg, "xvycc") == 0) {
-				sprintf(param, "%-4s", "8");
-			}
-#ifdef NEWER_PROTOCOL
-			else if (strcmp(arg, "standard-3d") == 0) {
-				sprintf(param, "%-4s", "14");
-			}
-			else if (strcmp(arg, "movie-3d") == 0) {
-				sprintf(param, "%-4s", "15");
-			}
-			else if (strcmp(arg, "game-3d") == 0) {
-				sprintf(param, "%-4s", "16");
-			}
-			else if (strcmp(arg, "auto") == 0) {
-				sprintf(param, "%-4s", "100");
-			}
-#endif
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
-
-				return(EXIT_FAILURE);
-			}
-
-			sendcommand("AVMD", param);
-			break;
+		case CMD_PLAY:
+			return(playscene(progname, argc - 1, argv + 1));
 
-		case CMD_VOLUME:
-			if ((strcmp(arg, "") != 0) &&
-				(atoi(arg) >= 0 && atoi(arg) <= 60)) {
-				sprintf(param, "%-4s", arg);
-			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
+		case CMD_RAW:
+			return(raw(progname, argc - 1, argv + 1));
 
-				return(EXIT_FAILURE);
-			}
+		case CMD_HEALTH:
+			return(showhealth());
 
-			sendcommand("VOLM", param);
-			break;
+		case CMD_BROKER:
+			return(broker(progname, argc - 1, argv + 1));
 
-		case CMD_HPOS:
-			/* Range depends on view mode and type, so can't
-			   range check beyond 0-999. */
-			if ((strcmp(arg, "") != 0) &&
-				(atoi(arg) >= 0 && atoi(arg) <= 999)) {
-				sprintf(param, "%-4s", arg);
-			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
+		case CMD_BENCH:
+			return(bench(progname, argc - 1, argv + 1));
 
-				return(EXIT_FAILURE);
-			}
+		case CMD_SERVE:
+			return(serve(progname, argc - 1, argv + 1));
 
-			sendcommand("HPOS", param);
-			break;
+		case CMD_RELOAD:
+			return(reload(progname));
 
-		case CMD_VPOS:
-			/* Range depends on view mode and type, so can't 
-			   range check beyond 0-999. */
-			if ((strcmp(arg, "") != 0) &&
-				(atoi(arg) >= 0 && atoi(arg) <= 999)) {
-				sprintf(param, "%-4s", arg);
-			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
+		case CMD_MIRROR:
+			return(mirror(progname, argc - 1, argv + 1));
 
-				return(EXIT_FAILURE);
-			}
+		case CMD_FLEET:
+			return(fleet(progname, argc - 1, argv + 1));
 
-			sendcommand("VPOS", param);
-			break;
+		case CMD_SIMULATE:
+			return(simulate(progname, argc - 1, argv + 1));
 
-		case CMD_CLOCK:
-			if ((strcmp(arg, "") != 0) &&
-			    (atoi(arg) >= 0 && atoi(arg) <= 180)) {
-				sprintf(param, "%-4s", arg);
-			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
+		case CMD_SLO:
+			return(slowatch(progname, argc - 1, argv + 1));
+#endif /* AQUOS_TINY */
 
+		default:
+			if ((n = encodecommand(progname, opcode, oparg, arg, arg2,
+			                       frames)) < 0) {
 				return(EXIT_FAILURE);
 			}
-
-			sendcommand("CLCK", param);
-			break;
-
-		case CMD_PHASE:
-			if ((strcmp(arg, "") != 0) &&
-			    (atoi(arg) >= 0 && atoi(arg) <= 40)) {
-				sprintf(param, "%-4s", arg);
+			for (i = 0; i < n; i++) {
+				noteframe(&frames[i],
+					sendcommand(frames[i].command, frames[i].param));
 			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
+			break;
+	}
 
-				return(EXIT_FAILURE);
-			}
+	close(fd);
 
-			sendcommand("PHSE", param);
-			break;
+	return(EXIT_SUCCESS);
+}
+#endif /* AQUOS_LIBRARY */
 
-		case CMD_VIEWMODE:
-			if (strcmp(arg, "") == 0) { /* toggle */
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "sidebar") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-			else if (strcmp(arg, "sstretch") == 0) {
-				sprintf(param, "%-4s", "2");
-			}
-			else if (strcmp(arg, "zoom") == 0) {
-				sprintf(param, "%-4s", "3");
-			}
-			else if (strcmp(arg, "stretch") == 0) {
-				sprintf(param, "%-4s", "4");
-			}
-			else if (strcmp(arg, "normal") == 0) {
-				sprintf(param, "%-4s", "5");
-			}
-			else if (strcmp(arg, "zoom-pc") == 0) {
-				sprintf(param, "%-4s", "6");
-			}
-			else if (strcmp(arg, "stretch-pc") == 0) {
-				sprintf(param, "%-4s", "7");
-			}
-			else if (strcmp(arg, "dotbydot") == 0) {
-				sprintf(param, "%-4s", "8");
-			}
-			else if (strcmp(arg, "full") == 0) {
-				sprintf(param, "%-4s", "9");
-			}
-#ifdef NEWER_PROTOCOL
-			else if (strcmp(arg, "auto") == 0) {
-				sprintf(param, "%-4s", "10");
-			}
-			else if (strcmp(arg, "original") == 0) {
-				sprintf(param, "%-4s", "11");
-			}
-#endif
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
+/*
+ * Encode a command and its arguments into the frame(s) that carry it.
+ * Returns the number of frames, or -1 (after complaining) if the
+ * arguments are invalid.
+ */
+int
+encodecommand(
+	char         *progname,
+	int          opcode,
+	char         *oparg,
+	char         *arg,
+	char         *arg2,
+	struct frame *frames
+)
+{
+	struct wordtab *w;
+	struct bulktab *t;
+	int            n = 0,
+	               i, words,
+	               value = 0, argok = 0, inrange = 0,
+	               chan = 0,
+	               subchan = 0;
+	char           param[5] = "";
 
-				return(EXIT_FAILURE);
-			}
+	for (w = findwords(opcode, &words), i = 0; i < words; w++, i++) {
+		if ((w->proto & PROTO_THIS) != 0 &&
+		    (w->word[0] == '*' ||
+		     (w->word[0] == arg[0] && strcmp(w->word, arg) == 0))) {
+			memcpy(frames[0].command, w->code, 5);
+			memcpy(frames[0].param, w->param, 5);
+			return(1);
+		}
+	}
 
-			sendcommand("WIDE", param);
-			break;
+	/*
+	 * The numeric arguments' limits are bulktab's, as for encodebulk().
+	 * Only digits count (and one '.' in a channel), no more of them than
+	 * the widest value has: "20abc" and "00000020" aren't 20.
+	 */
+	if ((t = findbulk(opcode)) != NULL) {
+		if (t->style == BULK_PAIR || t->style == BULK_CABLE1) {
+			argok = strspn(arg, "0123456789.") == strlen(arg) &&
+			        strchr(arg, '.') == strrchr(arg, '.') &&
+			        strlen(arg) <= (t->style == BULK_PAIR ? 5 : 7);
+		}
+		else {
+			argok = strspn(arg, "0123456789") == strlen(arg) &&
+			        strlen(arg) <= (t->style == BULK_CABLE2 ? 5 : 4);
+		}
+		value = atoi(arg);
+		inrange = argok && value >= t->min && value <= t->max;
+	}
 
-		case CMD_MUTE:
-			if (strcmp(arg, "") == 0) { /* toggle */
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "on") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-			else if (strcmp(arg, "off") == 0) {
-				sprintf(param, "%-4s", "2");
+	switch(opcode) {
+		case CMD_INPUT: /* blank and tv are words */
+			if (inrange && (strcmp(arg2, "") == 0)) { /* input select */
+				snprintf(param, sizeof(param), "%-4s", arg);
+				addframe(frames, &n, "IAVD", param);
 			}
 			else {
 				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
+					"%s: Invalid parameter(s) for command %s.\n",
+					progname, oparg
 				);
 
-				return(EXIT_FAILURE);
+				return(-1);
 			}
 
-			sendcommand("MUTE", param);
 			break;
 
-		case CMD_SURROUND:
-			if (strcmp(arg, "") == 0) { /* toggle */
-				sprintf(param, "%-4s", "0");
-			}
-#ifdef NEWER_PROTOCOL
-			else if (strcmp(arg, "normal") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-#else
-			else if (strcmp(arg, "on") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-#endif
-			else if (strcmp(arg, "off") == 0) {
-				sprintf(param, "%-4s", "2");
-			}
-#ifdef NEWER_PROTOCOL
-			else if (strcmp(arg, "3d-hall") == 0) {
-				sprintf(param, "%-4s", "4");
-			}
-			else if (strcmp(arg, "3d-movie") == 0) {
-				sprintf(param, "%-4s", "5");
-			}
-			else if (strcmp(arg, "3d-standard") == 0) {
-				sprintf(param, "%-4s", "6");
-			}
-			else if (strcmp(arg, "3d-stadium") == 0) {
-				sprintf(param, "%-4s", "7");
+		case CMD_VOLUME:
+			if ((strcmp(arg, "") != 0) && inrange) {
+				snprintf(param, sizeof(param), "%-4s", arg);
 			}
-#endif
 			else {
 				fprintf(stderr,
 					"%s: Invalid parameter \"%s\" for command %s.\n",
 					progname, arg, oparg
 				);
 
-				return(EXIT_FAILURE);
+				return(-1);
 			}
 
-			sendcommand("ACSU", param);
-			break;
-
-		case CMD_AUDIOSEL:
-			sprintf(param, "%-4s", "0"); /* toggle */
-			sendcommand("ACHA", param);
+			addframe(frames, &n, "VOLM", param);
 			break;
 
-		case CMD_SLEEP:
-			if (strcmp(arg, "off") == 0) {
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "0") == 0) {
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "30") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-			else if (strcmp(arg, "60") == 0) {
-				sprintf(param, "%-4s", "2");
-			}
-			else if (strcmp(arg, "90") == 0) {
-				sprintf(param, "%-4s", "3");
-			}
-			else if (strcmp(arg, "120") == 0) {
-				sprintf(param, "%-4s", "4");
+		case CMD_HPOS:
+		case CMD_VPOS:
+		case CMD_CLOCK:
+		case CMD_PHASE:
+			/* Position ranges depend on view mode and type, so the
+			   table's is as far as they go until one is learned. */
+			if ((strcmp(arg, "") != 0) && inrange) {
+				if (checkrange(progname, t->command, arg) != 0) {
+					return(-1);
+				}
+				snprintf(param, sizeof(param), "%-4s", arg);
 			}
 			else {
 				fprintf(stderr,
@@ -619,122 +1782,62 @@ int  argc,
 					progname, arg, oparg
 				);
 
-				return(EXIT_FAILURE);
+				return(-1);
 			}
 
-			sendcommand("OFTM", param);
+			addframe(frames, &n, t->command, param);
 			break;
 
 		case CMD_ACHAN:
-			if (atoi(arg) >= 1 && atoi(arg) <= 135) {
-				sprintf(param, "%-4s", arg);
+			if (inrange) {
+				snprintf(param, sizeof(param), "%-4s", arg);
 			} else {
 				fprintf(stderr,
 					"%s: Invalid parameter \"%s\" for command %s.\n",
 					progname, arg, oparg
 				);
 
-				return(EXIT_FAILURE);
+				return(-1);
 			}
 
-			sendcommand("DCCH", param);
+			addframe(frames, &n, "DCCH", param);
 			break;
 
 		case CMD_DCHAN:
-			/* This will catch channel formats "xxyy" and "xx.yy". */
-			if (sscanf(arg, "%d.%d", &chan, &subchan) > 0) {
-				sprintf(param, "%02d%02d", chan, subchan);
-			} else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
-
-				return(EXIT_FAILURE);
-			}
-
-			sendcommand("DA2P", param);
-			break;
-
 		case CMD_DCABL1:
-			/* This will catch channel formats "xxx" and "xxx.yyy". */
-			if ((sscanf(arg, "%d.%d", &chan, &subchan) > 0) &&
-		        (chan <= 999 && subchan <= 999)) {
+			/* Channel formats "xx"/"xx.yy" and "xxx"/"xxx.yyy"; the
+			   subchannel has the channel's limits. */
+			if (argok && (sscanf(arg, "%d.%d", &chan, &subchan) > 0) &&
+			    (chan >= t->min && chan <= t->max) &&
+			    (subchan >= t->min && subchan <= t->max)) {
 			} else {
 				fprintf(stderr,
 					"%s: Invalid parameter \"%s\" for command %s.\n",
 					progname, arg, oparg
 				);
 
-				return(EXIT_FAILURE);
-			}
-
-			sprintf(param, "%03d ", chan);
-			sendcommand("DC2U", param);
-			sprintf(param, "%03d ", subchan);
-			sendcommand("DC2L", param);
-			break;
-
-		case CMD_DCABL2:
-			if (atoi(arg) >= 0 && atoi(arg) <= 9999) {
-				sprintf(param, "%04d", atoi(arg));
-				sendcommand("DC10", param);
+				return(-1);
 			}
-			else if (atoi(arg) > 9999 && atoi(arg) <= 16383) {
-				sprintf(param, "%04d", atoi(arg) - 10000);
-				sendcommand("DC11", param);
-			}
-			else {
-				fprintf(stderr,
-					"%s: Invalid parameter \"%s\" for command %s.\n",
-					progname, arg, oparg
-				);
 
-				return(EXIT_FAILURE);
+			if (opcode == CMD_DCHAN) {
+				snprintf(param, sizeof(param), "%02u%02u",
+					(unsigned) chan % 100, (unsigned) subchan % 100);
+				addframe(frames, &n, "DA2P", param);
+				break;
 			}
-
-			break;
-
-		case CMD_CHUP:
-			sprintf(param, "%-4s", "0");
-			sendcommand("CHUP", param);
-			break;
-
-		case CMD_CHDN:
-			sprintf(param, "%-4s", "0");
-			sendcommand("CHDW", param);
-			break;
-
-		case CMD_CC:
-			sprintf(param, "%-4s", "0"); /* toggle */
-			sendcommand("CLCP", param);
+			snprintf(param, sizeof(param), "%03u ", (unsigned) chan % 1000);
+			addframe(frames, &n, "DC2U", param);
+			snprintf(param, sizeof(param), "%03u ",
+				(unsigned) subchan % 1000);
+			addframe(frames, &n, "DC2L", param);
 			break;
 
-#ifdef NEWER_PROTOCOL
-		case CMD_3D:
-			if (strcmp(arg, "off") == 0) {
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "2d3d") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-			else if (strcmp(arg, "sbs") == 0) {
-				sprintf(param, "%-4s", "2");
-			}
-			else if (strcmp(arg, "tab") == 0) {
-				sprintf(param, "%-4s", "3");
-			}
-			else if (strcmp(arg, "3d2d-sbs") == 0) {
-				sprintf(param, "%-4s", "4");
-			}
-			else if (strcmp(arg, "3d2d-tab") == 0) {
-				sprintf(param, "%-4s", "5");
-			}
-			else if (strcmp(arg, "3d-auto") == 0) {
-				sprintf(param, "%-4s", "6");
-			}
-			else if (strcmp(arg, "2d-auto") == 0) {
-				sprintf(param, "%-4s", "7");
+		case CMD_DCABL2:
+			if (inrange) {
+				/* DC10 takes 0-9999 and DC11 the rest, less 10000. */
+				snprintf(param, sizeof(param), "%04u",
+					(unsigned) value % 10000);
+				addframe(frames, &n, value < 10000 ? "DC10" : "DC11", param);
 			}
 			else {
 				fprintf(stderr,
@@ -742,319 +1845,8801 @@ int  argc,
 					progname, arg, oparg
 				);
 
-				return(EXIT_FAILURE);
+				return(-1);
 			}
 
-			sendcommand("TDCH", param);
 			break;
 
-		case CMD_BUTTON:
-			if (strcmp(arg, "0") == 0) {
-				sprintf(param, "%-4s", "0");
-			}
-			else if (strcmp(arg, "1") == 0) {
-				sprintf(param, "%-4s", "1");
-			}
-			else if (strcmp(arg, "2") == 0) {
-				sprintf(param, "%-4s", "2");
-			}
-			else if (strcmp(arg, "3") == 0) {
-				sprintf(param, "%-4s", "3");
-			}
-			else if (strcmp(arg, "4") == 0) {
-				sprintf(param, "%-4s", "4");
-			}
-			else if (strcmp(arg, "5") == 0) {
-				sprintf(param, "%-4s", "5");
-			}
-			else if (strcmp(arg, "6") == 0) {
-				sprintf(param, "%-4s", "6");
-			}
-			else if (strcmp(arg, "7") == 0) {
-				sprintf(param, "%-4s", "7");
-			}
-			else if (strcmp(arg, "8") == 0) {
-				sprintf(param, "%-4s", "8");
-			}
-			else if (strcmp(arg, "9") == 0) {
-				sprintf(param, "%-4s", "9");
-			}
-			else if (strcmp(arg, ".") == 0) {
-				sprintf(param, "%-4s", "10");
-			}
-			else if (strcmp(arg, "ent") == 0 ||
-			         strcmp(arg, "enter") == 0) {
-				sprintf(param, "%-4s", "11");
-			}
-			else if (strcmp(arg, "power") == 0) {
-				sprintf(param, "%-4s", "12");
-			}
-			else if (strcmp(arg, "display") == 0) {
-				sprintf(param, "%-4s", "13");
-			}
-			else if (strcmp(arg, "power-source") == 0) {
-				sprintf(param, "%-4s", "14");
-			}
-			else if (strcmp(arg, "rew") == 0) { /* << */
-				sprintf(param, "%-4s", "15");
-			}
-			else if (strcmp(arg, "play") == 0) {
-				sprintf(param, "%-4s", "16");
-			}
-			else if (strcmp(arg, "ff") == 0) { /* >> */
-				sprintf(param, "%-4s", "17");
-			}
-			else if (strcmp(arg, "pause") == 0) { /* || */
-				sprintf(param, "%-4s", "18");
-			}
-			else if (strcmp(arg, "prev") == 0) { /* |<< */
-				sprintf(param, "%-4s", "19");
-			}
-			else if (strcmp(arg, "stop") == 0) {
-				sprintf(param, "%-4s", "20");
-			}
-			else if (strcmp(arg, "next") == 0) { /* >>| */
-				sprintf(param, "%-4s", "21");
-			}
-			else if (strcmp(arg, "rec") == 0) {
-				sprintf(param, "%-4s", "22");
-			}
-			else if (strcmp(arg, "option") == 0) {
-				sprintf(param, "%-4s", "23");
-			}
-			else if (strcmp(arg, "sleep") == 0) {
-				sprintf(param, "%-4s", "24");
-			}
-			else if (strcmp(arg, "cc") == 0) {
-				sprintf(param, "%-4s", "27");
-			}
-			else if (strcmp(arg, "avmode") == 0) {
-				sprintf(param, "%-4s", "28");
-			}
-			else if (strcmp(arg, "viewmode") == 0) {
-				sprintf(param, "%-4s", "29");
-			}
-			else if (strcmp(arg, "flashback") == 0) {
-				sprintf(param, "%-4s", "30");
-			}
-			else if (strcmp(arg, "mute") == 0) {
-				sprintf(param, "%-4s", "31");
-			}
-			else if (strcmp(arg, "vol-") == 0 ||
-			         strcmp(arg, "voldn") == 0) {
-				sprintf(param, "%-4s", "32");
-			}
-			else if (strcmp(arg, "vol+") == 0 ||
-			         strcmp(arg, "volup") == 0) {
-				sprintf(param, "%-4s", "33");
-			}
-			else if (strcmp(arg, "chup") == 0) {
-				sprintf(param, "%-4s", "34");
-			}
-			else if (strcmp(arg, "chdn") == 0) {
-				sprintf(param, "%-4s", "35");
-			}
-			else if (strcmp(arg, "input") == 0) {
-				sprintf(param, "%-4s", "36");
-			}
-			else if (strcmp(arg, "menu") == 0) {
-				sprintf(param, "%-4s", "38");
-			}
-			else if (strcmp(arg, "startcenter") == 0) {
-				sprintf(param, "%-4s", "39");
-			}
-			else if (strcmp(arg, "enter") == 0) {
-				sprintf(param, "%-4s", "40");
-			}
-			else if (strcmp(arg, "up") == 0) {
-				sprintf(param, "%-4s", "41");
-			}
-			else if (strcmp(arg, "down") == 0) {
-				sprintf(param, "%-4s", "42");
-			}
-			else if (strcmp(arg, "left") == 0) {
-				sprintf(param, "%-4s", "43");
-			}
-			else if (strcmp(arg, "right") == 0) {
-				sprintf(param, "%-4s", "44");
-			}
-			else if (strcmp(arg, "return") == 0) {
-				sprintf(param, "%-4s", "45");
-			}
-			else if (strcmp(arg, "exit") == 0) {
-				sprintf(param, "%-4s", "46");
-			}
-			else if (strcmp(arg, "fav") == 0 ||
-			         strcmp(arg, "favorite") == 0 ||
-			         strcmp(arg, "favoritech") == 0) {
-				sprintf(param, "%-4s", "47");
-			}
-			else if (strcmp(arg, "3d-surround") == 0) {
-				sprintf(param, "%-4s", "48");
-			}
-			else if (strcmp(arg, "audio") == 0) {
-				sprintf(param, "%-4s", "49");
-			}
-			else if (strcmp(arg, "a") == 0 ||
-			         strcmp(arg, "red") == 0) {
-				sprintf(param, "%-4s", "50");
-			}
-			else if (strcmp(arg, "b") == 0 ||
-			         strcmp(arg, "green") == 0) {
-				sprintf(param, "%-4s", "51");
-			}
-			else if (strcmp(arg, "c") == 0 ||
-			         strcmp(arg, "blue") == 0) {
-				sprintf(param, "%-4s", "52");
-			}
-			else if (strcmp(arg, "d") == 0 ||
-			         strcmp(arg, "yellow") == 0) {
-				sprintf(param, "%-4s", "53");
-			}
-			else if (strcmp(arg, "freeze") == 0) {
-				sprintf(param, "%-4s", "54");
-			}
-			else if (strcmp(arg, "favapp1") == 0) {
-				sprintf(param, "%-4s", "55");
-			}
-			else if (strcmp(arg, "favapp2") == 0) {
-				sprintf(param, "%-4s", "56");
-			}
-			else if (strcmp(arg, "favapp3") == 0) {
-				sprintf(param, "%-4s", "57");
-			}
-			else if (strcmp(arg, "3d") == 0) {
-				sprintf(param, "%-4s", "58");
-			}
-			else if (strcmp(arg, "netflix") == 0) {
-				sprintf(param, "%-4s", "59");
-			}
-			else {
+		default:
+			if (words > 0) {
 				fprintf(stderr,
 					"%s: Invalid parameter \"%s\" for command %s.\n",
 					progname, arg, oparg
 				);
 
-				return(EXIT_FAILURE);
+				return(-1);
 			}
-
-			sendcommand("RCKY", param);
 			break;
-#endif
 	}
 
-	close(fd);
-
-	return(EXIT_SUCCESS);
+	return(n);
 }
 
+/* Append a command/parameter pair to a frame list. */
 void
-openport(
-	char *port
+addframe(
+	struct frame *frames,
+	int          *n,
+	char         *command,
+	char         *param
 )
 {
-	struct termios options;
+	snprintf(frames[*n].command, sizeof(frames[*n].command), "%s", command);
+	snprintf(frames[*n].param, sizeof(frames[*n].param), "%s", param);
+	(*n)++;
+}
 
-	fd = open(port, O_RDWR | O_NOCTTY | O_NDELAY);
-	if (fd == -1) {
-		fprintf(stderr, "openport(%s): %s\n", port, strerror(errno));
-		exit(EXIT_FAILURE);
+/*
+ * The run of wordtab lines for opcode, in every revision, and how many
+ * there are (none for the numeric commands' own arguments).
+ */
+struct wordtab *
+findwords(
+	int opcode,
+	int *count
+)
+{
+	static short first[CMD_LEARN], words[CMD_LEARN];
+	static int   indexed = 0;
+	int          i;
+
+	if (!indexed) {
+		for (i = 0; i < sizeof(wordtab) / sizeof(wordtab[0]); i++) {
+			if (words[wordtab[i].opcode]++ == 0)
+				first[wordtab[i].opcode] = i;
+		}
+		indexed = 1;
 	}
 
+	if (opcode <= CMD_NONE || opcode >= CMD_LEARN) {
+		*count = 0;
+		return(NULL);
+	}
+	*count = words[opcode];
+	return(&wordtab[first[opcode]]);
+}
+
+/* opcode's line of bulktab, or NULL if it takes no number. */
+struct bulktab *
+findbulk(
+	int opcode
+)
+{
+	static unsigned char slot[CMD_DCABL2 + 1]; /* bulktab index + 1 */
+	static int           indexed = 0;
+	int                  i;
+
+	if (!indexed) {
+		for (i = 0; i < sizeof(bulktab) / sizeof(bulktab[0]); i++)
+			slot[bulktab[i].opcode] = i + 1;
+		indexed = 1;
+	}
+
+	if (opcode < 0 || opcode > CMD_DCABL2 || slot[opcode] == 0) return(NULL);
+	return(&bulktab[slot[opcode] - 1]);
+}
+
+/*
+ * Encode n numeric settings straight into out as ready-to-write frames
+ * (command, parameter and CR, 9 bytes each; dcabl1 takes two). The
+ * whole array is checked against the static limits before anything is
+ * written, so a bad item costs nothing; learned ranges aren't consulted.
+ * Returns the bytes written, or -1 with *bad set to the first item that
+ * is unknown, out of range or doesn't fit in size.
+ */
+long
+encodebulk(
+	struct bulkitem *items,
+	int             n,
+	char            *out,
+	size_t          size,
+	int             *bad
+)
+{
+	static char    pairs[200]; /* "000102...99" */
+	struct bulktab *t;
+	size_t         need = 0;
+	char           *p = out;
+	int            i, v;
+
+	if (pairs[1] == '\0') {
+		for (i = 0; i < 100; i++) {
+			pairs[2 * i] = '0' + i / 10;
+			pairs[2 * i + 1] = '0' + i % 10;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((t = findbulk(items[i].opcode)) == NULL) break;
+		if (items[i].value < t->min || items[i].value > t->max) break;
+		if ((t->style == BULK_PAIR && (items[i].sub < 0 || items[i].sub > 99)) ||
+		    (t->style == BULK_CABLE1 && (items[i].sub < 0 || items[i].sub > 999)))
+			break;
+		need += (t->style == BULK_CABLE1) ? 18 : 9;
+		if (need > size) break;
+	}
+	if (i < n) {
+		*bad = i;
+		return(-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		t = findbulk(items[i].opcode);
+		v = items[i].value;
+		memcpy(p, t->command, 4);
+
+		switch (t->style) {
+			case BULK_LEFT: /* up to 3 digits, space filled */
+				memset(p + 4, ' ', 4);
+				if (v >= 100) {
+					p[4] = '0' + v / 100;
+					memcpy(p + 5, pairs + 2 * (v % 100), 2);
+				}
+				else if (v >= 10) {
+					memcpy(p + 4, pairs + 2 * v, 2);
+				}
+				else {
+					p[4] = '0' + v;
+				}
+				break;
+
+			case BULK_PAIR:
+				memcpy(p + 4, pairs + 2 * v, 2);
+				memcpy(p + 6, pairs + 2 * items[i].sub, 2);
+				break;
+
+			case BULK_CABLE1:
+				p[4] = '0' + v / 100;
+				memcpy(p + 5, pairs + 2 * (v % 100), 2);
+				p[7] = ' ';
+				p[8] = '\r';
+				p += 9;
+				v = items[i].sub;
+				memcpy(p, "DC2L", 4);
+				p[4] = '0' + v / 100;
+				memcpy(p + 5, pairs + 2 * (v % 100), 2);
+				p[7] = ' ';
+				break;
+
+			case BULK_CABLE2:
+				if (v > 9999) {
+					p[3] = '1'; /* DC11 */
+					v -= 10000;
+				}
+				memcpy(p + 4, pairs + 2 * (v / 100), 2);
+				memcpy(p + 6, pairs + 2 * (v % 100), 2);
+				break;
+		}
+		p[8] = '\r';
+		p += 9;
+	}
+
+	return(p - out);
+}
+
+#ifndef AQUOS_TINY
+/*
+ * Note what a sent frame tells us about the TV: the View Mode and input
+ * key the learned ranges, and position/clock/phase replies refine them.
+ */
+void
+noteframe(
+	struct frame *f,
+	int          resp
+)
+{
+	char value[5];
+
+	if (resp != RESP_OK && resp != RESP_ERR) return;
+
+	sscanf(f->param, "%4s", value);
+
+	if (strcmp(f->command, "HPOS") == 0 || strcmp(f->command, "VPOS") == 0 ||
+	    strcmp(f->command, "CLCK") == 0 || strcmp(f->command, "PHSE") == 0) {
+		recordrange(f->command, atoi(value), resp);
+	}
+	else if (resp != RESP_OK) {
+		return;
+	}
+	else if (strcmp(f->command, "IAVD") == 0) {
+		setcontext(NULL, value);
+	}
+	else if (strcmp(f->command, "ITVD") == 0) {
+		setcontext(NULL, "tv");
+	}
+	else if (strcmp(f->command, "ITGD") == 0) {
+		setcontext(NULL, "?");
+	}
+	else if (strcmp(f->command, "WIDE") == 0) {
+		setcontext(strcmp(value, "0") == 0 ? "?" : value, NULL); /* 0 toggles */
+	}
+}
+#endif /* AQUOS_TINY */
+
+void
+openport(
+	char *port
+)
+{
+	/* A running broker hands over a port it already has set up. */
+	if (brokerclient(port) == 0) return;
+
+	lockport(port);
+
+	fd = portopen(port);
+	if (fd == -1) {
+		fprintf(stderr, "openport(%s): %s\n", port, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Shut out anything that doesn't take the lock. */
+#ifdef TIOCEXCL
+	ioctl(fd, TIOCEXCL);
+#endif
+
+	setupport(fd);
+
+	return;
+}
+
+/*
+ * Open a port: a serial device, or "tcp:[addr:]port" for a TV behind a
+ * serial to TCP bridge (or simulate --tcp). The socket takes the tty
+ * calls made on a port as harmless no-ops. Returns -1 with errno set.
+ */
+int
+portopen(
+	char *port
+)
+{
+#ifndef AQUOS_TINY
+	struct sockaddr_in addr;
+	int                sock, on = 1, saved;
+
+	if (strncmp(port, "tcp:", 4) == 0) {
+		if (httpaddr(port + 4, &addr) == -1) {
+			errno = EINVAL;
+			return(-1);
+		}
+		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) return(-1);
+		if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+			saved = errno;
+			close(sock);
+			errno = saved;
+			return(-1);
+		}
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		return(sock);
+	}
+#endif
+
+	return(open(port, O_RDWR | O_NOCTTY | O_NDELAY));
+}
+
+/* Put an open port into raw 9600,8,N,1 mode. */
+void
+setupport(
+	int fd
+)
+{
+	struct termios options;
+
 	fcntl(fd, F_SETFL, 0); /* Make reads return immediately. */
 
-	tcgetattr(fd, &options); /* Get current port options. */
+	tcgetattr(fd, &options); /* Get current port options. */
+
+	/* Set the baud rates to 9600,8,N,1. */
+	cfsetispeed(&options, B9600);
+	cfsetospeed(&options, B9600);
+	options.c_cflag &= ~PARENB;
+	options.c_cflag &= ~CSTOPB;
+	options.c_cflag &= ~CSIZE;
+	options.c_cflag |= CS8;
+
+	options.c_cflag &= ~CRTSCTS; /* No hardware flow control. */
+
+	options.c_cflag |= (CLOCAL | CREAD); /* Enable receiver, set local mode. */
+	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); /* Raw input. */
+
+	options.c_iflag &= ~(IXON | IXOFF | IXANY); /* No software flow control. */
+	options.c_oflag &= ~OPOST; /* Raw output. */
+
+	tcsetattr(fd, TCSANOW, &options); /* Set options for the new port. */
+	tcflush(fd, TCIFLUSH); /* Drop anything left from an earlier run. */
+}
+
+#ifndef AQUOS_TINY
+/*
+ * Open (creating) the flock() file for port in the lock directory, the
+ * one place every process looks, so there is no falling back elsewhere.
+ * A link planted there isn't followed, and the file is only as open as
+ * 0660 and the umask make it. The path is left in path, with room for
+ * lockport()'s "s". Returns -1 with ENAMETOOLONG rather than lock a
+ * truncated name another port could share.
+ */
+int
+openlock(
+	char *port,
+	char *path,
+	int  size
+)
+{
+	char name[256], *c;
+	int  lfd;
+
+	if (snprintf(name, sizeof(name), "%s", port) >= (int) sizeof(name)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	for (c = name; *c != '\0'; c++) {
+		if (*c == '/') *c = '_';
+	}
+
+	if (snprintf(path, size, "%s/aquosctl.%s.lock", cfg.lock_dir, name) >=
+	    size - 1) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	/* flock() needs no write access, so someone else's file will do. */
+	if ((lfd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+	                0660)) == -1 && errno == EACCES) {
+		lfd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	}
+
+	return(lfd);
+}
+
+/*
+ * Whether the process at the other end of Unix socket sock runs as us
+ * or as root, the only peers the broker and its clients trust with a
+ * port.
+ */
+int
+trustedpeer(
+	int sock
+)
+{
+	struct ucred cred;
+	socklen_t    len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return(0);
+
+	return(cred.uid == geteuid() || cred.uid == 0);
+}
+
+/*
+ * Ask a running broker for port. The broker queues us until the port is
+ * free and then passes its open, configured descriptor over the socket,
+ * which stays open as our lease until we exit. Returns -1 (use the port
+ * directly) if there is no broker or it doesn't have the port.
+ */
+int
+brokerclient(
+	char *port
+)
+{
+	struct sockaddr_un addr;
+	struct msghdr      msg;
+	struct iovec       iov;
+	struct cmsghdr     *cmsg;
+	struct pollfd      pfd;
+	struct stat        st;
+	union {
+		struct cmsghdr hdr;
+		char           buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	char               request[300], reply[64];
+	int                sock, len, waited = 0;
+	long long          start = monotime();
+
+	if (stat(cfg.broker_socket, &st) == -1 || !S_ISSOCK(st.st_mode))
+		return(-1);
+
+	if (strlen(cfg.broker_socket) >= sizeof(addr.sun_path)) return(-1);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, cfg.broker_socket, strlen(cfg.broker_socket));
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return(-1);
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(sock);
+		return(-1);
+	}
+
+	/* Anyone can bind a socket in /tmp; take a port only from a broker
+	   run by us or root. */
+	if (!trustedpeer(sock)) {
+		fprintf(stderr, "warning: ignoring %s, run by another user\n",
+			cfg.broker_socket);
+		close(sock);
+		return(-1);
+	}
+
+	len = snprintf(request, sizeof(request), "OPEN %s\n", port);
+	if (write(sock, request, len) != len) {
+		close(sock);
+		return(-1);
+	}
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, cfg.lock_timeout) <= 0) {
+		fprintf(stderr, "openport(%s): busy, gave up after %d ms\n",
+			port, cfg.lock_timeout);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply) - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if ((len = recvmsg(sock, &msg, 0)) <= 0) {
+		close(sock);
+		return(-1);
+	}
+	reply[len] = '\0';
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (strncmp(reply, "OK", 2) != 0 || cmsg == NULL ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		close(sock);
+		return(-1);
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	sscanf(reply, "OK %d", &waited);
+
+	/* sock stays open: closing it (at exit) ends the lease. */
+	if (verbose == 1) {
+		logmsg("port from broker in %.1f ms (waited %d ms)",
+			(monotime() - start) / 1e6, waited);
+	}
+
+	return(0);
+}
+
+/*
+ * Open and set up a port, holding its lock (never waiting for it) so
+ * direct users stay off: until we exit, or until the caller closes the
+ * lock's descriptor, left in lock if that isn't NULL. Returns the port's
+ * descriptor, or -1 after saying why.
+ */
+int
+claimport(
+	char *progname,
+	char *port,
+	int  *lock
+)
+{
+	char path[PATH_MAX];
+	int  lfd, pfd;
+
+	if ((lfd = openlock(port, path, sizeof(path))) == -1) {
+		fprintf(stderr, "%s: lock for %s: %s\n", progname, port,
+			strerror(errno));
+		return(-1);
+	}
+	if (flock(lfd, LOCK_EX | LOCK_NB) == -1) {
+		fprintf(stderr, "%s: %s is in use\n", progname, port);
+		close(lfd);
+		return(-1);
+	}
+
+	if ((pfd = portopen(port)) == -1) {
+		fprintf(stderr, "openport(%s): %s\n", port, strerror(errno));
+		close(lfd);
+		return(-1);
+	}
+#ifdef TIOCEXCL
+	ioctl(pfd, TIOCEXCL);
+#endif
+	setupport(pfd);
+	if (lock != NULL) *lock = lfd;
+
+	return(pfd);
+}
+
+/*
+ * Port broker: open and configure each port once, then lend the open
+ * descriptor to aquosctl clients over a Unix socket (SCM_RIGHTS). Only
+ * one client holds a port at a time; the others queue in arrival order.
+ * A lease ends when the client's connection closes, at which point the
+ * port is flushed and passed to the next client.
+ */
+int
+broker(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct sockaddr_un addr;
+	struct pollfd      pfds[1 + BROKER_CLIENTS];
+	struct msghdr      msg;
+	struct iovec       iov;
+	struct cmsghdr     *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char           buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct bport {
+		char      name[256];
+		int       fd;
+		int       holder;  /* client index, or -1 */
+	} ports[BROKER_PORTS];
+	struct bclient {
+		int       sock;
+		int       port;    /* index into ports, or -1 */
+		long long asked;   /* when it asked (monotime) */
+		long      seq;     /* arrival order while waiting */
+		char      line[300];  /* its request so far */
+		int       len;
+	} clients[BROKER_CLIENTS];
+	char               reply[64], *nl;
+	int                listenfd, sock, nports = 0, nclients = 0, i, j, k, len;
+	long               seq = 0;
+	mode_t             mask;
+
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (i = 0; i < (argc > 0 ? argc : 1) && nports < BROKER_PORTS; i++) {
+		snprintf(ports[nports].name, sizeof(ports[0].name), "%s",
+			argc > 0 ? argv[i] : portname);
+		if ((ports[nports].fd = claimport(progname, ports[nports].name, NULL)) ==
+		    -1)
+			return(EXIT_FAILURE);
+		ports[nports].holder = -1;
+		nports++;
+	}
+
+	if (strlen(cfg.broker_socket) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, cfg.broker_socket,
+			strerror(ENAMETOOLONG));
+		return(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, cfg.broker_socket, strlen(cfg.broker_socket));
+	unlink(cfg.broker_socket);
+
+	/* A lease is the open tty itself, so the socket is ours alone (0600)
+	   and peers are checked as well: see trustedpeer(). */
+	mask = umask(077);
+	if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(listenfd, 64) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, cfg.broker_socket,
+			strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	umask(mask);
+
+	if (verbose == 1) {
+		logmsg("broker on %s with %d port(s)", cfg.broker_socket, nports);
+	}
+
+	for (;;) {
+		pfds[0].fd = listenfd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfds[1 + i].fd = clients[i].sock;
+			pfds[1 + i].events = POLLIN;
+		}
+		if (poll(pfds, 1 + nclients, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		for (i = nclients - 1; i >= 0; i--) {
+			if (pfds[1 + i].revents == 0) continue;
+
+			len = read(clients[i].sock, clients[i].line + clients[i].len,
+			           sizeof(clients[i].line) - 1 - clients[i].len);
+			if (len > 0 && clients[i].port == -1) {
+				/* "OPEN port\n", maybe in pieces: queue for it, or refuse. */
+				clients[i].len += len;
+				clients[i].line[clients[i].len] = '\0';
+				if ((nl = strchr(clients[i].line, '\n')) != NULL) *nl = '\0';
+				else if (clients[i].len < (int) sizeof(clients[i].line) - 1) continue;
+				clients[i].len = 0;
+				for (k = 0; k < nports; k++) {
+					if (strncmp(clients[i].line, "OPEN ", 5) == 0 &&
+					    strcmp(clients[i].line + 5, ports[k].name) == 0)
+						break;
+				}
+				if (k < nports) {
+					clients[i].port = k;
+					clients[i].asked = monotime();
+					clients[i].seq = seq++;
+					continue;
+				}
+				write(clients[i].sock, "ERR no such port\n", 17);
+			}
+			else if (len > 0) {
+				clients[i].len = 0; /* nothing else to say while holding */
+				continue;
+			}
+
+			/* Gone (or refused): end its lease or leave the queue. */
+			k = clients[i].port;
+			if (k != -1 && ports[k].holder == i) {
+				tcflush(ports[k].fd, TCIOFLUSH);
+				ports[k].holder = -1;
+			}
+			close(clients[i].sock);
+			nclients--;
+			if (i != nclients) {
+				clients[i] = clients[nclients];
+				for (j = 0; j < nports; j++) {
+					if (ports[j].holder == nclients) ports[j].holder = i;
+				}
+			}
+		}
+
+		/* When full, a new client is told so rather than left pending. */
+		if (pfds[0].revents & POLLIN) {
+			if ((sock = accept(listenfd, NULL, NULL)) != -1 &&
+			    !trustedpeer(sock)) {
+				write(sock, "ERR not allowed\n", 16);
+				close(sock);
+				if (verbose == 1) logmsg("refused a client of another user");
+			}
+			else if (sock != -1 && nclients == BROKER_CLIENTS) {
+				write(sock, "ERR too many clients\n", 21);
+				close(sock);
+			}
+			else if (sock != -1) {
+				clients[nclients].sock = sock;
+				clients[nclients].port = -1;
+				clients[nclients].len = 0;
+				nclients++;
+			}
+		}
+
+		/* Grant free ports to the longest waiting client. */
+		for (k = 0; k < nports; k++) {
+			if (ports[k].holder != -1) continue;
+			for (i = 0, j = -1; i < nclients; i++) {
+				if (clients[i].port == k &&
+				    (j == -1 || clients[i].seq < clients[j].seq))
+					j = i;
+			}
+			if (j == -1) continue;
+
+			len = snprintf(reply, sizeof(reply), "OK %lld\n",
+				(monotime() - clients[j].asked) / 1000000);
+			memset(&msg, 0, sizeof(msg));
+			memset(&control, 0, sizeof(control));
+			iov.iov_base = reply;
+			iov.iov_len = len;
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &ports[k].fd, sizeof(int));
+
+			ports[k].holder = j;
+			clients[j].seq = LONG_MAX; /* no longer waiting */
+			if (sendmsg(clients[j].sock, &msg, 0) != len) {
+				/* Picked up as a hangup on the next pass. */
+				continue;
+			}
+			if (verbose == 1) {
+				logmsg("%s lent out", ports[k].name);
+			}
+		}
+	}
+
+	return(EXIT_FAILURE);
+}
+
+/*
+ * Mirror the master (-p) onto the followers: read its input, volume and
+ * channel round and round, one query at a time, and set whatever changed
+ * on every follower at once. Each port has one frame out and is driven
+ * from a single poll(), so the followers are set in parallel. What the
+ * followers were last read or set to is kept, and those already showing
+ * the master's value are skipped. Each change is reported with how long
+ * it took, and a summary at SIGINT or SIGTERM.
+ */
+int
+mirror(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct mirrorport ports[MIRROR_PORTS], *p;
+	struct pollfd     pfds[MIRROR_PORTS];
+	char              *cr;
+	int               nports = 1, i, k, len, wait;
+	long long         now, due;
+
+	if (argc < 1 || nosend == 1) {
+		fprintf(stderr, "%s: mirror needs follower ports (and no -n).\n",
+			progname);
+		return(EXIT_FAILURE);
+	}
+
+	memset(ports, 0, sizeof(ports));
+	ports[0].name = portname;
+	ports[0].fd = fd;
+	for (i = 0; i < argc && nports < MIRROR_PORTS; i++) {
+		ports[nports].name = argv[i];
+		if ((ports[nports].fd = claimport(progname, argv[i], NULL)) == -1)
+			return(EXIT_FAILURE);
+		nports++;
+	}
+	for (p = ports; p < ports + nports; p++) {
+		fcntl(p->fd, F_SETFL, O_NONBLOCK);
+		for (k = 0; k < MIRROR_KEYS; k++) p->value[k] = p->want[k] = -1;
+		p->key = MIRROR_KEYS - 1;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGINT, stopserving);
+	signal(SIGTERM, stopserving);
+	if (verbose == 1) {
+		logmsg("mirroring %s to %d follower(s)", portname, nports - 1);
+	}
+
+	while (!serving_stopped) {
+		/* Not answered in time: forget it, and anything late. */
+		now = monotime();
+		for (i = 0, p = ports; i < nports; i++, p++) {
+			if (p->frame[0] != '\0' &&
+			    now >= p->sent + cfg.timeout_default * 1000000LL) {
+				mirrorreply(p, i, NULL, ports, nports);
+				tcflush(p->fd, TCIFLUSH);
+				p->inlen = 0;
+			}
+		}
+
+		wait = -1;
+		for (i = 0, p = ports; i < nports; i++, p++) {
+			if (p->frame[0] == '\0') mirrornext(p, i);
+
+			pfds[i].fd = p->fd;
+			pfds[i].events = POLLIN;
+			if (p->frame[0] == '\0') continue;
+
+			due = p->sent + cfg.timeout_default * 1000000LL;
+			if (wait == -1 || (due - now) / 1000000 + 1 < wait)
+				wait = (due - now) / 1000000 + 1;
+		}
+
+		if (poll(pfds, nports, wait) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+			return(EXIT_FAILURE);
+		}
+
+		for (i = 0, p = ports; i < nports; i++, p++) {
+			if (pfds[i].revents == 0) continue;
+			if ((len = read(p->fd, p->in + p->inlen,
+			                sizeof(p->in) - 1 - p->inlen)) <= 0)
+				continue;
+			p->inlen += len;
+			p->in[p->inlen] = '\0';
+
+			while ((cr = strpbrk(p->in, "\r\n")) != NULL) {
+				*cr = '\0';
+				if (cr > p->in && p->frame[0] != '\0') {
+					mirrorreply(p, i, p->in, ports, nports);
+				}
+				p->inlen -= cr + 1 - p->in;
+				memmove(p->in, cr + 1, p->inlen + 1);
+			}
+			if (p->inlen == sizeof(p->in) - 1) p->inlen = 0;
+		}
+	}
+
+	mirrorsettled(-1, NULL);
+
+	return(EXIT_SUCCESS);
+}
+
+/*
+ * Write p's next frame, if it has one: the master's next query, or for a
+ * follower a setting the master changed (read first if not known).
+ */
+void
+mirrornext(
+	struct mirrorport *p,
+	int               master
+)
+{
+	char param[8], frame[16];
+	int  k, len;
+
+	if (master == 0) {
+		for (k = (p->key + 1) % MIRROR_KEYS; p->tries[k] > 0;
+		     k = (k + 1) % MIRROR_KEYS) {
+			p->tries[k]--;
+		}
+		snprintf(param, sizeof(param), "?   ");
+	}
+	else {
+		for (k = 0; k < MIRROR_KEYS && p->want[k] == -1; k++)
+			;
+		if (k == MIRROR_KEYS) return;
+
+		if (p->value[k] == -1)
+			snprintf(param, sizeof(param), "?   ");
+		else
+			snprintf(param, sizeof(param), mirrorkeys[k].format, p->want[k]);
+	}
+
+	snprintf(p->frame, sizeof(p->frame), "%.4s%.4s", mirrorkeys[k].code,
+		param);
+	p->key = k;
+	p->framegen = p->gen[k];
+	p->sent = monotime();
+	if (verbose == 1) logmsg("%s: '%s'", p->name, p->frame);
+	len = snprintf(frame, sizeof(frame), "%s\r", p->frame);
+	write(p->fd, frame, len);
+}
+
+/*
+ * Take p's answer to its frame (NULL if it timed out). A master reading
+ * that differs from the last one starts a change; a follower's answer
+ * moves its part of the change along.
+ */
+void
+mirrorreply(
+	struct mirrorport *p,
+	int               index,
+	char              *reply,
+	struct mirrorport ports[],
+	int               nports
+)
+{
+	static struct mirrorchange changes[MIRROR_KEYS];
+	static long long           lastread[MIRROR_KEYS];
+	struct mirrorchange        *c;
+	struct mirrorport          *f;
+	int                        k = p->key, v, query = p->frame[4] == '?',
+	                           sent = atoi(p->frame + 4);
+
+	p->frame[0] = '\0';
+	if (verbose == 1) logmsg("%s: %s", p->name, reply ? reply : "(none)");
+	v = reply != NULL && isdigit(reply[0]) ? atoi(reply) : -1;
+	c = &changes[k];
+
+	if (index == 0) {
+		if (v != -1 && v != p->value[k]) {
+			if (c->pending > 0) mirrorsettled(k, c); /* overtaken */
+			c->from = p->value[k];
+			c->to = v;
+			c->before = lastread[k];
+			c->seen = monotime();
+			c->pending = c->set = c->matched = c->failed = 0;
+			c->gen++;
+			for (f = ports + 1; f < ports + nports; f++) {
+				f->gen[k] = c->gen;
+				if (f->value[k] == v) {
+					f->want[k] = -1;
+					c->matched++;
+				}
+				else {
+					f->want[k] = v;
+					f->tries[k] = 0;
+					c->pending++;
+				}
+			}
+			if (c->pending == 0) mirrorsettled(k, c);
+		}
+		if (v != -1) {  /* a failed read changes nothing */
+			p->value[k] = v;
+			lastread[k] = monotime();
+		}
+		else if (reply != NULL) {  /* e.g. DA2P on an analog channel */
+			p->tries[k] = MIRROR_SKIP;
+		}
+		return;
+	}
+
+	/*
+	 * A follower's answer to a frame written for a change since
+	 * overtaken tells us what it shows, but counts for no change.
+	 */
+	if (p->framegen != c->gen) {
+		if (query && v != -1)
+			p->value[k] = v;
+		else if (!query && reply != NULL && strncmp(reply, "OK", 2) == 0)
+			p->value[k] = sent;
+		else
+			p->value[k] = -1;
+		return;
+	}
+
+	/* A follower: a read of what it shows, or a set. */
+	if (query && v != -1) {
+		p->value[k] = v;
+		if (v != p->want[k]) return; /* set it next */
+		p->want[k] = -1;
+		c->matched++;
+	}
+	else if (!query && reply != NULL && strncmp(reply, "OK", 2) == 0) {
+		p->value[k] = sent;
+		if (sent != p->want[k]) return; /* the master moved on */
+		p->want[k] = -1;
+		c->set++;
+	}
+	else {
+		p->value[k] = -1;
+		if (!query && ++p->tries[k] < MIRROR_TRIES) return;
+		p->want[k] = -1;
+		c->failed++;
+		if (reply == NULL || query) {
+			fprintf(stderr, "%s: %.4s: %s\n", p->name, mirrorkeys[k].code,
+				reply == NULL ? "no response" : reply);
+		}
+	}
+
+	if (--c->pending == 0) mirrorsettled(k, c);
+}
+
+/*
+ * Report a change that has reached every follower (or been overtaken),
+ * timed from the master's read that saw it and from the read before,
+ * which bounds when it was really made. k of -1 prints the summary.
+ */
+void
+mirrorsettled(
+	int                 k,
+	struct mirrorchange *c
+)
+{
+	static struct timings seen, made;
+	long long             now = monotime();
+
+	if (k == -1) {
+		if (seen.total == 0) return;
+		printf("%u changes; followers updated after the master's read: "
+			"p50 <%lld ms, p99 <%lld ms, max %.1f ms; after the change, "
+			"at most: p50 <%lld ms, p99 <%lld ms, max %.1f ms\n",
+			seen.total, timingpercentile(&seen, 50) / 1000,
+			timingpercentile(&seen, 99) / 1000, seen.worst / 1e6,
+			timingpercentile(&made, 50) / 1000,
+			timingpercentile(&made, 99) / 1000, made.worst / 1e6);
+		return;
+	}
+
+	if (c->from == -1) {
+		printf("%.4s %d: %d set, %d matched", mirrorkeys[k].code, c->to,
+			c->set, c->matched);
+	}
+	else {
+		printf("%.4s %d -> %d: %d set, %d matched", mirrorkeys[k].code,
+			c->from, c->to, c->set, c->matched);
+		addtiming(&seen, now - c->seen);
+		addtiming(&made, now - c->before);
+	}
+	if (c->failed > 0) printf(", %d failed", c->failed);
+	if (c->pending > 0) printf(", %d overtaken", c->pending);
+	printf(" in %.1f ms (%.1f ms at most since the change)\n",
+		(now - c->seen) / 1e6,
+		(now - (c->from == -1 ? c->seen : c->before)) / 1e6);
+	c->pending = 0;
+}
+
+/*
+ * Load the inventory: a line per TV, its port and then its tags, with
+ * '#' comments:
+ *
+ *     /dev/ttyUSB0  floor=3 type=lobby
+ *     /dev/ttyUSB1  floor=3 type=bar maintenance
+ *
+ * Returns the number of TVs, or -1 if the file can't be read.
+ */
+int
+loadfleet(
+	char         *path,
+	struct fleet *f
+)
+{
+	FILE *fp;
+	char line[1024], *port, *tags, *hash;
+
+	memset(f, 0, sizeof(*f));
+	if ((fp = fopen(path, "r")) == NULL) return(-1);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((hash = strchr(line, '#')) != NULL) *hash = '\0';
+		line[strcspn(line, "\r\n")] = '\0';
+		port = line + strspn(line, " \t");
+		if (*port == '\0') continue;
+		tags = port + strcspn(port, " \t");
+		if (*tags != '\0') *tags++ = '\0';
+		if (fleetadd(f, port, tags) == -1) {
+			fclose(fp);
+			return(-1); /* never part of the inventory */
+		}
+	}
+	fclose(fp);
+
+	return(f->count);
+}
+
+/* Add a TV and its space separated tags. Returns -1 if out of memory. */
+int
+fleetadd(
+	struct fleet *f,
+	char         *port,
+	char         *tags
+)
+{
+	char *copy, *tag, *save;
+	int  i, slot, alloc;
+
+	/* Sets grow a word (64 TVs) at a time, doubling. */
+	if (f->count == f->alloc) {
+		alloc = f->alloc ? f->alloc * 2 : 64;
+		if ((f->ports = realloc(f->ports, alloc * sizeof(char *))) == NULL ||
+		    (f->tagtext = realloc(f->tagtext, alloc * sizeof(char *))) ==
+		    NULL ||
+		    (f->stack = realloc(f->stack, FLEET_DEPTH * alloc / 8)) == NULL)
+			return(-1);
+		for (i = 0; i < f->hashsize; i++) {
+			if (f->tags[i] == NULL) continue;
+			if ((f->bits[i] = realloc(f->bits[i], alloc / 8)) == NULL)
+				return(-1);
+			memset(f->bits[i] + f->alloc / 64, 0, (alloc - f->alloc) / 8);
+		}
+		f->alloc = alloc;
+	}
+
+	if ((f->ports[f->count] = strdup(port)) == NULL ||
+	    (f->tagtext[f->count] = strdup(tags)) == NULL ||
+	    (copy = strdup(tags)) == NULL)
+		return(-1);
+
+	for (tag = strtok_r(copy, " \t", &save); tag != NULL;
+	     tag = strtok_r(NULL, " \t", &save)) {
+		if ((slot = fleettag(f, tag, 1)) == -1) {
+			free(copy);
+			return(-1);
+		}
+		f->bits[slot][f->count / 64] |= 1ULL << (f->count % 64);
+	}
+	free(copy);
+	f->count++;
+
+	return(0);
+}
+
+/*
+ * The slot holding tag's set, added (empty) if create is set. Returns -1
+ * if it isn't there, or out of memory.
+ */
+int
+fleettag(
+	struct fleet *f,
+	char         *tag,
+	int          create
+)
+{
+	uint32_t h;
+
+	if (create && f->ntags >= f->hashsize / 2 && fleetgrow(f) == -1)
+		return(-1);
+	if (f->hashsize == 0) return(-1);
+
+	for (h = fleethash(tag) & (f->hashsize - 1); f->tags[h] != NULL;
+	     h = (h + 1) & (f->hashsize - 1)) {
+		if (strcmp(f->tags[h], tag) == 0) return(h);
+	}
+	if (!create) return(-1);
+
+	if ((f->tags[h] = strdup(tag)) == NULL ||
+	    (f->bits[h] = calloc(f->alloc / 64, sizeof(uint64_t))) == NULL)
+		return(-1);
+	f->ntags++;
+
+	return(h);
+}
+
+/* Double the tag slots (or make the first), moving each set over. */
+int
+fleetgrow(
+	struct fleet *f
+)
+{
+	char     **tags;
+	uint64_t **bits;
+	uint32_t h;
+	int      i, size = f->hashsize ? f->hashsize * 2 : FLEET_HASH;
+
+	if ((tags = calloc(size, sizeof(char *))) == NULL) return(-1);
+	if ((bits = calloc(size, sizeof(uint64_t *))) == NULL) {
+		free(tags);
+		return(-1);
+	}
+
+	for (i = 0; i < f->hashsize; i++) {
+		if (f->tags[i] == NULL) continue;
+		for (h = fleethash(f->tags[i]) & (size - 1); tags[h] != NULL;
+		     h = (h + 1) & (size - 1))
+			;
+		tags[h] = f->tags[i];
+		bits[h] = f->bits[i];
+	}
+	free(f->tags);
+	free(f->bits);
+	f->tags = tags;
+	f->bits = bits;
+	f->hashsize = size;
+
+	return(0);
+}
+
+/* FNV-1a, for the tag slots. */
+uint32_t
+fleethash(
+	char *tag
+)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *tag != '\0'; tag++) h = (h ^ (unsigned char) *tag) * 16777619u;
+
+	return(h);
+}
+
+/*
+ * Compile a selector such as "floor=3 & type=lobby & !maintenance" into
+ * ops: tags joined by & (and), | (or) and ! (not), with parentheses; &
+ * binds tighter than |, and "*" is every TV. A tag no TV has selects
+ * none, with a warning. Returns how many ops, or -1 with error set.
+ */
+int
+compileselector(
+	struct fleet   *f,
+	char           *selector,
+	struct fleetop ops[],
+	char           *error,
+	size_t         size
+)
+{
+	char *p = selector;
+	int  n = 0, depth = 0;
+
+	if (selectorlevel(f, &p, ops, &n, &depth, 0, 0) == -1 || *p != '\0') {
+		snprintf(error, size, "bad selector at column %d",
+			(int) (p - selector) + 1);
+		return(-1);
+	}
+	if (depth > FLEET_DEPTH) {
+		snprintf(error, size, "selector nests too deep");
+		return(-1);
+	}
+
+	return(n);
+}
+
+/*
+ * Recursive descent: an expression is terms joined by |, a term is
+ * factors joined by &, and a factor is !factor, (expression) or a tag.
+ * Ops are emitted postfix; depth tracks the most sets held at once. The
+ * level argument is 0 for an expression, 1 for a term and 2 for a factor.
+ */
+int
+selectorlevel(
+	struct fleet   *f,
+	char           **p,
+	struct fleetop ops[],
+	int            *n,
+	int            *depth,
+	int            level,
+	int            held
+)
+{
+	char tag[128];
+	int  len, op, slot = -1;
+
+	while (**p == ' ' || **p == '\t') (*p)++;
+
+	if (level == 2) {
+		if (**p == '!') {
+			(*p)++;
+			if (selectorlevel(f, p, ops, n, depth, 2, held) == -1)
+				return(-1);
+			op = FLEET_NOT;
+		}
+		else if (**p == '(') {
+			(*p)++;
+			if (selectorlevel(f, p, ops, n, depth, 0, held) == -1 ||
+			    **p != ')')
+				return(-1);
+			(*p)++;
+			op = -1;
+		}
+		else {
+			len = strcspn(*p, " \t&|!()");
+			if (len == 0 || len >= sizeof(tag)) return(-1);
+			memcpy(tag, *p, len);
+			tag[len] = '\0';
+			*p += len;
+			if (held + 1 > *depth) *depth = held + 1;
+
+			if (strcmp(tag, "*") == 0) {
+				op = FLEET_ALL;
+			}
+			else if ((slot = fleettag(f, tag, 0)) == -1) {
+				fprintf(stderr, "no TV is tagged %s\n", tag);
+				op = FLEET_NONE;
+			}
+			else {
+				op = FLEET_TAG;
+			}
+			if (*n >= FLEET_OPS) return(-1);
+			ops[*n].op = op;
+			ops[(*n)++].tag = slot;
+			op = -1;
+		}
+		if (op != -1) {
+			if (*n >= FLEET_OPS) return(-1);
+			ops[(*n)++].op = op;
+		}
+		while (**p == ' ' || **p == '\t') (*p)++;
+		return(0);
+	}
+
+	if (selectorlevel(f, p, ops, n, depth, level + 1, held) == -1)
+		return(-1);
+	while (**p == (level == 0 ? '|' : '&')) {
+		(*p)++;
+		if (selectorlevel(f, p, ops, n, depth, level + 1, held + 1) == -1 ||
+		    *n >= FLEET_OPS)
+			return(-1);
+		ops[(*n)++].op = level == 0 ? FLEET_OR : FLEET_AND;
+	}
+
+	return(0);
+}
+
+/*
+ * Evaluate compiled ops into out (a set of the fleet's size), a word at
+ * a time. Returns how many TVs it holds.
+ */
+int
+resolveselector(
+	struct fleet   *f,
+	struct fleetop ops[],
+	int            nops,
+	uint64_t       out[]
+)
+{
+	uint64_t *a, *b, tail;
+	int      words = (f->count + 63) / 64, sp = 0, i, w, count = 0;
+
+	tail = f->count % 64 ? (1ULL << (f->count % 64)) - 1 : ~0ULL;
+
+	for (i = 0; i < nops; i++) {
+		a = f->stack + (sp - 1) * words;
+		b = f->stack + sp * words;
+
+		switch (ops[i].op) {
+			case FLEET_TAG:
+				memcpy(b, f->bits[ops[i].tag], words * sizeof(uint64_t));
+				sp++;
+				break;
+
+			case FLEET_NONE:
+			case FLEET_ALL:
+				memset(b, ops[i].op == FLEET_ALL ? 0xff : 0,
+					words * sizeof(uint64_t));
+				sp++;
+				break;
+
+			case FLEET_NOT:
+				for (w = 0; w < words; w++) a[w] = ~a[w];
+				break;
+
+			case FLEET_AND:
+				a = f->stack + (sp - 2) * words;
+				b = f->stack + (sp - 1) * words;
+				for (w = 0; w < words; w++) a[w] &= b[w];
+				sp--;
+				break;
+
+			case FLEET_OR:
+				a = f->stack + (sp - 2) * words;
+				b = f->stack + (sp - 1) * words;
+				for (w = 0; w < words; w++) a[w] |= b[w];
+				sp--;
+				break;
+		}
+	}
+
+	/* NOT and ALL set the bits past the last TV too. */
+	if (words > 0) f->stack[words - 1] &= tail;
+	memcpy(out, f->stack, words * sizeof(uint64_t));
+	for (w = 0; w < words; w++) count += __builtin_popcountll(out[w]);
+
+	return(count);
+}
+
+/*
+ * fleet {selector} [command [arg ...]]: pick TVs from the inventory and
+ * list them, or send them all the command.
+ */
+int
+fleet(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct fleet   f;
+	struct fleetop ops[FLEET_OPS];
+	struct frame   frames[MAX_FRAMES];
+	uint64_t       *set;
+	char           error[64], **picked, *path = statepath(FLEET_FILE);
+	int            nops, count, opcode, n = 0, i, j, status;
+	long long      start;
+
+	if (argc < 1) {
+		fprintf(stderr, "%s: fleet needs a selector.\n", progname);
+		return(EXIT_FAILURE);
+	}
+
+	/* The command is checked before anything is sent. */
+	if (argc >= 2 &&
+	    ((opcode = checkcmd(argv[1])) == CMD_NONE || opcode >= CMD_LEARN ||
+	     (n = encodecommand(progname, opcode, argv[1], argc >= 3 ? argv[2] : "",
+	                        argc >= 4 ? argv[3] : "", frames)) <= 0)) {
+		if (opcode == CMD_NONE || opcode >= CMD_LEARN)
+			fprintf(stderr, "%s: fleet can't send '%s'.\n", progname, argv[1]);
+		return(EXIT_FAILURE);
+	}
+
+	if (loadfleet(path, &f) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	if ((nops = compileselector(&f, argv[0], ops, error, sizeof(error))) ==
+	    -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, argv[0], error);
+		return(EXIT_FAILURE);
+	}
+
+	if ((set = calloc((f.count + 63) / 64 + 1, sizeof(uint64_t))) == NULL ||
+	    (picked = calloc(f.count + 1, sizeof(char *))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", progname);
+		return(EXIT_FAILURE);
+	}
+	start = monotime();
+	count = resolveselector(&f, ops, nops, set);
+	if (verbose == 1) {
+		logmsg("%d of %d TVs in %.1f us", count, f.count,
+			(monotime() - start) / 1e3);
+	}
+	for (i = j = 0; i < f.count; i++) {
+		if (set[i / 64] & (1ULL << (i % 64))) picked[j++] = f.ports[i];
+	}
+
+	if (argc < 2) {
+		for (i = 0; i < count; i++) printf("%s\n", picked[i]);
+		return(EXIT_SUCCESS);
+	}
+	if (nosend == 1) {
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < n; j++) {
+				printf("%s: command='%s', parameter='%s'\n", picked[i],
+					frames[j].command, frames[j].param);
+			}
+		}
+		return(EXIT_SUCCESS);
+	}
+
+	status = fleetsend(progname, picked, count, frames, n);
+	free(picked);
+	free(set);
+
+	return(status);
+}
+
+/*
+ * Send frames to each port, FLEET_BATCH ports at a time, all of a
+ * batch at once from one poll() loop. Ports held by others are skipped.
+ * Each TV's outcome goes to stdout, as from raw.
+ */
+int
+fleetsend(
+	char         *progname,
+	char         **ports,
+	int          nports,
+	struct frame frames[],
+	int          nframes
+)
+{
+	struct fleetport {
+		int       fd, lock;
+		int       next;      /* frame to write, or nframes once done */
+		long long sent;      /* 0 if not waiting for a reply */
+		char      in[32];
+		int       inlen;
+	} batch[FLEET_BATCH], *p;
+	struct pollfd pfds[FLEET_BATCH];
+	char          frame[16], *cr;
+	int           first, count, left, i, len, wait, ok = 0, failed = 0;
+	long long     start = monotime(), now, due;
+
+	for (first = 0; first < nports; first += count) {
+		count = nports - first < FLEET_BATCH ? nports - first : FLEET_BATCH;
+		left = count;
+		for (i = 0, p = batch; i < count; i++, p++) {
+			memset(p, 0, sizeof(*p));
+			if ((p->fd = claimport(progname, ports[first + i], &p->lock)) ==
+			    -1) {
+				p->next = nframes;
+				failed++;
+				left--;
+				continue;
+			}
+			fcntl(p->fd, F_SETFL, O_NONBLOCK);
+		}
+
+		while (left > 0) {
+			now = monotime();
+			wait = -1;
+			for (i = 0, p = batch; i < count; i++, p++) {
+				pfds[i].fd = p->next < nframes ? p->fd : -1;
+				pfds[i].events = POLLIN;
+				pfds[i].revents = 0;
+				if (p->next == nframes) continue;
+
+				/* Frames that get no reply just go; the next follows. */
+				while (p->sent == 0 && p->next < nframes) {
+					len = snprintf(frame, sizeof(frame), "%.4s%.4s\r",
+						frames[p->next].command, frames[p->next].param);
+					write(p->fd, frame, len);
+					if (!noreply(frames[p->next].command)) {
+						p->sent = now;
+						break;
+					}
+					if (++p->next == nframes) {
+						printf("%s\tsent\n", ports[first + i]);
+						ok++;
+						left--;
+					}
+				}
+				if (p->sent == 0) continue;
+
+				due = p->sent + cfg.timeout_default * 1000000LL;
+				if (now >= due) {
+					printf("%s\tno response\n", ports[first + i]);
+					p->next = nframes;
+					failed++;
+					left--;
+					continue;
+				}
+				if (wait == -1 || (due - now) / 1000000 + 1 < wait)
+					wait = (due - now) / 1000000 + 1;
+			}
+			if (left == 0) break;
+
+			if (poll(pfds, count, wait) < 0 && errno != EINTR) break;
+
+			for (i = 0, p = batch; i < count; i++, p++) {
+				if (pfds[i].revents == 0 || p->next == nframes) continue;
+				if ((len = read(p->fd, p->in + p->inlen,
+				                sizeof(p->in) - 1 - p->inlen)) <= 0)
+					continue;
+				p->inlen += len;
+				p->in[p->inlen] = '\0';
+				if ((cr = strchr(p->in, '\r')) == NULL) {
+					if (p->inlen == sizeof(p->in) - 1) p->inlen = 0;
+					continue;
+				}
+				*cr = '\0';
+				p->inlen = 0;
+				p->sent = 0;
+
+				if (strncmp(p->in, "OK", 2) == 0 && ++p->next < nframes)
+					continue;
+				printf("%s\t%s\n", ports[first + i], p->in);
+				p->next = nframes;
+				if (strncmp(p->in, "OK", 2) == 0) ok++; else failed++;
+				left--;
+			}
+		}
+
+		for (i = 0, p = batch; i < count; i++, p++) {
+			if (p->fd == -1) continue;
+			close(p->fd);
+			close(p->lock);
+		}
+	}
+
+	if (verbose == 1) {
+		logmsg("fleet: %d OK, %d failed, in %.1f ms", ok, failed,
+			(monotime() - start) / 1e6);
+	}
+
+	return(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * simulate {count} [--tcp port] [--latency ms[/spread%]]
+ * [--faults err%[,drop%]] [--seed n]: stand in for count TVs, on ptys
+ * or on loopback TCP ports from port up, all served by one epoll()
+ * loop. Each TV keeps what the TV codes set and answers queries from
+ * it. Its turn at a frame is drawn once, around the median latency, and
+ * each reply strays up to SIM_JITTER% from that; the TV answers in
+ * order. Fault rates are drawn per TV around the fleet's (up to twice
+ * it): that share of frames gets ERR, or no reply at all. The TVs are
+ * listed on stdout as an inventory, tagged sim and, where it applies,
+ * slow or flaky; how late replies went out is reported at SIGINT or
+ * SIGTERM.
+ */
+int
+simulate(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct epoll_event events[SIM_EVENTS];
+	struct simreply    r;
+	struct simline     *l;
+	struct simtv       *t;
+	struct rlimit      rl;
+	FILE               *fp;
+	char               name[64];
+	int                count, tcp = 0, latency = SIM_LATENCY;
+	int                spread = SIM_SPREAD, err = 0, drop = 0, seed = 1;
+	int                i, k, n, c, wait, on = 1;
+	long               pages = 0;
+	long long          start = monotime(), now, need;
+	double             z;
+
+	if (argc < 1 || (count = atoi(argv[0])) < 1 || count > SIM_MAX) {
+		fprintf(stderr, "%s: simulate needs a count of TVs (1-%d).\n",
+			progname, SIM_MAX);
+		return(EXIT_FAILURE);
+	}
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--tcp") == 0 && i + 1 < argc) {
+			tcp = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+			sscanf(argv[++i], "%d/%d", &latency, &spread);
+		}
+		else if (strcmp(argv[i], "--faults") == 0 && i + 1 < argc) {
+			sscanf(argv[++i], "%d,%d", &err, &drop);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = atoi(argv[++i]);
+		}
+		else {
+			break;
+		}
+	}
+	if (i < argc || tcp < 0 || tcp + count - 1 > 65535 || latency < 1 ||
+	    spread < 0 || spread > 100 || err < 0 || drop < 0 || err + drop > 50) {
+		fprintf(stderr, "%s: simulate {count} [--tcp port] "
+			"[--latency ms[/spread%%]] [--faults err%%[,drop%%]] [--seed n]\n",
+			progname);
+		return(EXIT_FAILURE);
+	}
+
+	/* A pty takes two descriptors; a listener one, and one per client. */
+	need = tcp ? count + 1024LL : 2LL * count + 64;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+		rl.rlim_cur = rl.rlim_max < need ? rl.rlim_max : need;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur < need) {
+			fprintf(stderr, "%s: %d TVs need %lld descriptors, the limit "
+				"is %ld\n", progname, count, need, (long) rl.rlim_max);
+			return(EXIT_FAILURE);
+		}
+	}
+
+	memset(&sim, 0, sizeof(sim));
+	sim.rng = (uint64_t) seed * 0x9e3779b97f4a7c15ULL | 1;
+	if ((sim.tvs = calloc(count, sizeof(struct simtv))) == NULL ||
+	    (sim.epoll = epoll_create1(0)) == -1) {
+		fprintf(stderr, "%s: simulate: %s\n", progname, strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	setvbuf(stdout, NULL, _IOFBF, 0);
+	for (i = 0, t = sim.tvs; i < count; i++, t++) {
+		/* Roughly normal: the sum of 12 uniform draws, less 6. */
+		for (z = -6, k = 0; k < 12; k++) z += simrandom() / 4294967296.0;
+		z = latency * 1000.0 * (1 + spread * z / 100);
+		t->turn = z < latency * 250.0 ? latency * 250 : (uint32_t) z;
+		t->err = (uint64_t) simrandom() * err * 2 * 65536 / 100 >> 32;
+		t->drop = (uint64_t) simrandom() * drop * 2 * 65536 / 100 >> 32;
+		for (k = 0; k < SIM_CODES; k++) t->value[k] = simcodes[k].initial;
+
+		if (simopen(progname, t, i, tcp ? tcp + i : 0, name, sizeof(name)) ==
+		    -1) {
+			fprintf(stderr, "%s: %d of %d TVs started\n", progname, i, count);
+			return(EXIT_FAILURE);
+		}
+		sim.ntvs++;
+		printf("%s\tsim%s%s\n", name,
+			t->turn >= latency * 1500 ? " slow" : "",
+			err + drop > 0 && t->err + t->drop >= (err + drop) * 983 ?
+			" flaky" : ""); /* 1.5 times the fleet's rate, in 65536ths */
+	}
+	fflush(stdout);
+
+	if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+		fscanf(fp, "%*d %ld", &pages);
+		fclose(fp);
+	}
+	if (tcp) {
+		snprintf(name, sizeof(name), "TCP ports %d-%d", tcp, tcp + count - 1);
+	}
+	fprintf(stderr, "simulate: %d TVs on %s up in %.1f ms; %zu bytes a TV, "
+		"%ld kB resident\n", count, tcp ? name : "ptys",
+		(monotime() - start) / 1e6,
+		sizeof(struct simtv) + (tcp ? 0 : sizeof(struct simline)),
+		pages * sysconf(_SC_PAGESIZE) / 1024);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stopserving);
+	signal(SIGTERM, stopserving);
+
+	while (!serving_stopped) {
+		now = monotime();
+		while (sim.nheap > 0 && sim.heap[0].due <= now) {
+			simpop(&r);
+			l = &sim.lines[r.line];
+			if (l->fd == -1 || l->gen != r.gen) continue;
+			write(l->fd, r.text, strlen(r.text));
+			addtiming(&sim.late, now - r.due);
+			sim.replies++;
+		}
+		wait = sim.nheap > 0 ? (sim.heap[0].due - now + 999999) / 1000000 : -1;
+
+		if ((n = epoll_wait(sim.epoll, events, SIM_EVENTS, wait)) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "%s: epoll_wait: %s\n", progname, strerror(errno));
+			return(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((events[i].data.u64 >> 32) == 0) {
+				simread((int) events[i].data.u64);
+				continue;
+			}
+			/* A listener: take every client waiting. */
+			k = (int) (events[i].data.u64 & 0xffffffff);
+			while ((c = accept4(sim.tvs[k].fd, NULL, NULL, SOCK_NONBLOCK)) !=
+			       -1) {
+				setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				if (simaddline(c, k) == -1) {
+					close(c);
+					continue;
+				}
+				sim.connections++;
+			}
+		}
+	}
+
+	if (tcp) fprintf(stderr, "simulate: %lu connections\n", sim.connections);
+	fprintf(stderr, "simulate: %lu frames, %lu replies (%lu ERR and %lu "
+		"dropped by faults); replies late by p50 <%lld us, p99 <%lld us, "
+		"max %.1f us\n", sim.frames, sim.replies, sim.errors, sim.drops,
+		timingpercentile(&sim.late, 50), timingpercentile(&sim.late, 99),
+		sim.late.worst / 1e3);
+
+	return(EXIT_SUCCESS);
+}
+
+/*
+ * Give TV number index its endpoint, watched by the epoll set: a pty,
+ * or a listener on 127.0.0.1:port if port isn't 0. The name to open
+ * it by is left in name. Returns -1 after saying why.
+ */
+int
+simopen(
+	char         *progname,
+	struct simtv *t,
+	int          index,
+	int          port,
+	char         *name,
+	int          size
+)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	struct termios     options;
+	char               *slave;
+	int                on = 1;
+
+	if (port == 0) {
+		if ((t->fd = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+		    grantpt(t->fd) == -1 || unlockpt(t->fd) == -1 ||
+		    (slave = ptsname(t->fd)) == NULL ||
+		    (t->slave = open(slave, O_RDWR | O_NOCTTY)) == -1) {
+			fprintf(stderr, "%s: pty: %s%s\n", progname, strerror(errno),
+				errno == ENOSPC ? " (kernel.pty.max; --tcp has no such limit)" :
+				"");
+			return(-1);
+		}
+		snprintf(name, size, "%s", slave);
+
+		/* Raw until a client sets it up, so replies aren't echoed back. */
+		tcgetattr(t->slave, &options);
+		cfmakeraw(&options);
+		tcsetattr(t->slave, TCSANOW, &options);
+		fcntl(t->fd, F_SETFL, O_NONBLOCK);
+		if (simaddline(t->fd, index) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+			return(-1);
+		}
+		return(0);
+	}
+
+	t->slave = -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	ev.events = EPOLLIN;
+	ev.data.u64 = 1ULL << 32 | index;
+	if ((t->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1 ||
+	    setsockopt(t->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(t->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(t->fd, 16) == -1 ||
+	    epoll_ctl(sim.epoll, EPOLL_CTL_ADD, t->fd, &ev) == -1) {
+		fprintf(stderr, "%s: port %d: %s\n", progname, port, strerror(errno));
+		return(-1);
+	}
+	snprintf(name, size, "tcp:127.0.0.1:%d", port);
+
+	return(0);
+}
+
+/* Watch fd for frames to TV tv. Returns its line, or -1. */
+int
+simaddline(
+	int fd,
+	int tv
+)
+{
+	struct epoll_event ev;
+	struct simline     *l;
+	int                i, size, *spare;
+
+	if (sim.nspare > 0) {
+		i = sim.spare[--sim.nspare];
+	}
+	else {
+		if (sim.nlines == sim.linesize) {
+			size = sim.linesize ? sim.linesize * 2 : 256;
+			if ((l = realloc(sim.lines, size * sizeof(*l))) == NULL)
+				return(-1);
+			sim.lines = l;
+			if ((spare = realloc(sim.spare, size * sizeof(int))) == NULL)
+				return(-1);
+			sim.spare = spare;
+			sim.linesize = size;
+		}
+		i = sim.nlines++;
+		sim.lines[i].gen = 0;
+	}
+
+	l = &sim.lines[i];
+	l->fd = fd;
+	l->tv = tv;
+	l->inlen = 0;
+	ev.events = EPOLLIN;
+	ev.data.u64 = i;
+	if (epoll_ctl(sim.epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		l->fd = -1;
+		sim.spare[sim.nspare++] = i;
+		return(-1);
+	}
+
+	return(i);
+}
+
+/* A client has gone: free its line, and forget its replies. */
+void
+simdropline(
+	int i
+)
+{
+	close(sim.lines[i].fd);
+	sim.lines[i].fd = -1;
+	sim.lines[i].gen++;
+	sim.spare[sim.nspare++] = i;
+}
+
+/* Take what has come in on line i, and queue the TV's replies. */
+void
+simread(
+	int i
+)
+{
+	struct simline  *l = &sim.lines[i];
+	struct simtv    *t = &sim.tvs[l->tv];
+	struct simreply r;
+	char            frame[9], *cr;
+	int             len, jitter;
+	long long       now;
+
+	if ((len = read(l->fd, l->in + l->inlen, sizeof(l->in) - 1 - l->inlen)) <=
+	    0) {
+		if (t->slave == -1 && (len == 0 || errno != EAGAIN)) simdropline(i);
+		return;
+	}
+	l->inlen += len;
+	l->in[l->inlen] = '\0';
+
+	/*
+	 * Clients set TIOCEXCL, which outlives them while the slave is held
+	 * here; clear it so the next one can open the pty.
+	 */
+	if (t->slave != -1) ioctl(t->slave, TIOCNXCL);
+
+	now = monotime();
+	while ((cr = strchr(l->in, '\r')) != NULL) {
+		*cr = '\0';
+		snprintf(frame, sizeof(frame), "%-8.8s",
+			cr - l->in > 8 ? cr - 8 : l->in);
+		if ((len = simframe(t, frame, r.text)) != -1) {
+			jitter = (int) (simrandom() % (2 * SIM_JITTER + 1)) - SIM_JITTER;
+			t->busy = (t->busy > now ? t->busy : now) +
+				t->turn * (100LL + jitter) * 10;
+			if (len == 1) {
+				r.due = t->busy;
+				r.line = i;
+				r.gen = l->gen;
+				simpush(&r);
+			}
+		}
+		l->inlen -= cr + 1 - l->in;
+		memmove(l->in, cr + 1, l->inlen + 1);
+	}
+	if (l->inlen == sizeof(l->in) - 1) l->inlen = 0;
+}
+
+/*
+ * Act on a frame as TV t would. Returns 1 with the reply (and CR) in
+ * reply, 0 if the TV takes it silently (CHUP, CHDW), or -1 if a fault
+ * lost it. A TV that is off answers nothing but POWR and RSPW.
+ */
+int
+simframe(
+	struct simtv *t,
+	char         *frame,
+	char         *reply
+)
+{
+	static int power = -1, standby, input, channel;
+	char       param[5], *c;
+	int        k, v;
+
+	if (power == -1) {
+		power = simcode("POWR");
+		standby = simcode("RSPW");
+		input = simcode("IAVD");
+		channel = simcode("DCCH");
+	}
+
+	sim.frames++;
+	if ((simrandom() & 0xffff) < t->drop) {
+		sim.drops++;
+		return(-1);
+	}
+
+	if (strncmp(frame, "CHUP", 4) == 0 || strncmp(frame, "CHDW", 4) == 0) {
+		if (t->value[power] == 1) {
+			v = t->value[channel] + (frame[2] == 'U' ? 1 : -1);
+			if (v > simcodes[channel].max) v = simcodes[channel].min;
+			if (v < simcodes[channel].min) v = simcodes[channel].max;
+			t->value[channel] = v;
+		}
+		return(0);
+	}
+
+	strcpy(reply, "ERR\r");
+	if ((k = simcode(frame)) == -1 ||
+	    (t->value[power] == 0 && k != power && k != standby))
+		return(1);
+
+	snprintf(param, sizeof(param), "%.4s", frame + 4);
+	if (param[0] == '?') {
+		if (simcodes[k].initial != -1) sprintf(reply, "%d\r", t->value[k]);
+		return(1);
+	}
+	for (c = param; isdigit((unsigned char) *c); c++);
+	if (c == param || c[strspn(c, " ")] != '\0') return(1);
+	if ((v = atoi(param)) < simcodes[k].min || v > simcodes[k].max)
+		return(1);
+	if ((simrandom() & 0xffff) < t->err) {
+		sim.errors++;
+		return(1);
+	}
+
+	if (simcodes[k].initial != -1) t->value[k] = v;
+	if (strncmp(frame, "ITVD", 4) == 0) t->value[input] = 0;
+	strcpy(reply, "OK\r");
+
+	return(1);
+}
+
+/* The simcodes index of frame's code, or -1. */
+int
+simcode(
+	char *frame
+)
+{
+	int k;
+
+	for (k = 0; k < SIM_CODES; k++) {
+		if (strncmp(frame, simcodes[k].code, 4) == 0) return(k);
+	}
+
+	return(-1);
+}
+
+/* xorshift64*: fast, and the same run to run for a given --seed. */
+uint32_t
+simrandom(void)
+{
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+
+	return((sim.rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/* Queue a reply on the heap, ordered by when it is due. */
+void
+simpush(
+	struct simreply *r
+)
+{
+	struct simreply *heap;
+	int             i, parent, size;
+
+	if (sim.nheap == sim.heapsize) {
+		size = sim.heapsize ? sim.heapsize * 2 : 1024;
+		if ((heap = realloc(sim.heap, size * sizeof(*heap))) == NULL) return;
+		sim.heap = heap;
+		sim.heapsize = size;
+	}
+
+	for (i = sim.nheap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (sim.heap[parent].due <= r->due) break;
+		sim.heap[i] = sim.heap[parent];
+	}
+	sim.heap[i] = *r;
+}
+
+/* Take the soonest reply off the heap. */
+void
+simpop(
+	struct simreply *r
+)
+{
+	struct simreply last;
+	int             i, child;
+
+	*r = sim.heap[0];
+	last = sim.heap[--sim.nheap];
+	for (i = 0; (child = 2 * i + 1) < sim.nheap; i = child) {
+		if (child + 1 < sim.nheap &&
+		    sim.heap[child + 1].due < sim.heap[child].due)
+			child++;
+		if (last.due <= sim.heap[child].due) break;
+		sim.heap[i] = sim.heap[child];
+	}
+	sim.heap[i] = last;
+}
+
+/*
+ * Open a handle on port for threaded programs (see aquos.h): the port
+ * is claimed and locked as by the broker, and a thread of its own
+ * sends what is submitted. The library build reads the config file on
+ * first use; aquosctl itself already has.
+ */
+struct aquos *
+aquosopen(
+	const char *port
+)
+{
+	struct aquos *h;
+	int          pfd, lock;
+
+#ifdef AQUOS_LIBRARY
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, loadconfig);
+#endif
+
+	if ((pfd = claimport("aquos", (char *) port, &lock)) == -1) return(NULL);
+	if ((h = aquosattach(pfd, lock)) == NULL) {
+		close(pfd);
+		close(lock);
+	}
+
+	return(h);
+}
+
+/* Make a handle on an open, set up port; lock is closed with it. */
+struct aquos *
+aquosattach(
+	int pfd,
+	int lock
+)
+{
+	struct aquos *h;
+	sigset_t     all, old;
+	int          i, started;
+
+	if (posix_memalign((void **) &h, 64, sizeof(*h)) != 0) return(NULL);
+	memset(h, 0, sizeof(*h));
+	for (i = 0; i < AQUOS_RING; i++) atomic_init(&h->slot[i].seq, i);
+	h->fd = pfd;
+	h->lock = lock;
+	h->window = cfg.window < 1 ? 1 :
+		(cfg.window > WINDOW_MAX ? WINDOW_MAX : cfg.window);
+	if ((h->wake = eventfd(0, EFD_CLOEXEC)) == -1 ||
+	    (h->events = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		if (h->wake != -1) close(h->wake);
+		free(h);
+		return(NULL);
+	}
+	fcntl(pfd, F_SETFL, O_NONBLOCK);
+
+	/* Signals are for the caller's threads; ours inherits this mask. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	started = (pthread_create(&h->thread, NULL, aquosthread, h) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!started) {
+		close(h->wake);
+		close(h->events);
+		free(h);
+		return(NULL);
+	}
+
+	return(h);
+}
+
+/*
+ * Queue a frame from any thread. The slot at head is claimed with a
+ * compare-and-swap (a lost race just tries the next position), filled,
+ * and published by its seq. The handle's thread is woken only if it
+ * said it might sleep, and then by just one submitter.
+ */
+int
+aquossubmit(
+	struct aquos *h,
+	const char   *frame,
+	aquosdone    done,
+	void         *arg
+)
+{
+	struct aquosslot *s;
+	unsigned long    pos, seq;
+	uint64_t         one = 1;
+
+	if (atomic_load_explicit(&h->closing, memory_order_relaxed)) {
+		errno = EPIPE;
+		return(-1);
+	}
+	if (badframe((char *) frame)) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	pos = atomic_load_explicit(&h->head, memory_order_relaxed);
+	for (;;) {
+		s = &h->slot[pos & (AQUOS_RING - 1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&h->head, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if ((long) (seq - pos) < 0) {
+			errno = EAGAIN; /* full: the thread is a lap behind */
+			return(-1);
+		}
+		else {
+			pos = atomic_load_explicit(&h->head, memory_order_relaxed);
+		}
+	}
+
+	memcpy(s->frame, frame, 9);
+	s->done = done;
+	s->arg = arg;
+	s->queued = monotime();
+	atomic_store(&s->seq, pos + 1);
+
+	if (atomic_load(&h->sleeping) && atomic_exchange(&h->sleeping, 0))
+		write(h->wake, &one, sizeof(one));
+
+	return(0);
+}
+
+int
+aquosfd(
+	struct aquos *h
+)
+{
+	return(h->events);
+}
+
+/* Let the thread finish what is queued, then free everything. */
+void
+aquosclose(
+	struct aquos *h
+)
+{
+	uint64_t one = 1;
+
+	atomic_store(&h->closing, 1);
+	write(h->wake, &one, sizeof(one));
+	pthread_join(h->thread, NULL);
+
+	close(h->fd);
+	if (h->lock != -1) close(h->lock);
+	close(h->wake);
+	close(h->events);
+	free(h);
+}
+
+/*
+ * A handle's thread: take frames from the ring while the window has
+ * room, write them in one go, and match replies to them in order. The
+ * port doesn't block, so a short write is finished as it drains before
+ * more frames are taken. A frame not answered in time fails along with
+ * those behind it, and anything left on the line is dropped.
+ * Completions are counted on the events eventfd once per pass.
+ */
+void *
+aquosthread(
+	void *arg
+)
+{
+	struct aquos     *h = arg;
+	struct aquosslot flight[WINDOW_MAX];
+	struct pollfd    pfds[2];
+	char             out[WINDOW_MAX * 9], in[64], *cr;
+	int              nflight = 0, inlen = 0, outlen = 0, outoff = 0,
+	                 unwritten = 0, first, i, len, wait;
+	long long        now, due;
+	uint64_t         done = 0, count;
+
+	pfds[0].fd = h->fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = h->wake;
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		if (outoff == outlen) {
+			outoff = outlen = 0;
+			first = nflight;
+			while (nflight < h->window && aquostake(h, &flight[nflight])) {
+				memcpy(out + outlen, flight[nflight].frame, 8);
+				out[outlen + 8] = '\r';
+				outlen += 9;
+				nflight++;
+			}
+			unwritten += nflight - first;
+			now = monotime();
+			for (i = first; i < nflight; i++) flight[i].sent = now;
+		}
+		if (outoff < outlen) {
+			len = write(h->fd, out + outoff, outlen - outoff);
+			if (len > 0) {
+				outoff += len;
+			}
+			else if (len == -1 && errno != EAGAIN && errno != EINTR) {
+				outoff = outlen; /* lost: left to time out */
+				unwritten = 0;
+			}
+		}
+
+		/* Frames that get no reply are done once all written. */
+		if (unwritten > 0 && outoff == outlen) {
+			for (i = nflight - unwritten; i < nflight; i++) {
+				if (!noreply(flight[i].frame)) continue;
+				aquosfinish(&flight[i], RESP_OK, "sent");
+				memmove(&flight[i], &flight[i + 1],
+					(nflight - i - 1) * sizeof(flight[0]));
+				nflight--;
+				i--;
+				done++;
+			}
+			unwritten = 0;
+		}
+		if (done > 0) {
+			write(h->events, &done, sizeof(done));
+			done = 0;
+		}
+
+		if (nflight == 0 && outoff == outlen && atomic_load(&h->closing) &&
+		    !aquosready(h))
+			break;
+
+		wait = -1;
+		if (nflight > 0) {
+			due = flight[0].sent + cfg.timeout_default * 1000000LL;
+			now = monotime();
+			wait = due <= now ? 0 : (due - now) / 1000000 + 1;
+		}
+
+		/* Say we may sleep, then look again: a submit can't slip by. */
+		if (nflight < h->window && outoff == outlen) {
+			atomic_store(&h->sleeping, 1);
+			if (aquosready(h)) {
+				atomic_store(&h->sleeping, 0);
+				continue;
+			}
+		}
+		pfds[0].events = outoff < outlen ? POLLIN | POLLOUT : POLLIN;
+		if (poll(pfds, 2, wait) < 0 && errno != EINTR) break;
+		atomic_store(&h->sleeping, 0);
+
+		if (pfds[1].revents & POLLIN) read(h->wake, &count, sizeof(count));
+
+		if ((pfds[0].revents & POLLIN) &&
+		    (len = read(h->fd, in + inlen, sizeof(in) - 1 - inlen)) > 0) {
+			inlen += len;
+			in[inlen] = '\0';
+			while ((cr = strpbrk(in, "\r\n")) != NULL) {
+				*cr = '\0';
+				if (cr > in && nflight > 0) {
+					aquosfinish(&flight[0], strncmp(in, "OK", 2) == 0 ?
+						RESP_OK : strncmp(in, "ERR", 3) == 0 ? RESP_ERR :
+						RESP_UNKNOWN, in);
+					memmove(&flight[0], &flight[1],
+						(nflight - 1) * sizeof(flight[0]));
+					nflight--;
+					done++;
+				}
+				inlen -= cr + 1 - in;
+				memmove(in, cr + 1, inlen + 1);
+			}
+			if (inlen == sizeof(in) - 1) inlen = 0;
+			if (unwritten > nflight) unwritten = nflight;
+		}
+
+		if (nflight > 0 &&
+		    monotime() >= flight[0].sent + cfg.timeout_default * 1000000LL) {
+			for (i = 0; i < nflight; i++)
+				aquosfinish(&flight[i], RESP_NONE, "");
+			done += nflight;
+			nflight = 0;
+			unwritten = 0;
+			outlen = (outoff + 8) / 9 * 9; /* finish a frame half out */
+			tcflush(h->fd, TCIFLUSH);
+			inlen = 0;
+		}
+	}
+
+	return(NULL);
+}
+
+/* Take the frame at tail, if it has been published, and free its slot. */
+int
+aquostake(
+	struct aquos     *h,
+	struct aquosslot *out
+)
+{
+	struct aquosslot *s = &h->slot[h->tail & (AQUOS_RING - 1)];
+
+	if (atomic_load(&s->seq) != h->tail + 1) return(0);
+
+	memcpy(out->frame, s->frame, sizeof(out->frame));
+	out->done = s->done;
+	out->arg = s->arg;
+	out->queued = s->queued;
+	atomic_store_explicit(&s->seq, h->tail + AQUOS_RING, memory_order_release);
+	h->tail++;
+
+	return(1);
+}
+
+/* Nonzero if a frame is waiting at tail. */
+int
+aquosready(
+	struct aquos *h
+)
+{
+	return(atomic_load(&h->slot[h->tail & (AQUOS_RING - 1)].seq) ==
+	       h->tail + 1);
+}
+
+void
+aquosfinish(
+	struct aquosslot *s,
+	int              resp,
+	char             *reply
+)
+{
+	if (s->done != NULL) s->done(s->arg, resp, reply, monotime() - s->queued);
+}
+
+/*
+ * Take exclusive use of the port, queueing fairly behind other aquosctl
+ * processes. Each process draws a ticket from a counter file and waits
+ * for the "now serving" number to reach it, then takes an flock() on
+ * the port's lock file that is held until exit. A ticket nobody claims
+ * within LOCK_GRACE ms (its process died or gave up) is skipped.
+ */
+void
+lockport(
+	char *port
+)
+{
+	char      path[PATH_MAX];
+	long      next, serving, seen = -1;
+	long long start = monotime(), now, since = 0;
+
+	if ((lockfd = openlock(port, path, sizeof(path))) == -1) {
+		fprintf(stderr, "lockport(%s): %s: %s\n", port,
+			errno == ENAMETOOLONG ? cfg.lock_dir : path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	strcat(path, "s"); /* .locks; openlock() leaves room */
+	if ((ticketfd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+	                     0660)) == -1) {
+		fprintf(stderr, "lockport(%s): %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	flock(ticketfd, LOCK_EX);
+	readtickets(&next, &serving);
+	ticket = next;
+	writetickets(next + 1, serving);
+	flock(ticketfd, LOCK_UN);
+
+	for (;;) {
+		flock(ticketfd, LOCK_EX);
+		readtickets(&next, &serving);
+		now = monotime();
+
+		if (serving == ticket) {
+			flock(ticketfd, LOCK_UN);
+			/* Our turn, once the last owner (or a broker) lets go. */
+			if (flock(lockfd, LOCK_EX | LOCK_NB) == 0) break;
+		}
+		else {
+			if (serving > ticket) {
+				/* We were skipped as abandoned; rejoin at the back. */
+				ticket = next;
+				writetickets(next + 1, serving);
+			}
+			else if (serving != seen) {
+				seen = serving;
+				since = now;
+			}
+			else if (now - since > LOCK_GRACE * 1000000LL &&
+			         flock(lockfd, LOCK_EX | LOCK_NB) == 0) {
+				/* Nobody has the port and the ticket being served
+				   hasn't been claimed: its owner is gone. */
+				flock(lockfd, LOCK_UN);
+				writetickets(next, serving + 1);
+				since = now;
+			}
+			flock(ticketfd, LOCK_UN);
+		}
+
+		if (now - start > cfg.lock_timeout * 1000000LL) {
+			fprintf(stderr, "openport(%s): busy, gave up after %d ms\n",
+				port, cfg.lock_timeout);
+			exit(EXIT_FAILURE);
+		}
+		sleepuntil(now + 2000000LL);
+	}
+
+	atexit(unlockport);
+
+	if (verbose == 1) {
+		logmsg("port wait: %.1f ms (ticket %ld)",
+			(monotime() - start) / 1e6, ticket);
+	}
+}
+
+/* Pass the port to the next ticket. */
+void
+unlockport(void)
+{
+	long next, serving;
+
+	if (ticketfd == -1) return;
+
+	flock(ticketfd, LOCK_EX);
+	readtickets(&next, &serving);
+	if (serving == ticket) writetickets(next, serving + 1);
+	flock(ticketfd, LOCK_UN);
+
+#ifdef TIOCNXCL
+	if (fd > 0) ioctl(fd, TIOCNXCL);
+#endif
+	close(lockfd);
+	close(ticketfd);
+	lockfd = ticketfd = -1;
+}
+
+/* Ticket counters: "next serving". The caller holds the flock. */
+int
+readtickets(
+	long *next,
+	long *serving
+)
+{
+	char buffer[64];
+	int  nbytes;
+
+	*next = *serving = 0;
+	if ((nbytes = pread(ticketfd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+		return(-1);
+	buffer[nbytes] = '\0';
+
+	return(sscanf(buffer, "%ld %ld", next, serving) == 2 ? 0 : -1);
+}
+
+void
+writetickets(
+	long next,
+	long serving
+)
+{
+	char buffer[64];
+	int  len;
+
+	len = snprintf(buffer, sizeof(buffer), "%ld %ld\n", next, serving);
+	pwrite(ticketfd, buffer, len, 0);
+	ftruncate(ticketfd, len);
+}
+#endif /* AQUOS_TINY */
+
+int
+sendcommand(
+	char *command,
+	char *parameter
+)
+{
+	char buffer[255];
+
+	if (nosend == 1) {
+		printf("command='%s', parameter='%s'\n", command, parameter);
+		return(RESP_OK);
+	}
+
+	if (verbose == 1) {
+		logmsg("command='%s', parameter='%s'", command, parameter);
+	}
+
+	/* Some commands (CHUP, CHDW) don't issue a response, so timeout after
+	 * the deadline learned for the command and just exit. This may
+	 * cause problems with multi-command functions such as Digital
+	 * Cable tuning options since the first sequence may succeeed on the
+	 * TV side, but not be reported at 'OK' by the TV, thereby causing
+	 * the second half of the tuning command not to be sent, but this is
+	 * just a hypothesis.
+	 */
+
+	if (transact(command, parameter, buffer, sizeof(buffer),
+	             TIMEOUT_ADAPTIVE) == RESP_NONE) {
+		leave(SIGALRM);
+	}
+
+	if (strncmp(buffer, "OK", 2) == 0) {
+		if (verbose == 1) logmsg("Success.");
+		return(RESP_OK);
+	}
+	else if (strncmp(buffer, "ERR", 3) == 0) {
+		fprintf(stderr, "Error: command/param '%s%s'\n", command, parameter);
+		return(RESP_ERR);
+	}
+	else {
+		fprintf(stderr,
+			"Error: unexpected response '%s' to command/param '%s%s'\n",
+			buffer, command, parameter
+		);
+		return(RESP_UNKNOWN);
+	}
+}
+
+#ifndef AQUOS_TINY
+/*
+ * Send a status query ("VOLM?   ") and return the raw response in reply.
+ * Returns RESP_ERR if the TV doesn't support the query.
+ */
+int
+querycommand(
+	char *command,
+	char *reply,
+	int  size
+)
+{
+	if (verbose == 1) logmsg("query='%s'", command);
+
+	if (transact(command, "?   ", reply, size, TIMEOUT_ADAPTIVE) ==
+	    RESP_NONE) {
+		leave(SIGALRM);
+	}
+
+	if (verbose == 1) logmsg("response='%s'", reply);
+
+	return(strncmp(reply, "ERR", 3) == 0 ? RESP_ERR : RESP_OK);
+}
+#endif /* AQUOS_TINY */
+
+/*
+ * Write one frame and wait up to timeout milliseconds (or the learned
+ * deadline, for TIMEOUT_ADAPTIVE) for its response, which is left in
+ * reply. Returns RESP_OK, RESP_ERR, RESP_UNKNOWN or RESP_NONE.
+ */
+int
+transact(
+	char *command,
+	char *parameter,
+	char *reply,
+	int  size,
+	int  timeout
+)
+{
+	char      frame[16];
+	int       len, resync = 0, adaptive = (timeout == TIMEOUT_ADAPTIVE);
+	long long start;
+
+	if (adaptive) timeout = replytimeout(command);
+
+	/* A degraded link gets breathing room between frames. */
+	loadhealth();
+	if (health.level > 0 && lastframe != 0)
+		sleepuntil(lastframe + health.level * cfg.health_gap * 1000000LL);
+
+	/* A reply that missed its deadline (or was garbled) may still
+	   arrive; don't let it answer this frame. */
+	if (stale) {
+		tcflush(fd, TCIFLUSH);
+		stale = 0;
+		resync = 1;
+	}
+
+	/* One write per frame; the TV sees it in a single burst. */
+	len = snprintf(frame, sizeof(frame), "%.4s%.4s\r", command, parameter);
+	awaitdue();
+	start = monotime();
+	write(fd, frame, len);
+
+	return(settlereply(command, parameter, reply, start, timeout, adaptive,
+		resync, readreply(reply, size, timeout) >= 0));
+}
+
+/*
+ * Account for the outcome of a frame written at start: latency, link
+ * health, and whether the port needs a resync before the next frame.
+ * got is 0 if nothing came back within timeout. Returns RESP_OK,
+ * RESP_ERR, RESP_UNKNOWN or RESP_NONE.
+ */
+int
+settlereply(
+	char      *command,
+	char      *parameter,
+	char      *reply,
+	long long start,
+	int       timeout,
+	int       adaptive,
+	int       resync,
+	int       got
+)
+{
+	int resp;
+
+	lastframe = monotime();
+	if (!got) {
+		if (noreply(command)) return(RESP_NONE);
+		stale = 1;
+		/* The reply takes at least this long; count it so a slow
+		   command's deadline grows rather than failing forever. */
+		if (adaptive) recordlatency(command, timeout * 1000000LL, 1);
+		recordhealth(RESP_NONE, timeout * 1000000LL, resync);
+		return(RESP_NONE);
+	}
+	recordlatency(command, lastframe - start, 0);
+
+	if (strncmp(reply, "OK", 2) == 0) resp = RESP_OK;
+	else if (strncmp(reply, "ERR", 3) == 0) resp = RESP_ERR;
+	else if (parameter[0] == '?') resp = RESP_UNKNOWN; /* query answer */
+	else {
+		resp = RESP_UNKNOWN;
+		stale = 1; /* garbled; resync before the next frame */
+	}
+	recordhealth(resp, lastframe - start, resync);
+
+	return(resp);
+}
+
+/*
+ * Read one CR/NL terminated response into buffer, waiting at most
+ * timeout milliseconds. Returns the response length (cr/nl chopped), or
+ * -1 on timeout with whatever arrived left in buffer.
+ */
+int
+readreply(
+	char *buffer,
+	int  size,
+	int  timeout
+)
+{
+	struct pollfd pfd;
+	long long     deadline = monotime() + timeout * 1000000LL;
+	int           nbytes, wait;
+	char          *buffptr = buffer;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (buffptr < buffer + size - 1) {
+		wait = (int) ((deadline - monotime() + 999999) / 1000000);
+		if (wait <= 0 || poll(&pfd, 1, wait) <= 0) {
+			*buffptr = '\0';
+			return(-1);
+		}
+		if ((nbytes = read(fd, buffptr, buffer+size-buffptr-1)) <= 0)
+			break;
+		buffptr += nbytes;
+		if (buffptr[-1] == '\n' || buffptr[-1] == '\r')
+			break;
+	}
+
+	/* NULL terminate and chop cr/nl. */
+	if (buffptr > buffer)
+		buffptr[-1] = '\0';
+	else
+		buffer[0] = '\0';
+
+	return(buffptr > buffer ? buffptr - buffer - 1 : 0);
+}
+
+/* CLOCK_MONOTONIC in nanoseconds. */
+long long
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+#ifndef AQUOS_TINY
+/* Sleep until an absolute monotonic time, immune to wall clock steps. */
+void
+sleepuntil(
+	long long when
+)
+{
+	struct timespec ts;
+
+	ts.tv_sec = when / 1000000000LL;
+	ts.tv_nsec = when % 1000000000LL;
+#ifdef TIMER_ABSTIME
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#else
+	{
+		long long left;
+
+		while ((left = when - monotime()) > 0) {
+			ts.tv_sec = left / 1000000000LL;
+			ts.tv_nsec = left % 1000000000LL;
+			nanosleep(&ts, NULL);
+		}
+	}
+#endif
+}
+
+/*
+ * Parse a duration such as "200ms", "1.5s" or "500us" (plain numbers are
+ * milliseconds) into nanoseconds. Returns -1 if it doesn't parse.
+ */
+long long
+parsetime(
+	char *string
+)
+{
+	char   *unit;
+	double value = strtod(string, &unit);
+
+	if (unit == string || value < 0) return(-1);
+
+	if (strcmp(unit, "") == 0 || strcmp(unit, "ms") == 0)
+		return((long long) (value * 1e6));
+	else if (strcmp(unit, "s") == 0)
+		return((long long) (value * 1e9));
+	else if (strcmp(unit, "us") == 0)
+		return((long long) (value * 1e3));
+
+	return(-1);
+}
+
+/*
+ * Parse --at: a local time of day still to come today ("21:30",
+ * "21:30:05.250") or a delay from now ("+2s"). Returns the moment as a
+ * monotime(), or -1.
+ */
+long long
+parseat(
+	char *string
+)
+{
+	struct timespec ts;
+	struct tm       tm;
+	time_t          now;
+	double          sec = 0;
+	long long       delay;
+	long            hour, min;
+	char            *end, *next;
+
+	if (string[0] == '+') {
+		return((delay = parsetime(string + 1)) < 0 ? -1 : monotime() + delay);
+	}
+
+	/* Digits only where strtol/strtod would also take signs or blanks. */
+	if (!isdigit((unsigned char) string[0])) return(-1);
+	hour = strtol(string, &end, 10);
+	if (end - string > 2 || *end != ':' ||
+	    !isdigit((unsigned char) end[1])) {
+		return(-1);
+	}
+	min = strtol(next = end + 1, &end, 10);
+	if (end - next > 2) return(-1);
+	if (*end == ':') {
+		next = end + 1;
+		if (!isdigit((unsigned char) *next) ||
+		    next[strspn(next, "0123456789.")] != '\0') {
+			return(-1);
+		}
+		sec = strtod(next, &end);
+	}
+	if (*end != '\0' || hour > 23 || min > 59 || sec >= 60) {
+		return(-1);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec;
+	localtime_r(&now, &tm);
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = 0;
+	delay = (mktime(&tm) - now) * 1000000000LL + (long long) (sec * 1e9) -
+	        ts.tv_nsec;
+
+	return(delay < 0 ? -1 : monotime() + delay);
+}
+
+/*
+ * Hold the next write until writedue, if one is set, and note how late
+ * it actually goes out.
+ */
+void
+awaitdue(void)
+{
+	long long late;
+
+	if (writedue == 0) return;
+
+	sleepuntil(writedue);
+	late = monotime() - writedue;
+	writedue = 0;
+
+	addtiming(&jitter, late);
+}
+
+/*
+ * --realtime: keep timed writes off the page fault and scheduler paths.
+ * State the send path reads is loaded and memory locked up front, then
+ * the process pins itself to cpu (if >= 0) and asks for SCHED_FIFO.
+ * Steps that fail, usually for want of privilege, are reported and
+ * skipped.
+ */
+void
+realtime(
+	char *progname,
+	int  cpu
+)
+{
+	struct sched_param sp;
+	cpu_set_t          cpus;
+	char               stack[REALTIME_STACK];
+	volatile char      *page;
+
+	/* The log writer starts now, so it keeps the default policy. */
+	if (verbose == 1) {
+		logmsg("realtime: cpu %d, priority %d", cpu, cfg.realtime_priority);
+	}
+	if (nosend == 0) {
+		loadlatency();
+		loadhealth();
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		fprintf(stderr, "%s: mlockall: %s\n", progname, strerror(errno));
+	}
+	for (page = stack; page < stack + sizeof(stack); page += 4096) *page = 0;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			fprintf(stderr, "%s: cpu %d: %s\n", progname, cpu,
+				strerror(errno));
+		}
+	}
+
+	sp.sched_priority = cfg.realtime_priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+		fprintf(stderr, "%s: SCHED_FIFO: %s\n", progname, strerror(errno));
+	}
+
+	atexit(showjitter);
+}
+
+void
+addtiming(
+	struct timings *t,
+	long long      ns
+)
+{
+	t->total++;
+	t->count[latencybucket(ns)]++;
+	if (ns > t->worst) t->worst = ns;
+}
+
+/* Upper bound (us) of the bucket of t holding the pct'th percentile. */
+long long
+timingpercentile(
+	struct timings *t,
+	double         pct
+)
+{
+	if (t->total == 0) return(0);
+
+	return(bucketlimit(bucketpercentile(t->count, t->total, pct)) / 1000);
+}
+
+/* Summarize the jitter of timed writes, if there were any. */
+void
+showjitter(void)
+{
+	int b;
+
+	if (jitter.total == 0) return;
+
+	fprintf(stderr, "jitter: %u timed writes, p50 <%lld us, p99 <%lld us, "
+		"max %.1f us\n", jitter.total, timingpercentile(&jitter, 50),
+		timingpercentile(&jitter, 99), jitter.worst / 1e3);
+
+	if (verbose == 1) {
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			if (jitter.count[b] == 0) continue;
+			fprintf(stderr, "  <%-8lld us %u\n", bucketlimit(b) / 1000,
+				jitter.count[b]);
+		}
+	}
+}
+
+struct termios savedtty;
+int ttysaved = 0;
+
+void
+restoretty(void)
+{
+	if (ttysaved) tcsetattr(STDIN_FILENO, TCSANOW, &savedtty);
+}
+
+/*
+ * Sweep a PC-alignment setting over [first, last] with the port held
+ * open, sending a value every dwell interval on an absolute monotonic
+ * schedule so late replies don't accumulate drift. While the picture
+ * settles the operator can press space/enter (or m) to mark the current
+ * value or q to stop; the sweep ends on the last marked value.
+ */
+int
+sweep(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct termios raw;
+	struct pollfd  pfd;
+	struct range   *r;
+	char           command[5], param[8], reply[255], key;
+	int            first, last, step = 1, value, i, n, count = 0, resp,
+	               marked = -1, interactive, quit = 0, wait;
+	long long      dwell = 200000000LL, start, due, late, maxlate = 0,
+	               sumlate = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "%s: sweep needs a setting, first and last value.\n",
+			progname);
+		return(EXIT_FAILURE);
+	}
+
+	if (strcmp(argv[0], "hpos") == 0) strcpy(command, "HPOS");
+	else if (strcmp(argv[0], "vpos") == 0) strcpy(command, "VPOS");
+	else if (strcmp(argv[0], "clock") == 0) strcpy(command, "CLCK");
+	else if (strcmp(argv[0], "phase") == 0) strcpy(command, "PHSE");
+	else {
+		fprintf(stderr, "%s: can't sweep \"%s\".\n", progname, argv[0]);
+		return(EXIT_FAILURE);
+	}
+	first = atoi(argv[1]);
+	last = atoi(argv[2]);
+
+	for (i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+			step = abs(atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--dwell") == 0 && i + 1 < argc) {
+			dwell = parsetime(argv[++i]);
+		}
+		else {
+			fprintf(stderr, "%s: bad sweep option \"%s\".\n",
+				progname, argv[i]);
+			return(EXIT_FAILURE);
+		}
+	}
+	if (step == 0 || dwell <= 0) {
+		fprintf(stderr, "%s: step and dwell must be positive.\n", progname);
+		return(EXIT_FAILURE);
+	}
+
+	for (i = 0; strcmp(rangetab[i].cmd, command) != 0; i++)
+		;
+	if (first < rangetab[i].min || first > rangetab[i].max ||
+	    last < rangetab[i].min || last > rangetab[i].max) {
+		fprintf(stderr, "%s: %s range is %d-%d.\n",
+			progname, argv[0], rangetab[i].min, rangetab[i].max);
+		return(EXIT_FAILURE);
+	}
+
+	/* Don't spend the sweep on values already known to be rejected. */
+	if ((r = findrange(command, 0)) != NULL) {
+		if (first <= r->lo_bad) first = r->lo_bad + 1;
+		if (first >= r->hi_bad) first = r->hi_bad - 1;
+		if (last <= r->lo_bad) last = r->lo_bad + 1;
+		if (last >= r->hi_bad) last = r->hi_bad - 1;
+	}
+	if (last < first) step = -step;
+	n = (last - first) / step + 1;
+
+	interactive = isatty(STDIN_FILENO);
+	if (interactive && tcgetattr(STDIN_FILENO, &savedtty) == 0) {
+		raw = savedtty;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		ttysaved = 1;
+		atexit(restoretty);
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+		printf("space/enter marks the current value, q stops\n");
+	}
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+
+	probing = 1;
+	start = monotime();
+	for (i = 0, value = first; i < n && quit == 0; i++, value += step) {
+		due = start + i * dwell;
+
+		/* Take keypresses for the previous value until the next is due. */
+		while (interactive && (wait = (int) ((due - monotime()) / 1000000)) > 1) {
+			if (poll(&pfd, 1, wait - 1) <= 0) continue;
+			if (read(STDIN_FILENO, &key, 1) != 1) {
+				interactive = 0;
+			}
+			else if (key == 'q' || key == 'Q' || key == '\033') {
+				quit = 1;
+				break;
+			}
+			else if (count > 0 && (key == ' ' || key == '\n' ||
+			                       key == '\r' || key == 'm')) {
+				marked = value - step;
+				printf("marked %s %d\n", argv[0], marked);
+			}
+		}
+		if (quit) break;
+		sleepuntil(due);
+
+		snprintf(param, sizeof(param), "%-4d", value);
+		if (nosend == 0) tcflush(fd, TCIFLUSH); /* drop late replies */
+		late = monotime() - due;
+		sumlate += late;
+		if (late > maxlate) maxlate = late;
+		count++;
+
+		if (nosend == 1) {
+			printf("command='%s', parameter='%s'\n", command, param);
+			continue;
+		}
+
+		/* The reply must arrive before the next value is due. */
+		wait = (int) ((due + dwell - monotime()) / 1000000);
+		resp = transact(command, param, reply, sizeof(reply),
+			wait > 0 ? wait : 0);
+		if (resp == RESP_NONE) strcpy(reply, "no response");
+		recordrange(command, value, resp);
+		if (verbose == 1 || strncmp(reply, "OK", 2) != 0) {
+			printf("%s %d: %s\n", argv[0], value, reply);
+		}
+	}
+
+	/* Last chance to mark the final value. */
+	if (interactive && quit == 0 && count > 0) {
+		sleepuntil(start + count * dwell);
+		while (poll(&pfd, 1, 0) > 0 && read(STDIN_FILENO, &key, 1) == 1) {
+			if (key == ' ' || key == '\n' || key == '\r' || key == 'm') {
+				marked = value - step;
+				printf("marked %s %d\n", argv[0], marked);
+			}
+		}
+	}
+	restoretty();
+
+	printf("%d values in %lld ms, dwell error mean %lld us, max %lld us\n",
+		count, (monotime() - start) / 1000000,
+		count ? sumlate / count / 1000 : 0, maxlate / 1000
+	);
+
+	if (marked != -1) {
+		printf("best %s %d\n", argv[0], marked);
+		snprintf(param, sizeof(param), "%-4d", marked);
+		return(sendcommand(command, param) == RESP_OK ?
+			EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+#endif /* AQUOS_TINY */
+
+int
+checkcmd(
+	char	*string
+)
+{
+	int i;
+	for(i = 0; i < sizeof(cmdtab) / sizeof(cmdtab[0]); i++)
+	if (strcmp(cmdtab[i].cmd, string) == 0) {
+		return cmdtab[i].opcode;
+	}
+
+	return CMD_NONE;
+}
+
+#ifndef AQUOS_TINY
+/*
+ * Print a histogram of latencies (milliseconds) in power-of-two buckets.
+ */
+void
+histogram(
+	char   *title,
+	double *ms,
+	int    count
+)
+{
+	int    buckets[16], i, b, top = 0, lo = 16, hi = 0;
+	double edge;
+
+	memset(buckets, 0, sizeof(buckets));
+	for (i = 0; i < count; i++) {
+		for (b = 0, edge = 1; b < 15 && ms[i] >= edge; b++, edge *= 2)
+			;
+		buckets[b]++;
+		if (buckets[b] > top) top = buckets[b];
+		if (b < lo) lo = b;
+		if (b > hi) hi = b;
+	}
+
+	printf("\n%s\n", title);
+	for (b = lo; b <= hi; b++) {
+		printf("%6d-%-6d ms %4d ", b ? 1 << (b - 1) : 0, 1 << b, buckets[b]);
+		for (i = 0; i < (buckets[b] * 40 + top - 1) / top; i++) putchar('#');
+		putchar('\n');
+	}
+}
+
+int
+cmpdouble(
+	const void *a,
+	const void *b
+)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return((x > y) - (x < y));
+}
+
+/*
+ * Step through channels or inputs, timing each switch from the first
+ * frame written to the TV's OK and, with --confirm, until a status query
+ * reports the new setting. Prints a latency table and histograms.
+ */
+int
+survey(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct frame frames[MAX_FRAMES];
+	char         *cmd, *targets[256], reply[255], value[5], defaults[8][2];
+	double       okms[256], confms[256], sorted[256];
+	int          ntargets = 0, confirm = 0, timeout = 5000, opcode,
+	             i, j, n, resp, failed = 0, nok = 0, nconf = 0;
+	long long    start, done, deadline;
+
+	if (argc < 1) {
+		fprintf(stderr, "%s: survey channels or inputs?\n", progname);
+		return(EXIT_FAILURE);
+	}
+
+	if (strcmp(argv[0], "inputs") == 0) {
+		cmd = "input";
+		i = 1;
+	}
+	else if (strcmp(argv[0], "channels") == 0 && argc >= 2 &&
+	         (strcmp(argv[1], "dchan") == 0 || strcmp(argv[1], "dcabl1") == 0 ||
+	          strcmp(argv[1], "achan") == 0)) {
+		cmd = argv[1];
+		i = 2;
+	}
+	else {
+		fprintf(stderr,
+			"%s: survey channels {dchan|dcabl1|achan} or inputs.\n",
+			progname);
+		return(EXIT_FAILURE);
+	}
+
+	for (; i < argc; i++) {
+		if (strcmp(argv[i], "--confirm") == 0) {
+			confirm = 1;
+		}
+		else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+			if ((timeout = (int) (parsetime(argv[++i]) / 1000000)) < 1) {
+				fprintf(stderr, "%s: bad timeout \"%s\".\n",
+					progname, argv[i]);
+				return(EXIT_FAILURE);
+			}
+		}
+		else if (ntargets < sizeof(targets) / sizeof(targets[0])) {
+			targets[ntargets++] = argv[i];
+		}
+	}
+
+	/* All inputs by default. */
+	if (ntargets == 0 && strcmp(cmd, "input") == 0) {
+#ifdef NEWER_PROTOCOL
+		n = 8;
+#else
+		n = 7;
+#endif
+		for (i = 0; i < n; i++) {
+			defaults[i][0] = '1' + i;
+			defaults[i][1] = '\0';
+			targets[ntargets++] = defaults[i];
+		}
+	}
+	if (ntargets == 0) {
+		fprintf(stderr, "%s: no channels to survey.\n", progname);
+		return(EXIT_FAILURE);
+	}
+
+	/* Validate everything before touching the TV. */
+	opcode = checkcmd(cmd);
+	for (i = 0; i < ntargets; i++) {
+		if (encodecommand(progname, opcode, cmd, targets[i], "", frames) < 0)
+			return(EXIT_FAILURE);
+	}
+
+	printf("%-8s %-10s %10s %12s\n", cmd, "result", "ok ms",
+		confirm ? "confirm ms" : "");
+
+	for (i = 0; i < ntargets; i++) {
+		n = encodecommand(progname, opcode, cmd, targets[i], "", frames);
+		okms[i] = confms[i] = -1;
+
+		if (nosend == 1) {
+			for (j = 0; j < n; j++) {
+				printf("command='%s', parameter='%s'\n",
+					frames[j].command, frames[j].param);
+			}
+			continue;
+		}
+
+		tcflush(fd, TCIFLUSH);
+		start = monotime();
+		for (j = 0, resp = RESP_OK; j < n && resp == RESP_OK; j++) {
+			resp = transact(frames[j].command, frames[j].param,
+				reply, sizeof(reply), timeout);
+			noteframe(&frames[j], resp);
+		}
+		done = monotime();
+
+		if (resp != RESP_OK) {
+			printf("%-8s %-10s\n", targets[i],
+				resp == RESP_NONE ? "timeout" : reply);
+			failed++;
+			continue;
+		}
+		okms[i] = (done - start) / 1e6;
+
+		/* Poll the setting until every frame of it reads back as
+		   requested (both halves of a dcabl1 channel). */
+		if (confirm) {
+			deadline = start + timeout * 1000000LL;
+			while (monotime() < deadline) {
+				for (j = 0; j < n; j++) {
+					sscanf(frames[j].param, "%4s", value);
+					resp = transact(frames[j].command, "?   ",
+						reply, sizeof(reply), timeout);
+					if (resp == RESP_ERR || resp == RESP_NONE ||
+					    reply[0] == '\0' || atoi(reply) != atoi(value))
+						break;
+				}
+				if (j == n) {
+					confms[i] = (monotime() - start) / 1e6;
+					break;
+				}
+				if (resp == RESP_ERR || resp == RESP_NONE) break;
+				sleepuntil(monotime() + 20000000LL);
+			}
+		}
+
+		printf("%-8s %-10s %10.1f", targets[i], "OK", okms[i]);
+		if (confirm && confms[i] >= 0)
+			printf(" %12.1f", confms[i]);
+		else if (confirm)
+			printf(" %12s", resp == RESP_ERR ? "no query" : "unconfirmed");
+		putchar('\n');
+	}
+
+	if (nosend == 1) return(EXIT_SUCCESS);
+
+	for (i = 0; i < ntargets; i++) {
+		if (okms[i] >= 0) sorted[nok++] = okms[i];
+	}
+	if (nok > 0) {
+		qsort(sorted, nok, sizeof(sorted[0]), cmpdouble);
+		printf("\nok: min %.1f  median %.1f  p90 %.1f  max %.1f ms\n",
+			sorted[0], sorted[nok / 2], sorted[(nok - 1) * 9 / 10],
+			sorted[nok - 1]);
+		histogram("time to OK", sorted, nok);
+	}
+
+	for (i = 0; i < ntargets; i++) {
+		if (confms[i] >= 0) sorted[nconf++] = confms[i];
+	}
+	if (nconf > 0) {
+		qsort(sorted, nconf, sizeof(sorted[0]), cmpdouble);
+		histogram("time to confirmed state", sorted, nconf);
+	}
+
+	return(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Map path for scriptline(). Returns 0, or -1 with errno set. Only
+ * regular files are mapped; pipes, FIFOs and ttys (/dev/stdin) have no
+ * size to map and are read in instead.
+ */
+int
+openscript(
+	char          *path,
+	struct script *script
+)
+{
+	struct stat st;
+	long        page = sysconf(_SC_PAGESIZE);
+	int         scriptfd;
+	void        *map;
+
+	if ((scriptfd = open(path, O_RDONLY)) == -1) return(-1);
+	if (fstat(scriptfd, &st) == -1) {
+		close(scriptfd);
+		return(-1);
+	}
+	if (!S_ISREG(st.st_mode)) {
+		map = readscript(scriptfd, script);
+		close(scriptfd);
+		if (map == MAP_FAILED) return(-1);
+		script->text = script->next = map;
+		script->line = 0;
+		return(0);
+	}
+
+	/* Anonymous zeroed pages first, then the file over the front. */
+	script->size = st.st_size;
+	script->mapped = (st.st_size / page + 1) * page;
+	map = mmap(NULL, script->mapped, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map != MAP_FAILED && st.st_size > 0 &&
+	    mmap(map, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	         scriptfd, 0) == MAP_FAILED) {
+		munmap(map, script->mapped);
+		map = MAP_FAILED;
+	}
+	close(scriptfd);
+	if (map == MAP_FAILED) return(-1);
+
+	madvise(map, script->mapped, MADV_SEQUENTIAL);
+	script->text = script->next = map;
+	script->line = 0;
+
+	return(0);
+}
+
+/*
+ * openscript() for what can't be mapped: read fd to its end into
+ * anonymous pages, doubling them as needed, with at least one zero
+ * byte left after the text as a mapped file has. Returns the pages, or
+ * MAP_FAILED with errno set.
+ */
+void *
+readscript(
+	int           scriptfd,
+	struct script *script
+)
+{
+	void    *map, *grown;
+	ssize_t len;
+	int     saved;
+
+	script->size = 0;
+	script->mapped = 16 * sysconf(_SC_PAGESIZE);
+	map = mmap(NULL, script->mapped, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	while (map != MAP_FAILED &&
+	       (len = read(scriptfd, (char *) map + script->size,
+	                   script->mapped - script->size - 1)) != 0) {
+		if (len == -1 && errno == EINTR) continue;
+		if (len == -1) {
+			saved = errno;
+			munmap(map, script->mapped);
+			errno = saved;
+			return(MAP_FAILED);
+		}
+		script->size += len;
+		if (script->size == script->mapped - 1) {
+			grown = mremap(map, script->mapped, 2 * script->mapped,
+				MREMAP_MAYMOVE);
+			if (grown == MAP_FAILED) {
+				saved = errno;
+				munmap(map, script->mapped);
+				errno = saved;
+				return(MAP_FAILED);
+			}
+			map = grown;
+			script->mapped *= 2;
+		}
+	}
+
+	return(map);
+}
+
+/*
+ * Cut the next line with anything on it into fields, in place: '#'
+ * starts a comment, and fields are separated by spaces or tabs. The
+ * fields are NUL terminated and their 1-based columns are stored in
+ * columns. Returns how many (unused ones are ""), or -1 at the end.
+ */
+int
+scriptline(
+	struct script *script,
+	char          *fields[],
+	int           columns[]
+)
+{
+	char *line, *end, *p, *hash;
+	int  n, count;
+
+	while (script->next < script->text + script->size) {
+		line = script->next;
+		end = memchr(line, '\n', script->text + script->size - line);
+		if (end == NULL) end = script->text + script->size;
+		script->next = end + 1;
+		script->line++;
+
+		if ((hash = memchr(line, '#', end - line)) != NULL) end = hash;
+		*end = '\0'; /* the newline, the '#' or the zeroed page */
+		if (end > line && end[-1] == '\r') *--end = '\0';
+
+		for (n = 0, p = line; n < SCRIPT_FIELDS; n++) {
+			while (*p == ' ' || *p == '\t') p++;
+			if (*p == '\0') break;
+			fields[n] = p;
+			columns[n] = p - line + 1;
+			while (*p != '\0' && *p != ' ' && *p != '\t') p++;
+			if (*p != '\0') *p++ = '\0';
+		}
+		if ((count = n) == 0) continue;
+
+		for (; n < SCRIPT_FIELDS; n++) {
+			fields[n] = "";
+			columns[n] = p - line + 1;
+		}
+
+		return(count);
+	}
+
+	return(-1);
+}
+
+void
+closescript(
+	struct script *script
+)
+{
+	munmap(script->text, script->mapped);
+}
+
+/*
+ * Compile a scene: one command per line as on the command line, '#'
+ * comments, and "wait {time}" lines adding a gap after the previous
+ * command. Everything is validated against the command table here so
+ * play never has to.
+ */
+int
+compilescene(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct scenehdr hdr;
+	struct scenerec *recs = NULL, *rec;
+	struct frame    frames[MAX_FRAMES];
+	struct script   script;
+	FILE            *out;
+	char            *source = NULL, output[PATH_MAX] = "", *dot,
+	                *field[SCRIPT_FIELDS];
+	int             i, n, opcode, count = 0, alloc = 0,
+	                column[SCRIPT_FIELDS];
+	long long       start = monotime(), parsed, gap;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			snprintf(output, sizeof(output), "%s", argv[++i]);
+		else
+			source = argv[i];
+	}
+	if (source == NULL) {
+		fprintf(stderr, "%s: compile needs a scene file.\n", progname);
+		return(EXIT_FAILURE);
+	}
+	if (strcmp(output, "") == 0) {
+		snprintf(output, sizeof(output), "%s", source);
+		if ((dot = strrchr(output, '.')) != NULL && strchr(dot, '/') == NULL)
+			*dot = '\0';
+		strncat(output, ".bin", sizeof(output) - strlen(output) - 1);
+	}
+
+	if (openscript(source, &script) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, source, strerror(errno));
+		return(EXIT_FAILURE);
+	}
+
+	/* Fields are cut in place; nothing is copied until the frames. */
+	while (scriptline(&script, field, column) > 0) {
+		if (strcmp(field[0], "wait") == 0) {
+			if (count == 0 || (gap = parsetime(field[1])) < 0) {
+				fprintf(stderr, "%s:%d:%d: bad wait.\n", source,
+					script.line, column[count == 0 ? 0 : 1]);
+				closescript(&script);
+				free(recs);
+				return(EXIT_FAILURE);
+			}
+			recs[count - 1].gap += gap / 1000;
+			continue;
+		}
+
+		opcode = checkcmd(field[0]);
+		if (opcode == CMD_NONE ||
+		    (n = encodecommand(progname, opcode, field[0], field[1],
+		                       field[2], frames)) <= 0) {
+			fprintf(stderr, "%s:%d:%d: can't compile \"%s\".\n",
+				source, script.line,
+				column[opcode == CMD_NONE ? 0 : 1], field[0]);
+			closescript(&script);
+			free(recs);
+			return(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (count == alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				recs = realloc(recs, alloc * sizeof(*recs));
+				if (recs == NULL) {
+					fprintf(stderr, "%s: out of memory\n", progname);
+					exit(EXIT_FAILURE);
+				}
+			}
+			rec = &recs[count++];
+			memset(rec, 0, sizeof(*rec));
+			memcpy(rec->frame, frames[i].command, 4);
+			memcpy(rec->frame + 4, frames[i].param, 4);
+			rec->frame[8] = '\r';
+			rec->expect = noreply(frames[i].command) ?
+			              EXPECT_NONE : EXPECT_OK;
+			rec->line = script.line > 65535 ? 65535 : script.line;
+		}
+	}
+	parsed = monotime() - start;
+	closescript(&script);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SCENE_MAGIC, 4);
+	hdr.version = SCENE_VERSION;
+	hdr.recsize = sizeof(struct scenerec);
+	hdr.count = count;
+
+	if ((out = fopen(output, "wb")) == NULL ||
+	    fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    (count > 0 && fwrite(recs, sizeof(*recs), count, out) != count) ||
+	    fclose(out) != 0) {
+		fprintf(stderr, "%s: %s: %s\n", progname, output, strerror(errno));
+		free(recs);
+		return(EXIT_FAILURE);
+	}
+	free(recs);
+
+	printf("%s: %d frames from %d lines in %lld us (%.1f MB/s parsed)\n",
+		output, count, script.line, (monotime() - start) / 1000,
+		parsed > 0 ? script.size / (parsed / 1e3) : 0.0);
+
+	return(EXIT_SUCCESS);
+}
+
+/*
+ * Play a compiled scene: map it and write each frame as stored, waiting
+ * for OK where one is expected and then for the frame's gap. With
+ * --verify the settings it leaves are read back, after each frame or in
+ * one batch at the end, and frames that didn't take are sent again.
+ */
+int
+playscene(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct scenehdr *hdr;
+	struct scenerec *recs, *rec;
+	struct stat     st;
+	char            reply[255], *file = "";
+	void            *map;
+	int             scenefd, resp, status = EXIT_SUCCESS, verify = 0, i,
+	                key;
+	uint32_t        r;
+	long long       start = monotime();
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--verify=each") == 0)
+			verify = VERIFY_EACH;
+		else if (strcmp(argv[i], "--verify=batch") == 0)
+			verify = VERIFY_BATCH;
+		else if (strncmp(argv[i], "--verify", 8) == 0) {
+			fprintf(stderr, "%s: --verify=each or --verify=batch.\n",
+				progname);
+			return(EXIT_FAILURE);
+		}
+		else
+			file = argv[i];
+	}
+
+	if ((scenefd = open(file, O_RDONLY)) == -1 || fstat(scenefd, &st) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, file, strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	if (st.st_size < sizeof(*hdr) ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, scenefd, 0)) ==
+	    MAP_FAILED) {
+		fprintf(stderr, "%s: %s: not a compiled scene\n", progname, file);
+		close(scenefd);
+		return(EXIT_FAILURE);
+	}
+	close(scenefd);
+
+	hdr = map;
+	if (memcmp(hdr->magic, SCENE_MAGIC, 4) != 0 ||
+	    hdr->version != SCENE_VERSION ||
+	    hdr->recsize != sizeof(struct scenerec) ||
+	    st.st_size < sizeof(*hdr) + (off_t) hdr->count * sizeof(*rec)) {
+		fprintf(stderr, "%s: %s: not a compiled scene (or built for "
+			"another version)\n", progname, file);
+		munmap(map, st.st_size);
+		return(EXIT_FAILURE);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	rec = recs = (struct scenerec *) (hdr + 1);
+	if (verify) verifystart(recs, hdr->count);
+	for (r = 0; r < hdr->count; r++, rec++) {
+		if (nosend == 1) {
+			printf("command='%.4s', parameter='%.4s'\n",
+				rec->frame, rec->frame + 4);
+			if (verify) verifynote(rec, r);
+			continue;
+		}
+		if (verbose == 1) {
+			logmsg("command='%.4s', parameter='%.4s'",
+				rec->frame, rec->frame + 4);
+		}
+
+		if (rec->expect == EXPECT_NONE) {
+			awaitdue();
+			write(fd, rec->frame, sizeof(rec->frame));
+			resp = RESP_OK;
+		}
+		else {
+			resp = transact(rec->frame, rec->frame + 4, reply,
+				sizeof(reply), TIMEOUT_ADAPTIVE);
+		}
+		if (resp != RESP_OK) {
+			fprintf(stderr, "%s: %s: frame %u (line %u) '%.8s': %s\n",
+				progname, file, r + 1, rec->line, rec->frame,
+				resp == RESP_NONE ? "no response" : reply);
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		key = verify ? verifynote(rec, r) : -1;
+		if (verify == VERIFY_EACH && key != -1 &&
+		    verifycheck(progname, file, recs, key) != EXIT_SUCCESS) {
+			status = EXIT_FAILURE;
+		}
+
+		/* Due a gap after the reply; awaitdue() holds the frame. */
+		if (rec->gap > 0) writedue = monotime() + rec->gap * 1000LL;
+	}
+
+	/* A trailing wait still holds before the next command. */
+	if (writedue > 0 && status == EXIT_SUCCESS) sleepuntil(writedue);
+	writedue = 0;
+
+	if (verify == VERIFY_BATCH && r == hdr->count &&
+	    verifycheck(progname, file, recs, -1) != EXIT_SUCCESS) {
+		status = EXIT_FAILURE;
+	}
+	munmap(map, st.st_size);
+
+	if (nosend == 1) {
+		printf("%u frames in %lld us\n", r, (monotime() - start) / 1000);
+	}
+	else if (verbose == 1 && verify) {
+		logmsg("%u frames in %lld us, %d queries, %d sent again", r,
+			(monotime() - start) / 1000, verifyqueries, verifyresent);
+	}
+	else if (verbose == 1) {
+		logmsg("%u frames in %lld us", r, (monotime() - start) / 1000);
+	}
+
+	return(status);
+}
+
+/*
+ * Forget what earlier plays expected. A scene that steps the channel
+ * before tuning one needs to know where it started, so that is read
+ * first.
+ */
+void
+verifystart(
+	struct scenerec *recs,
+	uint32_t        count
+)
+{
+	struct verifykey *k;
+	char             reply[255];
+	uint32_t         i;
+
+	for (k = verifykeys; k < verifykeys + VERIFY_KEYS; k++)
+		k->state = KEY_UNSET;
+	verifyqueries = verifyresent = 0;
+
+	for (i = 0; i < count; i++) {
+		for (k = verifykeys; k < verifykeys + VERIFY_KEYS; k++) {
+			if (k->group == 3 && memcmp(recs[i].frame, k->code, 4) == 0)
+				return;
+		}
+		if (noreply(recs[i].frame)) break;
+	}
+	if (i == count) return;
+
+	k = &verifykeys[3]; /* DCCH */
+	verifyqueries++;
+	if (nosend == 1) {
+		printf("command='%s', parameter='?   '\n", k->code);
+	}
+	else if (transact(k->code, "?   ", reply, sizeof(reply),
+	                  TIMEOUT_ADAPTIVE) != RESP_NONE && isdigit(reply[0])) {
+		k->state = KEY_SET;
+		k->expect = atoi(reply);
+		k->rec = -1;
+		k->line = 0;
+	}
+}
+
+/*
+ * Account for a frame the TV took. Returns the key it leaves to be
+ * checked, or -1.
+ */
+int
+verifynote(
+	struct scenerec *rec,
+	long            i
+)
+{
+	struct verifykey *k, *g;
+	char             value[5];
+
+	sscanf(rec->frame + 4, "%4s", value);
+
+	/* Relative steps only add up from an analog channel. */
+	if (noreply(rec->frame)) {
+		k = &verifykeys[3]; /* DCCH */
+		if (k->state == KEY_SET) {
+			k->expect += rec->frame[2] == 'U' ? 1 : -1;
+			k->rec = -1;
+			k->line = rec->line;
+			return(k - verifykeys);
+		}
+		for (g = verifykeys; g < verifykeys + VERIFY_KEYS; g++) {
+			if (g->group == k->group) g->state = KEY_UNKNOWN;
+		}
+		return(-1);
+	}
+
+	/* IAVD? can't say the TV tuner is selected, nor what a toggle did. */
+	if (memcmp(rec->frame, "ITVD", 4) == 0 ||
+	    memcmp(rec->frame, "ITGD", 4) == 0) {
+		verifykeys[1].state = KEY_UNKNOWN; /* IAVD */
+		return(-1);
+	}
+
+	for (k = verifykeys; k < verifykeys + VERIFY_KEYS; k++) {
+		if (memcmp(rec->frame, k->code, 4) == 0) break;
+	}
+	if (k == verifykeys + VERIFY_KEYS) return(-1);
+
+	/* The first half of a pair, sent just before, stays to be read. */
+	for (g = verifykeys; g < verifykeys + VERIFY_KEYS; g++) {
+		if (g->group == k->group &&
+		    !(k->pair < 0 && g == k + k->pair && g->rec == i - 1))
+			g->state = KEY_UNSET;
+	}
+	k->state = KEY_SET;
+	k->expect = atoi(value);
+	k->rec = i;
+	k->line = rec->line;
+
+	return(k->pair > 0 ? -1 : k - verifykeys); /* wait for the pair */
+}
+
+/*
+ * Read back one key, or every key set (only == -1), and send what set
+ * any that read wrong again, up to VERIFY_ROUNDS times. A TV left off
+ * only answers POWR. Returns EXIT_FAILURE if any stays wrong or can't
+ * be read.
+ */
+int
+verifycheck(
+	char            *progname,
+	char            *file,
+	struct scenerec *recs,
+	int             only
+)
+{
+	struct verifykey *k, *unit[2];
+	char             reply[255], param[8];
+	int              pending[VERIFY_KEYS], round, i, j, n, resp, left = 0,
+	                 failed = 0, off;
+
+	off = verifykeys[0].state == KEY_SET && verifykeys[0].expect == 0;
+	for (i = 0; i < VERIFY_KEYS; i++) {
+		pending[i] = verifykeys[i].state == KEY_SET &&
+		             (only == -1 || only == i ||
+		              (verifykeys[i].pair != 0 && only == i + verifykeys[i].pair)) &&
+		             (i == 0 || !off);
+		left += pending[i];
+	}
+
+	for (round = 0; round < VERIFY_ROUNDS && left > 0; round++) {
+		for (i = 0, k = verifykeys; i < VERIFY_KEYS; i++, k++) {
+			if (!pending[i]) continue;
+
+			verifyqueries++;
+			if (nosend == 1) {
+				printf("command='%s', parameter='?   '\n", k->code);
+				pending[i] = 0;
+				left--;
+				continue;
+			}
+			resp = transact(k->code, "?   ", reply, sizeof(reply),
+				TIMEOUT_ADAPTIVE);
+			if (resp == RESP_ERR || resp == RESP_NONE || !isdigit(reply[0])) {
+				fprintf(stderr, "%s: %s: line %d: %s? got %s\n", progname,
+					file, k->line, k->code,
+					resp == RESP_NONE ? "no response" : reply);
+				failed++;
+				pending[i] = 0;
+				left--;
+				continue;
+			}
+			if (atoi(reply) == k->expect) {
+				pending[i] = 0;
+				left--;
+				continue;
+			}
+			if (round == VERIFY_ROUNDS - 1) {
+				fprintf(stderr, "%s: %s: line %d: %s still reads %d, not "
+					"%d\n", progname, file, k->line, k->code, atoi(reply),
+					k->expect);
+				failed++;
+				continue;
+			}
+
+			/* Only the step behind this setting goes again: both
+			   frames of a pair, in order, and both are read again. */
+			unit[0] = unit[1] = k;
+			n = 1;
+			if (k->pair != 0 && k[k->pair].state == KEY_SET) {
+				unit[k->pair < 0 ? 0 : 1] = k + k->pair;
+				n = 2;
+				j = k->pair + i;
+				if (!pending[j]) {
+					pending[j] = 1;
+					left++;
+				}
+			}
+			if (verbose == 1) {
+				logmsg("line %d: %s reads %d, not %d", k->line, k->code,
+					atoi(reply), k->expect);
+			}
+			for (j = 0; j < n; j++) {
+				if (unit[j]->rec >= 0) {
+					memcpy(param, recs[unit[j]->rec].frame + 4, 4);
+					param[4] = '\0';
+				}
+				else {
+					snprintf(param, sizeof(param), "%-4d", unit[j]->expect);
+				}
+				if (verbose == 1) {
+					logmsg("sending '%.4s%s' again", unit[j]->code, param);
+				}
+				transact(unit[j]->code, param, reply, sizeof(reply),
+					TIMEOUT_ADAPTIVE);
+				verifyresent++;
+			}
+		}
+	}
+
+	return(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+#endif /* AQUOS_TINY */
+
+/* Commands the TV doesn't acknowledge, from wordtab's expectations. */
+int
+noreply(
+	char *command
+)
+{
+	int i;
+
+	for (i = 0; i < sizeof(noreplytab) / sizeof(noreplytab[0]); i++) {
+		if (strncmp(command, noreplytab[i], 4) == 0) return(1);
+	}
+
+	return(0);
+}
+
+#ifndef AQUOS_TINY
+/* Nonzero unless frame is 8 printable characters. */
+int
+badframe(
+	char *frame
+)
+{
+	int i;
+
+	for (i = 0; i < 8 && frame[i] >= ' ' && frame[i] <= '~'; i++)
+		;
+
+	return(i != 8 || frame[8] != '\0');
+}
+
+/*
+ * Whether raw should count resp to frame as a success: OK, or for a
+ * query ("VOLM?   ") any answer but ERR.
+ */
+int
+rawok(
+	char *frame,
+	int  resp
+)
+{
+	int i;
+
+	for (i = 7; i > 4 && frame[i] == ' '; i--)
+		;
+
+	return(resp == RESP_OK || (resp == RESP_UNKNOWN && frame[i] == '?'));
+}
+
+/*
+ * Send one raw frame (8 characters, no CR) and print its result as
+ * "frame<TAB>result<TAB>ms". Only the framing is checked.
+ */
+int
+rawframe(
+	char *progname,
+	char *frame
+)
+{
+	char      reply[255];
+	int       resp;
+	long long start;
+
+	if (badframe(frame)) {
+		fprintf(stderr, "%s: bad frame '%s' (need 8 printable characters)\n",
+			progname, frame);
+		return(RESP_UNKNOWN);
+	}
+
+	if (nosend == 1) {
+		printf("command='%.4s', parameter='%.4s'\n", frame, frame + 4);
+		return(RESP_OK);
+	}
+
+	start = monotime();
+	if (noreply(frame)) {
+		transact(frame, frame + 4, reply, sizeof(reply), 0);
+		resp = RESP_OK;
+		strcpy(reply, "sent");
+	}
+	else if ((resp = transact(frame, frame + 4, reply, sizeof(reply),
+	                          TIMEOUT_ADAPTIVE)) == RESP_NONE) {
+		strcpy(reply, "No response.");
+	}
+
+	printf("%s\t%s\t%.1f\n", frame, reply, (monotime() - start) / 1e6);
+
+	return(rawok(frame, resp) ? RESP_OK : resp);
+}
+
+/*
+ * raw's path with a window above 1: queue the frame for the port engine
+ * so it can go out while earlier ones are still being answered. Its
+ * line is printed by rawdone(), in order, when the reply comes back.
+ */
+int
+rawqueue(
+	char *progname,
+	char *frame
+)
+{
+	static struct job jobs[WINDOW_MAX + 1];
+	static int        next = 0;
+	struct job        *job;
+
+	if (badframe(frame)) {
+		enginedrain(0); /* keep the output in order */
+		return(rawframe(progname, frame));
+	}
+
+	/* Jobs finish in the order queued, so with no more than WINDOW_MAX
+	   outstanding the slot after them is free again. */
+	enginedrain(WINDOW_MAX);
+	job = &jobs[next++ % (WINDOW_MAX + 1)];
+	snprintf(job->frame, sizeof(job->frame), "%s", frame);
+	job->done = rawdone;
+	submitjob(job);
+	enginerun(0);
+
+	return(RESP_OK);
+}
+
+void
+rawdone(
+	struct job *job,
+	int        resp,
+	char       *reply
+)
+{
+	if (resp == RESP_NONE) reply = "No response.";
+	if (!rawok(job->frame, resp)) rawfailed = 1;
+
+	printf("%s\t%s\t%.1f\n", job->frame, reply, (monotime() - job->sent) / 1e6);
+}
+
+/*
+ * Pass frames straight through to the TV, from argv or one per line on
+ * stdin, over the one open port. stdin is read in large blocks so
+ * generated streams run as fast as the TV answers.
+ */
+int
+raw(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	static char buffer[65536];
+	char        *line, *nl;
+	int         i, status = EXIT_SUCCESS,
+	            windowed = (cfg.window > 1 && nosend == 0);
+	int         (*send)(char [], char []) = windowed ? rawqueue : rawframe;
+	size_t      len = 0;
+	ssize_t     nbytes;
+
+	if (windowed) {
+		loadhealth();
+		engine.window = cfg.window;
+		engine.ready = monotime();
+		awaitdue();
+	}
+
+	if (argc > 0) {
+		for (i = 0; i < argc; i++) {
+			if (send(progname, argv[i]) != RESP_OK) status = EXIT_FAILURE;
+		}
+		enginedrain(0);
+		return(rawfailed ? EXIT_FAILURE : status);
+	}
+
+	while ((nbytes = rawinput(buffer + len, sizeof(buffer) - len - 1)) > 0 ||
+	       len > 0) {
+		len += nbytes > 0 ? nbytes : 0;
+		buffer[len] = '\0';
+		if (nbytes <= 0 && memchr(buffer, '\n', len) == NULL) {
+			buffer[len++] = '\n'; /* unterminated last line */
+		}
+
+		for (line = buffer; (nl = memchr(line, '\n', buffer + len - line)) != NULL;
+		     line = nl + 1) {
+			*nl = '\0';
+			if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+			if (*line == '\0') continue;
+			if (send(progname, line) != RESP_OK) status = EXIT_FAILURE;
+		}
+
+		len = buffer + len - line;
+		if (len == sizeof(buffer) - 1) {
+			fprintf(stderr, "%s: line too long\n", progname);
+			return(EXIT_FAILURE);
+		}
+		memmove(buffer, line, len);
+	}
+	enginedrain(0);
+
+	return(rawfailed ? EXIT_FAILURE : status);
+}
+
+/* read() stdin for raw, keeping the engine going while it waits. */
+ssize_t
+rawinput(
+	char   *buffer,
+	size_t size
+)
+{
+	struct pollfd pfds[2];
+	int           wait;
+
+	while (engine.queued + engine.inflight > 0) {
+		wait = enginepoll(&pfds[0]);
+		pfds[1].fd = STDIN_FILENO;
+		pfds[1].events = POLLIN;
+		pfds[1].revents = 0;
+		if (poll(pfds, 2, wait) < 0 && errno != EINTR) break;
+		enginerun(pfds[0].revents);
+		if (pfds[1].revents != 0) break;
+	}
+
+	return(read(STDIN_FILENO, buffer, size));
+}
+
+/*
+ * Read settings from the config file. Missing files and keys keep the
+ * defaults in cfg.
+ */
+void
+loadconfig(void)
+{
+	cfgdefaults = cfg;
+	parseconfig(statepath(CONFIG_FILE), &cfg, NULL, 0);
+}
+
+/*
+ * Read the config file at path over c. Bad lines are reported on stderr
+ * and skipped, and the first is left in error. Returns how many there
+ * were. Touches nothing else, so serve can reload on another thread.
+ */
+int
+parseconfig(
+	char          *path,
+	struct config *c,
+	char          *error,
+	size_t        size
+)
+{
+	FILE   *fp;
+	char   line[256], key[64], name[32], text[256], *hash, *problem;
+	double value;
+	int    lineno = 0, n, modelwindow = 0, errors = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) return(0);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((hash = strchr(line, '#')) != NULL) *hash = '\0';
+		if (sscanf(line, "%63s", key) != 1) continue;
+		problem = NULL;
+
+		if (strcmp(key, "lock-dir") == 0 &&
+		    sscanf(line, "%*s %4095s", c->lock_dir) == 1) {
+			continue;
+		}
+		if (strcmp(key, "broker-socket") == 0 &&
+		    sscanf(line, "%*s %4095s", c->broker_socket) == 1) {
+			continue;
+		}
+		if (strcmp(key, "log") == 0 &&
+		    sscanf(line, "%*s %4095s", c->log) == 1) {
+			continue;
+		}
+		if (strcmp(key, "http-listen") == 0 &&
+		    sscanf(line, "%*s %63s", c->http_listen) == 1) {
+			continue;
+		}
+		if (strcmp(key, "http-token") == 0 &&
+		    sscanf(line, "%*s %63s", c->http_token) == 1) {
+			continue;
+		}
+		if (strcmp(key, "mqtt-server") == 0 &&
+		    sscanf(line, "%*s %255s", c->mqtt_server) == 1) {
+			continue;
+		}
+		if (strcmp(key, "mqtt-prefix") == 0 &&
+		    sscanf(line, "%*s %63s", c->mqtt_prefix) == 1) {
+			continue;
+		}
+		if (strcmp(key, "mqtt-name") == 0 &&
+		    sscanf(line, "%*s %63s", c->mqtt_name) == 1) {
+			continue;
+		}
+		/* Too long for sun_path is a bad line, not a different socket. */
+		if (strcmp(key, "admin-socket") == 0 &&
+		    sscanf(line, "%*s %255s", text) == 1 &&
+		    strlen(text) < sizeof(c->admin_socket)) {
+			strcpy(c->admin_socket, text);
+			continue;
+		}
+
+		/* "window n model" wins over a plain "window n" for that model. */
+		if (strcmp(key, "window") == 0 &&
+		    (n = sscanf(line, "%*s %lf %31s", &value, name)) >= 1 &&
+		    value >= 1 && value <= WINDOW_MAX) {
+			if (n == 2 && strcmp(name, model) == 0) {
+				c->window = (int) value;
+				modelwindow = 1;
+			}
+			else if (n == 1 && !modelwindow) {
+				c->window = (int) value;
+			}
+			continue;
+		}
+
+		if (strcmp(key, "slo") == 0) {
+			problem = sloline(c, line);
+		}
+		else if (strcmp(key, "admin-socket") == 0 &&
+		         sscanf(line, "%*s %255s", text) == 1) {
+			problem = "path too long for";
+		}
+		else if (sscanf(line, "%*s %lf", &value) != 1) {
+			problem = "missing value for";
+		}
+		else if (strcmp(key, "timeout-percentile") == 0 &&
+		         value > 0 && value <= 100) {
+			c->timeout_percentile = value;
+		}
+		else if (strcmp(key, "timeout-factor") == 0 && value >= 1) {
+			c->timeout_factor = value;
+		}
+		else if (strcmp(key, "timeout-floor") == 0 && value >= 1) {
+			c->timeout_floor = (int) value;
+		}
+		else if (strcmp(key, "timeout-ceiling") == 0 && value >= 1) {
+			c->timeout_ceiling = (int) value;
+		}
+		else if (strcmp(key, "timeout-default") == 0 && value >= 1) {
+			c->timeout_default = (int) value;
+		}
+		else if (strcmp(key, "timeout-samples") == 0 && value >= 0) {
+			c->timeout_samples = (int) value;
+		}
+		else if (strcmp(key, "latency-window") == 0 && value >= 16) {
+			c->latency_window = (int) value;
+		}
+		else if (strcmp(key, "health-alpha") == 0 &&
+		         value > 0 && value <= 1) {
+			c->health_alpha = value;
+		}
+		else if (strcmp(key, "health-latency") == 0 && value >= 1) {
+			c->health_latency = (int) value;
+		}
+		else if (strcmp(key, "health-degrade") == 0 &&
+		         value >= 0 && value <= 100) {
+			c->health_degrade = value;
+		}
+		else if (strcmp(key, "health-recover") == 0 &&
+		         value >= 0 && value <= 100) {
+			c->health_recover = value;
+		}
+		else if (strcmp(key, "health-gap") == 0 && value >= 0) {
+			c->health_gap = (int) value;
+		}
+		else if (strcmp(key, "lock-timeout") == 0 && value >= 0) {
+			c->lock_timeout = (int) value;
+		}
+		else if (strcmp(key, "mqtt-keepalive") == 0 &&
+		         value >= 2 && value <= 65535) {
+			c->mqtt_keepalive = (int) value;
+		}
+		else if (strcmp(key, "mqtt-metrics") == 0 && value >= 100) {
+			c->mqtt_metrics = (int) value;
+		}
+		else if (strcmp(key, "realtime-priority") == 0 &&
+		         value >= 1 && value <= 99) {
+			c->realtime_priority = (int) value;
+		}
+		else if (strcmp(key, "slo-window") == 0 && value >= 1000) {
+			c->slo_window = (int) value;
+		}
+		else {
+			problem = "bad setting";
+		}
+
+		if (problem == NULL) continue;
+		if (errors++ == 0 && error != NULL)
+			snprintf(error, size, "%s:%d: %s %s", path, lineno, problem, key);
+		fprintf(stderr, "%s:%d: %s %s\n", path, lineno, problem, key);
+	}
+
+	if (c->timeout_ceiling < c->timeout_floor)
+		c->timeout_ceiling = c->timeout_floor;
+	if (c->health_recover < c->health_degrade)
+		c->health_recover = c->health_degrade;
+
+	fclose(fp);
+
+	return(errors);
+}
+
+/*
+ * An "slo code percentile ms [port]" line into c. A line naming this
+ * port replaces a plain one for the same code and percentile, and a
+ * plain one doesn't replace it; lines for other ports are skipped.
+ * Returns NULL, or what is wrong with the line.
+ */
+char *
+sloline(
+	struct config *c,
+	char          *line
+)
+{
+	struct slotarget *t;
+	char             code[8], port[256];
+	double           pct;
+	int              ms, n, i;
+
+	if ((n = sscanf(line, "%*s %7s %lf %d %255s", code, &pct, &ms, port)) < 3)
+		return("missing value for");
+	if ((strlen(code) != 4 && strcmp(code, "*") != 0) ||
+	    pct <= 0 || pct > 100 || ms < 1) {
+		return("bad setting");
+	}
+	if (n == 4 && strcmp(port, portname) != 0) return(NULL);
+
+	for (i = 0; i < c->nslo; i++) {
+		if (strcmp(c->slo[i].code, code) == 0 &&
+		    c->slo[i].percentile == pct) {
+			break;
+		}
+	}
+	if (i == c->nslo) {
+		if (c->nslo == SLO_TARGETS) return("too many lines for");
+		c->nslo++;
+	}
+	else if (c->slo[i].port && n == 3) {
+		return(NULL);
+	}
+
+	t = &c->slo[i];
+	memcpy(t->code, code, strlen(code) + 1);
+	t->percentile = pct;
+	t->ms = ms;
+	t->port = (n == 4);
+
+	return(NULL);
+}
+
+/* Histogram bucket for a latency in nanoseconds. */
+int
+latencybucket(
+	long long ns
+)
+{
+	long long us = ns / 1000;
+	int       e;
+
+	if (us < 16) return(us < 0 ? 0 : (int) us);
+
+	for (e = 4; (us >> (e + 1)) != 0; e++)
+		;
+	e = 16 + (e - 4) * 4 + (int) ((us >> (e - 2)) & 3);
+
+	return(e < LAT_BUCKETS ? e : LAT_BUCKETS - 1);
+}
+
+/* Upper bound of a bucket in nanoseconds. */
+long long
+bucketlimit(
+	int bucket
+)
+{
+	int e;
+
+	if (bucket < 16) return((bucket + 1) * 1000LL);
+
+	e = 4 + (bucket - 16) / 4;
+
+	return(((1LL << e) + ((bucket - 16) % 4 + 1) * (1LL << (e - 2))) * 1000LL);
+}
+
+/* The bucket of count[] (total samples) holding the pct'th percentile. */
+int
+bucketpercentile(
+	uint32_t *count,
+	uint32_t total,
+	double   pct
+)
+{
+	long long rank, seen = 0;
+	int       b;
+
+	rank = (long long) (total * pct / 100.0 + 0.5);
+	if (rank < 1) rank = 1;
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		if ((seen += count[b]) >= rank) break;
+	}
+
+	return(b);
+}
+
+/*
+ * Latency table for this port's opcodes. The file holds every port, one
+ * line per (port, opcode) with the bucket counts as bucket:count pairs.
+ */
+void
+loadlatency(void)
+{
+	FILE           *fp;
+	struct latency *l;
+	char           line[4096], p[256], c[8], *tok;
+	int            bucket, n;
+	unsigned       count;
+
+	if (latencyloaded) return;
+	latencyloaded = 1;
+
+	if ((fp = fopen(statepath(LATENCY_FILE), "r")) == NULL) return;
+
+	while (fgets(line, sizeof(line), fp) != NULL && nlatency < MAX_LATENCY) {
+		if (sscanf(line, "%255s %4s%n", p, c, &n) != 2 ||
+		    strcmp(p, portname) != 0) {
+			continue;
+		}
+		l = &latency[nlatency++];
+		memset(l, 0, sizeof(*l));
+		strcpy(l->command, c);
+		tok = strtok(line + n, " \n");
+		if (tok != NULL) l->timeouts = strtoul(tok, NULL, 10);
+		while ((tok = strtok(NULL, " \n")) != NULL) {
+			if (sscanf(tok, "%d:%u", &bucket, &count) == 2 &&
+			    bucket >= 0 && bucket < LAT_BUCKETS) {
+				l->count[bucket] = count;
+				l->total += count;
+			}
+		}
+	}
+
+	fclose(fp);
+}
+
+void
+savelatency(void)
+{
+	FILE           *in, *out;
+	struct latency *l;
+	char           tmp[PATH_MAX], line[4096], p[256];
+	int            i, b, lock;
+
+	if (latencydirty == 0) return;
+	latencydirty = 0;
+
+	if ((out = statebegin(LATENCY_FILE, tmp, sizeof(tmp), &lock)) == NULL)
+		return;
+
+	if ((in = fopen(statepath(LATENCY_FILE), "r")) != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (sscanf(line, "%255s", p) == 1 && strcmp(p, portname) != 0)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	for (i = 0; i < nlatency; i++) {
+		l = &latency[i];
+		fprintf(out, "%s %s %u", portname, l->command, l->timeouts);
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			if (l->count[b]) fprintf(out, " %d:%u", b, l->count[b]);
+		}
+		fputc('\n', out);
+	}
+
+	statecommit(out, tmp, LATENCY_FILE, lock);
+}
+
+struct latency *
+findlatency(
+	char *command,
+	int  create
+)
+{
+	int i;
+
+	loadlatency();
+
+	for (i = 0; i < nlatency; i++) {
+		if (strncmp(latency[i].command, command, 4) == 0)
+			return(&latency[i]);
+	}
+
+	if (create == 0 || nlatency == MAX_LATENCY) return(NULL);
+
+	memset(&latency[nlatency], 0, sizeof(latency[0]));
+	snprintf(latency[nlatency].command, 5, "%.4s", command);
+
+	return(&latency[nlatency++]);
+}
+
+/*
+ * Add a reply time to command's histogram. Once latency_window samples
+ * have built up all counts are halved, so the estimate follows changes
+ * in the TV or link while the table stays small.
+ */
+void
+recordlatency(
+	char      *command,
+	long long ns,
+	int       timedout
+)
+{
+	struct latency *l;
+	int            b;
+
+	if ((l = findlatency(command, 1)) == NULL) return;
+
+	if (latencydirty == 0) {
+		latencydirty = 1;
+		atexit(savelatency);
+	}
+
+	l->count[latencybucket(ns)]++;
+	l->total++;
+	if (timedout) l->timeouts++;
+
+	if (l->total >= cfg.latency_window) {
+		l->total = 0;
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			l->count[b] /= 2;
+			l->total += l->count[b];
+		}
+		l->timeouts /= 2;
+	}
+}
+
+/*
+ * Reply deadline for command in milliseconds: the configured percentile
+ * of its observed latency times the safety factor, bounded by the floor
+ * and ceiling. Commands the TV never answers only wait the floor.
+ */
+int
+replytimeout(
+	char *command
+)
+{
+	struct latency *l;
+	long long      limit;
+	int            ms;
+
+	if (noreply(command)) return(cfg.timeout_floor);
+
+	l = findlatency(command, 0);
+	if (l == NULL || l->total < cfg.timeout_samples || l->total == 0) {
+		ms = cfg.timeout_default;
+	}
+	else {
+		limit = bucketlimit(bucketpercentile(l->count, l->total,
+			cfg.timeout_percentile));
+		ms = (int) (limit * cfg.timeout_factor / 1000000.0 + 0.999);
+	}
+
+	if (ms < cfg.timeout_floor) ms = cfg.timeout_floor;
+	if (ms > cfg.timeout_ceiling) ms = cfg.timeout_ceiling;
+
+	if (verbose == 1) logmsg("timeout=%dms", ms);
+
+	return(ms);
+}
+
+void
+loadhealth(void)
+{
+	FILE          *fp;
+	struct health h;
+	char          p[256];
+
+	if (healthloaded) return;
+	healthloaded = 1;
+
+	if ((fp = fopen(statepath(HEALTH_FILE), "r")) == NULL) return;
+
+	while (fscanf(fp, "%255s %lf %d %d %lf %lf %lf %lf", p, &h.score,
+	              &h.level, &h.settle, &h.latency, &h.timeouts, &h.errors,
+	              &h.resyncs) == 8) {
+		if (strcmp(p, portname) == 0) health = h;
+	}
+
+	fclose(fp);
+}
+
+void
+savehealth(void)
+{
+	FILE *in, *out;
+	char tmp[PATH_MAX], line[512], p[256];
+	int  lock;
+
+	if (healthdirty == 0) return;
+	healthdirty = 0;
+
+	if ((out = statebegin(HEALTH_FILE, tmp, sizeof(tmp), &lock)) == NULL)
+		return;
+
+	if ((in = fopen(statepath(HEALTH_FILE), "r")) != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (sscanf(line, "%255s", p) == 1 && strcmp(p, portname) != 0)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s %.1f %d %d %.1f %.4f %.4f %.4f\n", portname,
+		health.score, health.level, health.settle, health.latency,
+		health.timeouts, health.errors, health.resyncs);
+
+	statecommit(out, tmp, HEALTH_FILE, lock);
+}
+
+/*
+ * Fold one frame's outcome into the port's health and move between
+ * degraded levels. The score multiplies the success rates of the three
+ * failure kinds with a latency factor that falls off once the average
+ * reply time passes health_latency. Level changes are logged to stderr
+ * and the health log.
+ */
+void
+recordhealth(
+	int       resp,
+	long long ns,
+	int       resync
+)
+{
+	FILE   *fp;
+	double a = cfg.health_alpha, ms = ns / 1e6, latfactor;
+	int    old = health.level;
+	time_t now;
+	char   when[32];
+
+	loadhealth();
+	if (healthdirty == 0) {
+		healthdirty = 1;
+		atexit(savehealth);
+	}
+
+	health.latency += a * (ms - health.latency);
+	health.timeouts += a * ((resp == RESP_NONE) - health.timeouts);
+	health.errors += a * ((resp == RESP_ERR && !probing) - health.errors);
+	health.resyncs += a * ((resync != 0) - health.resyncs);
+
+	latfactor = health.latency > cfg.health_latency ?
+	            cfg.health_latency / health.latency : 1.0;
+	health.score = 100.0 * (1 - health.timeouts) * (1 - health.errors) *
+	               (1 - health.resyncs) * latfactor;
+
+	if (++health.settle < HEALTH_SETTLE) return;
+
+	if (health.score < cfg.health_degrade && health.level < HEALTH_LEVELS)
+		health.level++;
+	else if (health.score >= cfg.health_recover && health.level > 0)
+		health.level--;
+
+	if (health.level == old) return;
+	health.settle = 0;
+
+	fprintf(stderr, "%s: health %.0f, %s to level %d (gap %d ms)\n",
+		portname, health.score, health.level > old ? "degraded" : "recovered",
+		health.level, health.level * cfg.health_gap);
+
+	if ((fp = fopen(statepath(HEALTH_LOG), "a")) != NULL) {
+		now = time(NULL);
+		strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+		fprintf(fp, "%s %s level %d -> %d score %.1f latency %.1f "
+			"timeouts %.3f errors %.3f resyncs %.3f\n",
+			when, portname, old, health.level, health.score,
+			health.latency, health.timeouts, health.errors, health.resyncs);
+		fclose(fp);
+	}
+}
+
+/* Print the health table for every port seen. */
+int
+showhealth(void)
+{
+	FILE          *fp;
+	struct health h;
+	char          p[256];
+
+	if ((fp = fopen(statepath(HEALTH_FILE), "r")) == NULL) {
+		printf("no health data yet\n");
+		return(EXIT_SUCCESS);
+	}
+
+	printf("%-20s %5s %5s %10s %8s %8s %8s\n", "port", "score", "level",
+		"latency ms", "timeout", "err", "resync");
+	while (fscanf(fp, "%255s %lf %d %d %lf %lf %lf %lf", p, &h.score,
+	              &h.level, &h.settle, &h.latency, &h.timeouts, &h.errors,
+	              &h.resyncs) == 8) {
+		printf("%-20s %5.0f %5d %10.1f %8.3f %8.3f %8.3f\n", p, h.score,
+			h.level, h.latency, h.timeouts, h.errors, h.resyncs);
+	}
+
+	fclose(fp);
+
+	return(EXIT_SUCCESS);
+}
+
+/*
+ * Return the path of a file in the per-user state directory
+ * ($AQUOSCTL_DIR, or ~/.aquosctl), creating the directory if needed.
+ * The result is a static buffer.
+ */
+char *
+statepath(
+	char *name
+)
+{
+	static char path[PATH_MAX];
+	char        *dir, *home;
+
+	if ((dir = getenv("AQUOSCTL_DIR")) != NULL && strcmp(dir, "") != 0) {
+		snprintf(path, sizeof(path), "%s", dir);
+	}
+	else {
+		if ((home = getenv("HOME")) == NULL) home = ".";
+		snprintf(path, sizeof(path), "%s/.aquosctl", home);
+	}
+	(void) mkdir(path, 0755);
+
+	strncat(path, "/", sizeof(path) - strlen(path) - 1);
+	strncat(path, name, sizeof(path) - strlen(path) - 1);
+
+	return(path);
+}
+
+/*
+ * Start rewriting the state file name, which other aquosctl processes
+ * may be reading and rewriting at the same time. Its lock file
+ * (name.lock) is flocked until statecommit(), so one read-merge-write
+ * can't undo another's, and the new contents go to a file of our own
+ * from mkstemp(), named in tmp. Returns NULL if it can't be written.
+ */
+FILE *
+statebegin(
+	char   *name,
+	char   *tmp,
+	size_t size,
+	int    *lock
+)
+{
+	char path[PATH_MAX];
+	FILE *out;
+	int  fd;
+
+	snprintf(path, sizeof(path), "%s.lock", statepath(name));
+	if ((*lock = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+	                  0600)) == -1) {
+		return(NULL);
+	}
+	while (flock(*lock, LOCK_EX) == -1 && errno == EINTR)
+		;
+
+	snprintf(tmp, size, "%s.XXXXXX", statepath(name));
+	if ((fd = mkstemp(tmp)) == -1 || (out = fdopen(fd, "w")) == NULL) {
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		close(*lock);
+		return(NULL);
+	}
+	fchmod(fd, 0644); /* as fopen() made them */
+
+	return(out);
+}
+
+/* Put what statebegin() started in place of name, and let others in. */
+void
+statecommit(
+	FILE *out,
+	char *tmp,
+	char *name,
+	int  lock
+)
+{
+	if (fclose(out) == 0) rename(tmp, statepath(name));
+	else unlink(tmp);
+	close(lock);
+}
+
+/*
+ * Load the View Mode and input last seen on this port. They key the
+ * learned ranges, so they are updated whenever a viewmode/input command
+ * succeeds or the TV is queried.
+ */
+void
+loadcontext(void)
+{
+	FILE *fp;
+	char p[256], v[8], s[8];
+
+	if ((fp = fopen(statepath(CONTEXT_FILE), "r")) == NULL) return;
+
+	while (fscanf(fp, "%255s %7s %7s", p, v, s) == 3) {
+		if (strcmp(p, portname) == 0) {
+			strcpy(ctxview, v);
+			strcpy(ctxsignal, s);
+		}
+	}
+
+	fclose(fp);
+}
+
+void
+savecontext(void)
+{
+	FILE *in, *out;
+	char tmp[PATH_MAX], p[256], v[8], s[8];
+	int  lock;
+
+	if ((out = statebegin(CONTEXT_FILE, tmp, sizeof(tmp), &lock)) == NULL)
+		return;
+
+	if ((in = fopen(statepath(CONTEXT_FILE), "r")) != NULL) {
+		while (fscanf(in, "%255s %7s %7s", p, v, s) == 3) {
+			if (strcmp(p, portname) != 0)
+				fprintf(out, "%s %s %s\n", p, v, s);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s %s %s\n", portname, ctxview, ctxsignal);
+
+	statecommit(out, tmp, CONTEXT_FILE, lock);
+}
+
+/* Update the remembered View Mode and/or input; NULL leaves one as is. */
+void
+setcontext(
+	char *view,
+	char *signal
+)
+{
+	if (nosend == 1) return;
+
+	loadcontext();
+	if (view != NULL) snprintf(ctxview, sizeof(ctxview), "%s", view);
+	if (signal != NULL) snprintf(ctxsignal, sizeof(ctxsignal), "%s", signal);
+	savecontext();
+}
+
+void
+loadranges(void)
+{
+	FILE *fp;
+	struct range r;
+
+	if (rangesloaded) return;
+	rangesloaded = 1;
+	loadcontext();
+
+	if ((fp = fopen(statepath(RANGES_FILE), "r")) == NULL) return;
+
+	while (nranges < MAX_RANGES &&
+	       fscanf(fp, "%31s %7s %7s %4s %d %d %d %d",
+	              r.model, r.view, r.signal, r.cmd,
+	              &r.lo_ok, &r.hi_ok, &r.lo_bad, &r.hi_bad) == 8) {
+		ranges[nranges++] = r;
+	}
+
+	fclose(fp);
+}
+
+void
+saveranges(void)
+{
+	FILE *fp;
+	char tmp[PATH_MAX];
+	int  i, lock;
+
+	if ((fp = statebegin(RANGES_FILE, tmp, sizeof(tmp), &lock)) == NULL) {
+		fprintf(stderr, "saveranges(%s): %s\n", statepath(RANGES_FILE),
+			strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < nranges; i++) {
+		fprintf(fp, "%s %s %s %s %d %d %d %d\n",
+			ranges[i].model, ranges[i].view, ranges[i].signal,
+			ranges[i].cmd, ranges[i].lo_ok, ranges[i].hi_ok,
+			ranges[i].lo_bad, ranges[i].hi_bad
+		);
+	}
+
+	statecommit(fp, tmp, RANGES_FILE, lock);
+}
+
+/*
+ * Find the learned range of command for the current model, View Mode
+ * and input. With create set, a new entry bounded by the static limits
+ * is added if there isn't one.
+ */
+struct range *
+findrange(
+	char *command,
+	int  create
+)
+{
+	struct range *r;
+	int i;
+
+	loadranges();
+
+	for (i = 0; i < nranges; i++) {
+		r = &ranges[i];
+		if (strcmp(r->model, model) == 0 &&
+		    strcmp(r->view, ctxview) == 0 &&
+		    strcmp(r->signal, ctxsignal) == 0 &&
+		    strcmp(r->cmd, command) == 0) {
+			return(r);
+		}
+	}
+
+	if (create == 0 || nranges == MAX_RANGES) return(NULL);
+
+	for (i = 0; i < sizeof(rangetab) / sizeof(rangetab[0]); i++) {
+		if (strcmp(rangetab[i].cmd, command) == 0) break;
+	}
+	if (i == sizeof(rangetab) / sizeof(rangetab[0])) return(NULL);
+
+	r = &ranges[nranges++];
+	snprintf(r->model, sizeof(r->model), "%s", model);
+	strcpy(r->view, ctxview);
+	strcpy(r->signal, ctxsignal);
+	strcpy(r->cmd, command);
+	r->lo_ok = r->hi_ok = -1;
+	r->lo_bad = rangetab[i].min - 1;
+	r->hi_bad = rangetab[i].max + 1;
+
+	return(r);
+}
+
+/*
+ * Check arg against the learned range of command. Values the TV is known
+ * to reject fail here instead of costing a round trip, or with -c are
+ * clamped (arg is rewritten) to the nearest usable value.
+ */
+int
+checkrange(
+	char *progname,
+	char *command,
+	char *arg
+)
+{
+	struct range *r;
+	int  value = atoi(arg), lo, hi;
+
+	if ((r = findrange(command, 0)) == NULL) return(EXIT_SUCCESS);
+
+	lo = (r->lo_ok != -1) ? r->lo_ok : r->lo_bad + 1;
+	hi = (r->hi_ok != -1) ? r->hi_ok : r->hi_bad - 1;
+
+	if (value > r->lo_bad && value < r->hi_bad) return(EXIT_SUCCESS);
+
+	if (clamp == 1 && lo <= hi) {
+		value = (value <= r->lo_bad) ? lo : hi;
+		if (verbose == 1) {
+			logmsg("%s: clamped %s to %d (model %s, view %s, input %s)",
+				command, arg, value, model, ctxview, ctxsignal);
+		}
+		sprintf(arg, "%d", value);
+		return(EXIT_SUCCESS);
+	}
+
+	fprintf(stderr,
+		"%s: %s %s is outside the learned range %d-%d "
+		"(model %s, view %s, input %s).\n",
+		progname, command, arg, lo, hi, model, ctxview, ctxsignal
+	);
+
+	return(EXIT_FAILURE);
+}
+
+/* Narrow the learned range of command with the TV's verdict on value. */
+void
+recordrange(
+	char *command,
+	int  value,
+	int  resp
+)
+{
+	struct range *r;
+	int changed = 0;
+
+	if (nosend == 1 || (resp != RESP_OK && resp != RESP_ERR)) return;
+	if ((r = findrange(command, 1)) == NULL) return;
+
+	if (resp == RESP_OK) {
+		if (r->lo_ok == -1 || value < r->lo_ok) {
+			r->lo_ok = value;
+			changed = 1;
+		}
+		if (r->hi_ok == -1 || value > r->hi_ok) {
+			r->hi_ok = value;
+			changed = 1;
+		}
+		/* A wider accepted range invalidates stale rejections. */
+		if (r->lo_bad >= r->lo_ok) r->lo_bad = r->lo_ok - 1;
+		if (r->hi_bad <= r->hi_ok) r->hi_bad = r->hi_ok + 1;
+	}
+	else if (r->lo_ok != -1) {
+		/* Which side was rejected is only known once something has
+		   been accepted. */
+		if (value > r->hi_ok && value < r->hi_bad) {
+			r->hi_bad = value;
+			changed = 1;
+		}
+		else if (value < r->lo_ok && value > r->lo_bad) {
+			r->lo_bad = value;
+			changed = 1;
+		}
+	}
+
+	if (changed) saveranges();
+}
+
+/*
+ * Probe value with a set command without the usual error reporting,
+ * returning RESP_OK, RESP_ERR or RESP_NONE.
+ */
+int
+proberange(
+	char *command,
+	int  value,
+	int  *probes
+)
+{
+	char buffer[255], param[12]; /* any int; ranges keep to 4 digits */
+	int  resp;
+
+	snprintf(param, sizeof(param), "%-4d", value);
+	resp = transact(command, param, buffer, sizeof(buffer),
+	                TIMEOUT_ADAPTIVE);
+	(*probes)++;
+
+	if (verbose == 1) logmsg("probe %s%s: %s", command, param, buffer);
+
+	if (resp == RESP_NONE) return(RESP_NONE);
+	return(resp == RESP_OK ? RESP_OK : RESP_ERR);
+}
+
+/*
+ * Discover the exact limits of command for the current View Mode and
+ * input by bisecting between an accepted value and the static limits.
+ * The original value is restored afterwards, also when the TV stops
+ * answering part way.
+ */
+int
+learnrange(
+	char *progname,
+	char *command
+)
+{
+	struct range   *r;
+	struct timeval start, end;
+	char           reply[255];
+	int            orig = -1, ok = -1, lo, hi, mid, probes = 0, step;
+	int            resp, lost = 0;
+
+	gettimeofday(&start, NULL);
+	probing = 1;
+
+	loadranges();
+	if (querycommand("WIDE", reply, sizeof(reply)) == RESP_OK) {
+		snprintf(ctxview, sizeof(ctxview), "%.7s", reply);
+	}
+	if (querycommand("IAVD", reply, sizeof(reply)) == RESP_OK) {
+		snprintf(ctxsignal, sizeof(ctxsignal), "%.7s", reply);
+	}
+	savecontext();
+
+	/* Start over for this context; old observations may be stale. */
+	if ((r = findrange(command, 1)) == NULL) return(EXIT_FAILURE);
+	r->lo_ok = r->hi_ok = -1;
+	for (lo = 0; strcmp(rangetab[lo].cmd, command) != 0; lo++)
+		;
+	r->lo_bad = rangetab[lo].min - 1;
+	r->hi_bad = rangetab[lo].max + 1;
+
+	/* The current setting is a known good starting point. */
+	if (querycommand(command, reply, sizeof(reply)) == RESP_OK &&
+	    reply[0] >= '0' && reply[0] <= '9') {
+		orig = atoi(reply);
+		if ((resp = proberange(command, orig, &probes)) == RESP_OK) ok = orig;
+		lost = (resp == RESP_NONE);
+	}
+
+	/* Otherwise look for one, coarse to fine. */
+	for (step = (r->hi_bad - r->lo_bad) / 2; ok == -1 && !lost && step > 0;
+	     step /= 2) {
+		for (mid = r->lo_bad + step; mid < r->hi_bad && !lost;
+		     mid += 2 * step) {
+			if ((resp = proberange(command, mid, &probes)) == RESP_OK) {
+				ok = mid;
+				break;
+			}
+			lost = (resp == RESP_NONE);
+		}
+	}
+
+	if (ok == -1 && !lost) {
+		fprintf(stderr, "%s: no %s value accepted; is the input in PC mode?\n",
+			progname, command);
+		return(EXIT_FAILURE);
+	}
+
+	/* Upper limit: ok is accepted, hi is rejected (or out of bounds). */
+	lo = ok;
+	hi = r->hi_bad;
+	while (!lost && hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if ((resp = proberange(command, mid, &probes)) == RESP_OK) lo = mid;
+		else if (resp == RESP_ERR) hi = mid;
+		else lost = 1;
+	}
+	if (!lost) {
+		r->hi_ok = lo;
+		r->hi_bad = hi;
+	}
+
+	/* Lower limit. */
+	lo = r->lo_bad;
+	hi = ok;
+	while (!lost && hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if ((resp = proberange(command, mid, &probes)) == RESP_OK) hi = mid;
+		else if (resp == RESP_ERR) lo = mid;
+		else lost = 1;
+	}
+	if (!lost) {
+		r->lo_ok = hi;
+		r->lo_bad = lo;
+	}
+
+	/* Put the setting back, even (especially) after a timeout. */
+	if (orig != -1 &&
+	    proberange(command, orig, &probes) != RESP_OK) {
+		fprintf(stderr, "%s: couldn't restore %s to %d\n",
+			progname, command, orig);
+	}
+
+	if (lost) {
+		fprintf(stderr, "%s: no response to %s after %d probes; "
+			"nothing learned\n", progname, command, probes);
+		return(EXIT_FAILURE);
+	}
+
+	saveranges();
+	gettimeofday(&end, NULL);
+
+	printf("%s: %d - %d (model %s, view %s, input %s), "
+		"%d probes in %ld ms\n",
+		command, r->lo_ok, r->hi_ok, model, ctxview, ctxsignal, probes,
+		(end.tv_sec - start.tv_sec) * 1000L +
+		(end.tv_usec - start.tv_usec) / 1000L
+	);
+
+	return(EXIT_SUCCESS);
+}
+
+/*
+ * Serve mode's side of the port. Front ends queue jobs (one frame each)
+ * with submitjob(); enginerun() writes them as the port, the window and
+ * the health gap allow and hands each reply to the job's done().
+ * Nothing here blocks, so it shares the front ends' poll loop.
+ */
+void
+submitjob(
+	struct job *job
+)
+{
+	job->queued = monotime();
+	job->next = NULL;
+	if (engine.tail != NULL) engine.tail->next = job;
+	else engine.head = job;
+	engine.tail = job;
+	engine.queued++;
+}
+
+/*
+ * Set up pfd for the port and return how long (ms) poll may sleep
+ * before enginerun() has something to do, or -1.
+ */
+int
+enginepoll(
+	struct pollfd *pfd
+)
+{
+	long long now = monotime(), when = -1;
+
+	pfd->fd = (nosend == 1) ? -1 : fd;
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+
+	if (engine.first != NULL) when = jobdeadline(engine.first);
+	if (enginecansend() && (when == -1 || engine.ready < when))
+		when = engine.ready;
+	if (when == -1) return(-1);
+
+	return(when <= now ? 0 : (int) ((when - now + 999999) / 1000000));
+}
+
+/*
+ * With a window above 1 (the window setting), frames go out before the
+ * replies to earlier ones are back, so the TV reads the next frame while
+ * it works on this one. It answers in order, so each line that comes
+ * back belongs to the oldest frame in flight. An ERR to a frame that
+ * went out behind others halves the window (the TV may have been
+ * overrun), and a lost or garbled reply closes it to 1; window replies
+ * in a row without either open it by one again, up to the setting. Frames that
+ * get no reply (CHUP, CHDW), and the first frame after a resync, only go
+ * out on their own, as does everything on a degraded link.
+ */
+int
+enginecansend(void)
+{
+	struct job *job = engine.head;
+
+	if (job == NULL) return(0);
+	if (engine.inflight == 0) return(1);
+
+	return(engine.inflight < (health.level > 0 ? 1 : engine.window) &&
+	       !stale && !noreply(job->frame));
+}
+
+/* When the oldest frame in flight times out: its turn starts at the
+   previous reply, as the TV doesn't get to it before then. */
+long long
+jobdeadline(
+	struct job *job
+)
+{
+	return((job->sent > engine.since ? job->sent : engine.since) +
+	       job->timeout * 1000000LL);
+}
+
+void
+enginerun(
+	int revents
+)
+{
+	struct job *job;
+	long long  now;
+	int        len;
+
+	if (engine.first != NULL) {
+		if (revents & POLLIN) {
+			len = read(fd, engine.reply + engine.replylen,
+				sizeof(engine.reply) - engine.replylen - 1);
+			if (len > 0) engine.replylen += len;
+		}
+		enginereplies();
+	}
+	else if (revents & POLLIN) {
+		/* Nothing is waiting for it (a reply after its timeout, or
+		   noise): drop it, or poll() would keep returning at once. */
+		while (read(fd, engine.reply, sizeof(engine.reply)) > 0)
+			;
+		engine.replylen = 0;
+	}
+
+	while (enginecansend() && (now = monotime()) >= engine.ready) {
+		job = engine.head;
+		if ((engine.head = job->next) == NULL) engine.tail = NULL;
+		engine.queued--;
+
+		if (verbose == 1) {
+			logmsg("command='%.4s', parameter='%.4s' (queued %.1f ms)",
+				job->frame, job->frame + 4, (now - job->queued) / 1e6);
+		}
+
+		if (nosend == 1) {
+			engine.frames++;
+			addtiming(&engine.wire, now - job->queued);
+			job->done(job, RESP_OK, "OK");
+			continue;
+		}
+
+		loadhealth();
+		job->resync = stale;
+		if (stale) {
+			tcflush(fd, TCIFLUSH);
+			stale = 0;
+		}
+		if (engine.inflight == 0) engine.replylen = 0;
+
+		job->frame[8] = '\r';
+		job->timeout = replytimeout(job->frame);
+		job->sent = monotime();
+		write(fd, job->frame, 9);
+		job->frame[8] = '\0';
+		addtiming(&engine.wire, job->sent - job->queued);
+
+		if (noreply(job->frame)) {
+			lastframe = monotime();
+			engine.frames++;
+			job->done(job, RESP_OK, "sent");
+			continue;
+		}
+
+		job->piped = (engine.inflight > 0);
+		job->next = NULL;
+		if (engine.last != NULL) engine.last->next = job;
+		else engine.first = job;
+		engine.last = job;
+		engine.inflight++;
+	}
+
+	slosettled();
+}
+
+/* Settle the frames in flight that have their reply, or have timed out. */
+void
+enginereplies(void)
+{
+	struct job *job;
+	long long  start;
+	char       *cr;
+	int        len, resp, got;
+
+	while ((job = engine.first) != NULL) {
+		/* Skip the LF of a CR LF, or line noise between replies. */
+		len = strspn(engine.reply, "\r\n");
+		memmove(engine.reply, engine.reply + len, engine.replylen - len);
+		engine.replylen -= len;
+		engine.reply[engine.replylen] = '\0';
+
+		cr = strpbrk(engine.reply, "\r\n");
+		got = (cr != NULL || engine.replylen == sizeof(engine.reply) - 1);
+		if (!got && monotime() < jobdeadline(job)) return;
+
+		if (cr != NULL) *cr = '\0';
+		start = job->sent > engine.since ? job->sent : engine.since;
+		resp = settlereply(job->frame, job->frame + 4, engine.reply, start,
+			job->timeout, 1, job->resync, got);
+		if ((engine.first = job->next) == NULL) engine.last = NULL;
+		engine.inflight--;
+		engine.since = lastframe;
+		engine.frames++;
+		if (got) addtiming(&engine.turn, lastframe - start);
+		if (resp == RESP_ERR) engine.errors++;
+		if (resp == RESP_NONE) engine.timeouts++;
+		engine.ready = lastframe + health.level * cfg.health_gap * 1000000LL;
+		enginewindow(resp, job->piped);
+		/* Set aside before done(), which may free job. */
+		if (engine.nsettled == WINDOW_MAX) slosettled();
+		memcpy(engine.settled[engine.nsettled].code, job->frame, 4);
+		engine.settled[engine.nsettled++].ns = lastframe - start;
+		job->done(job, resp, resp == RESP_NONE ? "" : engine.reply);
+
+		len = (cr != NULL) ? cr - engine.reply + 1 : engine.replylen;
+		memmove(engine.reply, engine.reply + len, engine.replylen - len);
+		engine.replylen -= len;
+
+		if (stale) {
+			/* Lost or garbled: what comes back can't be matched to
+			   the frames still out, so they fail too. */
+			while ((job = engine.first) != NULL) {
+				if ((engine.first = job->next) == NULL) engine.last = NULL;
+				engine.inflight--;
+				engine.frames++;
+				engine.timeouts++;
+				job->done(job, RESP_NONE, "");
+			}
+			engine.replylen = 0;
+		}
+	}
+}
+
+/*
+ * Run the engine on its own, outside serve's loop, until no more than
+ * n jobs are waiting or in flight.
+ */
+void
+enginedrain(
+	int n
+)
+{
+	struct pollfd pfd;
+	int           wait;
+
+	while (engine.queued + engine.inflight > n) {
+		wait = enginepoll(&pfd);
+		if (poll(&pfd, 1, wait) < 0 && errno != EINTR) break;
+		enginerun(pfd.revents);
+	}
+}
+
+/* Open or close the window on a frame's result. */
+void
+enginewindow(
+	int resp,
+	int piped
+)
+{
+	int window = engine.window;
+
+	if (stale) {
+		engine.window = 1;
+	}
+	else if (resp == RESP_ERR && piped) {
+		engine.window = (engine.window + 1) / 2;
+	}
+	else if (++engine.oks >= engine.window && engine.window < cfg.window) {
+		engine.window++;
+	}
+
+	if (engine.window != window) {
+		engine.oks = 0;
+		if (verbose == 1) {
+			logmsg("window %d -> %d after %.8s", window, engine.window,
+				resp == RESP_ERR ? "ERR" : stale ? "timeout" : "OKs");
+		}
+	}
+	else if ((resp == RESP_ERR && piped) || stale) {
+		engine.oks = 0;
+	}
+}
+
+/*
+ * Count a reply time (a timeout at its deadline) towards its opcode's
+ * window and shift detector. It costs a lookup and a few additions;
+ * judging windows and reporting are left to slotick(), between turns of
+ * the loop.
+ */
+void
+slorecord(
+	char      *frame,
+	long long ns
+)
+{
+	struct slocode *c;
+	double         d, z;
+	int            i, b;
+
+	for (i = 0; i < slo.ncodes && memcmp(slo.codes[i].code, frame, 4) != 0;
+	     i++)
+		;
+	if (i == slo.ncodes) {
+		if (i == SLO_CODES) {
+			slo.untracked++;
+			return;
+		}
+		memcpy(slo.codes[slo.ncodes++].code, frame, 4);
+	}
+	c = &slo.codes[i];
+
+	b = latencybucket(ns);
+	c->slice[slo.slice][b]++;
+	c->sum[b]++;
+	c->total++;
+
+	if (c->seen++ == 0) {
+		c->mean = b;
+		c->dev = c->up = c->down = 0;
+		return;
+	}
+	d = b - c->mean;
+	if (c->seen <= SLO_WARMUP) {
+		c->mean += d / c->seen;
+		c->dev += ((d < 0 ? -d : d) - c->dev) / c->seen;
+		return;
+	}
+
+	z = d / (c->dev > 1 ? c->dev : 1);
+	if (z > SLO_CLIP) z = SLO_CLIP;
+	if (z < -SLO_CLIP) z = -SLO_CLIP;
+	if ((c->up += z - SLO_SLACK) <= 0) {
+		c->up = c->upsum = c->uplen = 0;
+	}
+	else {
+		c->upsum += b;
+		c->uplen++;
+	}
+	if ((c->down -= z + SLO_SLACK) <= 0) {
+		c->down = c->downsum = c->downlen = 0;
+	}
+	else {
+		c->downsum += b;
+		c->downlen++;
+	}
+
+	/* The new level is taken from the run that set it off. */
+	if (c->up > SLO_SHIFT || c->down > SLO_SHIFT) {
+		c->shifted = c->up > SLO_SHIFT ? 1 : -1;
+		c->from = c->mean;
+		c->to = c->up > SLO_SHIFT ? c->upsum / c->uplen :
+		                            c->downsum / c->downlen;
+		c->seen = 0; /* learn it as the baseline */
+		slo.flagged = 1;
+	}
+	else if (c->up == 0 && c->down == 0) {
+		c->mean += SLO_ALPHA * d;
+		c->dev += SLO_ALPHA * ((d < 0 ? -d : d) - c->dev);
+	}
+}
+
+/*
+ * Count the replies enginereplies() set aside. enginerun() calls this
+ * once the frames those replies made room for are written, so counting
+ * never holds up the port.
+ */
+void
+slosettled(void)
+{
+	int i;
+
+	for (i = 0; i < engine.nsettled; i++)
+		slorecord(engine.settled[i].code, engine.settled[i].ns);
+	engine.nsettled = 0;
+}
+
+/*
+ * Report shifts slorecord() flagged and, once a slice is over, judge
+ * each opcode's window against the slo lines that cover it, then drop
+ * its oldest slice. A window's percentile is only known to within its
+ * bucket, so it is in breach once the bucket's lower edge reaches the
+ * target, and back once the upper edge is under it again.
+ */
+void
+slotick(
+	long long now
+)
+{
+	struct slocode   *c;
+	struct slotarget *t;
+	long long        limit, len = cfg.slo_window / SLO_SLICES * 1000000LL;
+	int              i, j, b, next;
+
+	if (slo.flagged) {
+		slo.flagged = 0;
+		for (i = 0; i < slo.ncodes; i++) {
+			c = &slo.codes[i];
+			if (c->shifted == 0) continue;
+			sloalert("shift %.4s %s: ~%.1f ms -> ~%.1f ms", c->code,
+				c->shifted > 0 ? "up" : "down",
+				bucketlimit((int) (c->from + 0.5)) / 1e6,
+				bucketlimit((int) (c->to + 0.5)) / 1e6);
+			c->shifted = 0;
+		}
+	}
+
+	if (now < slo.rotate) return;
+
+	for (i = 0; i < slo.ncodes; i++) {
+		c = &slo.codes[i];
+		for (j = 0; j < cfg.nslo && c->total >= SLO_MIN; j++) {
+			t = &cfg.slo[j];
+			if (strcmp(t->code, "*") != 0 && memcmp(t->code, c->code, 4) != 0)
+				continue;
+			b = bucketpercentile(c->sum, c->total, t->percentile);
+			limit = t->ms * 1000000LL;
+			if (!c->over[j] && b > 0 && bucketlimit(b - 1) >= limit) {
+				c->over[j] = 1;
+				sloalert("slo %.4s p%g over %d ms: %.1f - %.1f ms "
+					"(%u replies in %d s)", c->code, t->percentile, t->ms,
+					bucketlimit(b - 1) / 1e6, bucketlimit(b) / 1e6,
+					c->total, cfg.slo_window / 1000);
+			}
+			else if (c->over[j] && bucketlimit(b) <= limit) {
+				c->over[j] = 0;
+				sloalert("slo %.4s p%g back under %d ms: <%.1f ms "
+					"(%u replies in %d s)", c->code, t->percentile, t->ms,
+					bucketlimit(b) / 1e6, c->total, cfg.slo_window / 1000);
+			}
+		}
+	}
+
+	next = (slo.slice + 1) % SLO_SLICES;
+	for (i = 0; i < slo.ncodes; i++) {
+		c = &slo.codes[i];
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			c->sum[b] -= c->slice[next][b];
+			c->total -= c->slice[next][b];
+		}
+		memset(c->slice[next], 0, sizeof(c->slice[next]));
+	}
+	slo.slice = next;
+	slo.rotate = (slo.rotate + len > now) ? slo.rotate + len : now + len;
+}
+
+/* An alert: to the log, and to each admin client watching. */
+void
+sloalert(
+	const char *fmt,
+	...
+)
+{
+	va_list   ap;
+	char      text[256], line[320], when[32];
+	time_t    now = time(NULL);
+	int       i, len;
+
+	va_start(ap, fmt);
+	vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	slo.alerts++;
+	logmsg("%s", text);
+
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	len = snprintf(line, sizeof(line), "%s %s %s\n", when, portname, text);
+	for (i = 0; i < nwatchers; i++) {
+		/* One that has gone, or stopped reading, is dropped. */
+		if (write(watchers[i], line, len) != len) {
+			close(watchers[i]);
+			watchers[i--] = watchers[--nwatchers];
+		}
+	}
+}
+
+/* Each opcode's window and baseline, and its slo lines, to sock. */
+void
+sloreport(
+	int sock
+)
+{
+	struct slocode   *c;
+	struct slotarget *t;
+	char             line[512];
+	int              i, j, len;
+
+	len = snprintf(line, sizeof(line), "%-6s %7s %9s %9s %9s  %s\n",
+		"opcode", "replies", "p50 ms", "p99 ms", "usual ms", "slo");
+	write(sock, line, len);
+	for (i = 0; i < slo.ncodes; i++) {
+		c = &slo.codes[i];
+		len = snprintf(line, sizeof(line), "%-6.4s %7u %9.1f %9.1f %9.1f ",
+			c->code, c->total,
+			c->total ? bucketlimit(bucketpercentile(c->sum, c->total, 50)) / 1e6 : 0,
+			c->total ? bucketlimit(bucketpercentile(c->sum, c->total, 99)) / 1e6 : 0,
+			bucketlimit((int) (c->mean + 0.5)) / 1e6);
+		for (j = 0; j < cfg.nslo; j++) {
+			t = &cfg.slo[j];
+			if (strcmp(t->code, "*") != 0 && memcmp(t->code, c->code, 4) != 0)
+				continue;
+			len += snprintf(line + len, sizeof(line) - len, " p%g<%d %s",
+				t->percentile, t->ms, c->total < SLO_MIN ? "(too few)" :
+				c->over[j] ? "BREACH" : "ok");
+		}
+		if (len > sizeof(line) - 2) len = sizeof(line) - 2;
+		line[len++] = '\n';
+		write(sock, line, len);
+	}
+	len = snprintf(line, sizeof(line), "window %d s; %lu alerts; "
+		"%lu replies to opcodes past the first %d\n", cfg.slo_window / 1000,
+		slo.alerts, slo.untracked, SLO_CODES);
+	write(sock, line, len);
+}
+
+/*
+ * Long-running mode: hold the port and take commands from the front
+ * ends given, sharing one poll loop with the port.
+ */
+int
+serve(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	struct pollfd pfds[6 + HTTP_CLIENTS + ADMIN_WATCHERS];
+	char          *http = cfg.http_listen,
+	              *broker = cfg.mqtt_server,
+	              admin[PATH_MAX];
+	int           i, n, w, wait, mqttwait, slowait, adminwait;
+
+	/* Front ends named here replace those from the config file. */
+	if (argc > 0) {
+		http = broker = "";
+		frontends_fixed = 1;
+	}
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--http") == 0 && i + 1 < argc) {
+			http = argv[++i];
+		}
+		else if (strcmp(argv[i], "--mqtt") == 0 && i + 1 < argc) {
+			broker = argv[++i];
+		}
+		else {
+			fprintf(stderr, "%s: serve [ --http [addr:]port ] "
+				"[ --mqtt host[:port] ]\n", progname);
+			return(EXIT_FAILURE);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stopserving);
+	signal(SIGTERM, stopserving);
+	signal(SIGHUP, wantreload);
+	if (nosend == 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		loadhealth();
+	}
+	engine.ready = monotime();
+	engine.window = cfg.window;
+	slo.rotate = engine.ready + cfg.slo_window / SLO_SLICES * 1000000LL;
+
+	if (strcmp(http, "") != 0 &&
+	    (httpfd = httplisten(progname, http)) == -1) {
+		return(EXIT_FAILURE);
+	}
+	mqtt.fd = -1;
+	if (strcmp(broker, "") != 0 && mqttstart(broker) == -1) {
+		return(EXIT_FAILURE);
+	}
+	adminpath(admin, sizeof(admin));
+	if ((adminfd = adminlisten(admin)) == -1 ||
+	    pipe2(reloadpipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, admin, strerror(errno));
+		return(EXIT_FAILURE);
+	}
+	if (verbose == 1) {
+		logmsg("serving %s: http on %s, mqtt to %s, admin on %s", portname,
+			*http ? http : "-", *broker ? broker : "-", admin);
+	}
+
+	/* Until a signal; returning saves latency and health at exit. */
+	while (!serving_stopped) {
+		if (reload_wanted && !reloading) {
+			reload_wanted = 0;
+			reloadstart();
+		}
+
+		wait = enginepoll(&pfds[0]);
+		pfds[1].fd = httpfd;
+		pfds[1].events = nhttp < HTTP_CLIENTS ? POLLIN : 0;
+		pfds[2].fd = -1;
+		if (strcmp(broker, "") != 0 &&
+		    (mqttwait = mqttpoll(&pfds[2])) != -1 &&
+		    (wait == -1 || mqttwait < wait)) {
+			wait = mqttwait;
+		}
+		if ((slowait = (slo.rotate - monotime() + 999999) / 1000000) < 0)
+			slowait = 0;
+		if (wait == -1 || slowait < wait) wait = slowait;
+		if (admindue != 0) {
+			if ((adminwait = (admindue - monotime() + 999999) / 1000000) < 0)
+				adminwait = 0;
+			if (wait == -1 || adminwait < wait) wait = adminwait;
+		}
+		pfds[3].fd = adminfd;
+		pfds[3].events = adminclient == -1 ? POLLIN : 0;
+		pfds[4].fd = adminclient;
+		pfds[4].events = reloading ? 0 : POLLIN;
+		pfds[5].fd = reloadpipe[0];
+		pfds[5].events = POLLIN;
+		w = 6 + httppoll(pfds + 6);
+		n = w + adminwatchpoll(pfds + w);
+
+		if (poll(pfds, n, wait) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+			return(EXIT_FAILURE);
+		}
+
+		enginerun(pfds[0].revents);
+		adminwatch(pfds + w);
+		slotick(monotime());
+		if (pfds[5].revents & POLLIN) reloadapply(progname);
+		if (pfds[3].revents & POLLIN) adminrun(1);
+		if (pfds[4].revents != 0 ||
+		    (admindue != 0 && monotime() >= admindue)) {
+			adminrun(0);
+		}
+		if (pfds[1].revents & POLLIN) httpaccept();
+		httprun(pfds + 6);
+		if (strcmp(broker, "") != 0) {
+			mqttrun(pfds[2].revents);
+			mqttflush();
+		}
+	}
+	unlink(admin);
+
+	return(EXIT_SUCCESS);
+}
+
+void
+stopserving(
+	int sig
+)
+{
+	serving_stopped = 1;
+}
+
+void
+wantreload(
+	int sig
+)
+{
+	reload_wanted = 1;
+}
+
+/*
+ * Read the config file again without holding up the port: the file is
+ * parsed from the defaults on a thread of its own, and reloadapply()
+ * swaps it in between two turns of the serve loop.
+ */
+void
+reloadstart(void)
+{
+	struct reload *r;
+	pthread_t     thread;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL) return;
+	r->cfg = cfgdefaults;
+	snprintf(r->path, sizeof(r->path), "%s", statepath(CONFIG_FILE));
+	r->started = monotime();
+	reloading = 1;
+
+	if (pthread_create(&thread, NULL, reloadthread, r) != 0) {
+		reloadthread(r);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+void *
+reloadthread(
+	void *arg
+)
+{
+	struct reload *r = arg;
+
+	r->errors = parseconfig(r->path, &r->cfg, r->error, sizeof(r->error));
+	r->parsed = monotime();
+
+	/* Everything in r is written before the pointer is seen. */
+	atomic_store_explicit(&reloaded, r, memory_order_release);
+	write(reloadpipe[1], "", 1);
+
+	return(NULL);
+}
+
+/*
+ * Swap in a reloaded config. This runs on the serve loop, which is the
+ * only reader of cfg, so no frame or request ever sees half of each. A
+ * file with bad lines is refused as a whole. The port stays open and
+ * queued and in-flight frames are untouched; the listener and the MQTT
+ * connection are only reopened if their settings changed. Settings read
+ * only at startup (lock, broker, log, realtime) keep their values.
+ */
+void
+reloadapply(
+	char *progname
+)
+{
+	struct reload *r;
+	struct config old = cfg;
+	char          result[512], changed[384] = "", buffer[64], *slash,
+	              server[sizeof(mqtt.server)];
+	long long     start = monotime();
+	int           i, len = 0, sock;
+
+	while (read(reloadpipe[0], buffer, sizeof(buffer)) > 0)
+		;
+	r = atomic_exchange_explicit(&reloaded, NULL, memory_order_acquire);
+	if (r == NULL) return;
+	reloading = 0;
+
+	if (r->errors > 0) {
+		snprintf(result, sizeof(result), "refused: %s (%d bad line%s)",
+			r->error, r->errors, r->errors == 1 ? "" : "s");
+		adminreply(result);
+		free(r);
+		return;
+	}
+
+	r->cfg.lock_timeout = old.lock_timeout;
+	r->cfg.realtime_priority = old.realtime_priority;
+	memcpy(r->cfg.lock_dir, old.lock_dir, sizeof(old.lock_dir));
+	memcpy(r->cfg.broker_socket, old.broker_socket, sizeof(old.broker_socket));
+	memcpy(r->cfg.log, old.log, sizeof(old.log));
+	memcpy(r->cfg.admin_socket, old.admin_socket, sizeof(old.admin_socket));
+	if (strcmp(r->cfg.mqtt_name, "") == 0 &&  /* as mqttstart() named it */
+	    strcmp(old.mqtt_name, "") != 0) {
+		slash = strrchr(portname, '/');
+		snprintf(r->cfg.mqtt_name, sizeof(r->cfg.mqtt_name), "%.*s",
+			(int) sizeof(r->cfg.mqtt_name) - 1,
+			slash != NULL ? slash + 1 : portname); /* cut to fit */
+	}
+	if (frontends_fixed) {
+		memcpy(r->cfg.http_listen, old.http_listen, sizeof(old.http_listen));
+		memcpy(r->cfg.mqtt_server, old.mqtt_server, sizeof(old.mqtt_server));
+	}
+	cfg = r->cfg;
+
+	if (strcmp(cfg.http_listen, old.http_listen) != 0) {
+		sock = strcmp(cfg.http_listen, "") != 0 ?
+		       httplisten(progname, cfg.http_listen) : -1;
+		if (sock == -1 && strcmp(cfg.http_listen, "") != 0) {
+			memcpy(cfg.http_listen, old.http_listen, sizeof(old.http_listen));
+		}
+		else {
+			if (httpfd != -1) {
+				httpaccept();  /* take what's queued on the old one */
+				close(httpfd);
+			}
+			httpfd = sock;
+		}
+	}
+	if (httpfd != -1 && !httploopback(&httpbound) &&
+	    strcmp(cfg.http_token, "") == 0) {  /* as httplisten() insists */
+		memcpy(cfg.http_token, old.http_token, sizeof(old.http_token));
+		fprintf(stderr, "%s: http off loopback needs an http-token; "
+			"kept it\n", progname);
+	}
+	if (strcmp(cfg.mqtt_server, old.mqtt_server) != 0 ||
+	    strcmp(cfg.mqtt_prefix, old.mqtt_prefix) != 0 ||
+	    strcmp(cfg.mqtt_name, old.mqtt_name) != 0) {
+		snprintf(server, sizeof(server), "%s",
+			frontends_fixed ? mqtt.server : cfg.mqtt_server);
+		if (mqtt.fd != -1) mqttdrop();
+		mqtt.fd = -1;
+		if (strcmp(server, "") != 0 && mqttstart(server) == -1) {
+			memcpy(cfg.mqtt_server, old.mqtt_server, sizeof(old.mqtt_server));
+			memcpy(cfg.mqtt_prefix, old.mqtt_prefix, sizeof(old.mqtt_prefix));
+			memcpy(cfg.mqtt_name, old.mqtt_name, sizeof(old.mqtt_name));
+			fprintf(stderr, "%s: kept mqtt-server %s\n", progname,
+				cfg.mqtt_server);
+		}
+	}
+	if (engine.window > cfg.window) engine.window = cfg.window;
+	if (memcmp(cfg.slo, old.slo, sizeof(cfg.slo)) != 0) {
+		for (i = 0; i < slo.ncodes; i++)  /* judged afresh */
+			memset(slo.codes[i].over, 0, sizeof(slo.codes[i].over));
+	}
+
+	for (i = 0; i < sizeof(cfgkeys) / sizeof(cfgkeys[0]); i++) {
+		if (memcmp((char *) &cfg + cfgkeys[i].offset,
+		           (char *) &old + cfgkeys[i].offset, cfgkeys[i].size) != 0 &&
+		    len < sizeof(changed)) {
+			len += snprintf(changed + len, sizeof(changed) - len, "%s%s",
+				len > 0 ? " " : "", cfgkeys[i].key);
+		}
+	}
+
+	snprintf(result, sizeof(result), "ok: read in %.2f ms, swapped in "
+		"%.1f us with %d queued and %d in flight; changed: %s",
+		(r->parsed - r->started) / 1e6, (monotime() - start) / 1e3,
+		engine.queued, engine.inflight, len > 0 ? changed : "nothing");
+	adminreply(result);
+	free(r);
+}
+
+/* serve's admin socket: the admin-socket setting, or one per port in
+   the state directory. */
+void
+adminpath(
+	char   *path,
+	size_t size
+)
+{
+	char name[sizeof("admin.") + sizeof(portname)], *c;
+
+	if (strcmp(cfg.admin_socket, "") != 0) {
+		snprintf(path, size, "%s", cfg.admin_socket);
+		return;
+	}
+	snprintf(name, sizeof(name), "admin.%s", portname);
+	for (c = name; *c != '\0'; c++) {
+		if (*c == '/') *c = '_';
+	}
+	snprintf(path, size, "%s", statepath(name));
+}
+
+int
+adminlisten(
+	char *path
+)
+{
+	struct sockaddr_un addr;
+	int                sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path));
+	unlink(path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		return(-1);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(sock, 8) == -1) {
+		close(sock);
+		return(-1);
+	}
+
+	return(sock);
+}
+
+/*
+ * Accept an admin client (one at a time), or read its command: "reload"
+ * is answered with one line once it's done, "slo" with sloreport(), and
+ * "watch" keeps the connection to send it alerts (see sloalert()). A
+ * client that hasn't sent a whole line within ADMIN_READ ms is dropped,
+ * so one left idle can't keep the others out.
+ */
+void
+adminrun(
+	int listening
+)
+{
+	char buffer[64];
+	int  len;
+
+	if (listening) {
+		if ((adminclient = accept4(adminfd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+			admindue = monotime() + ADMIN_READ * 1000000LL;
+			adminlen = 0;
+		}
+		return;
+	}
+
+	len = read(adminclient, adminline + adminlen,
+	           sizeof(adminline) - 1 - adminlen);
+	if (len > 0) adminlen += len;
+	adminline[adminlen] = '\0';
+	if (len > 0 && strpbrk(adminline, "\r\n") == NULL &&
+	    adminlen < (int) sizeof(adminline) - 1) {
+		return;  /* more to come */
+	}
+	if (len == -1 && errno == EAGAIN && monotime() < admindue) return;
+	if (len <= 0 && (adminlen == 0 || len == -1)) {
+		close(adminclient);  /* gone, or out of time */
+		adminclient = -1;
+		admindue = 0;
+		return;
+	}
+	admindue = 0;
+	snprintf(buffer, sizeof(buffer), "%.*s", (int) strcspn(adminline, "\r\n"),
+		adminline);
+
+	if (strcmp(buffer, "reload") == 0) {
+		reload_wanted = 1;
+	}
+	else if (strcmp(buffer, "slo") == 0) {
+		sloreport(adminclient);
+		close(adminclient);
+		adminclient = -1;
+	}
+	else if (strcmp(buffer, "watch") == 0) {
+		if (nwatchers == ADMIN_WATCHERS) {
+			write(adminclient, "too many watching\n", 18);
+			close(adminclient);
+		}
+		else {
+			len = snprintf(buffer, sizeof(buffer), "watching %.50s\n",
+				portname);
+			write(adminclient, buffer, len);
+			watchers[nwatchers++] = adminclient;
+		}
+		adminclient = -1;
+	}
+	else {
+		adminreply("unknown command (try reload, slo or watch)");
+	}
+}
+
+/* Poll each watching admin client, to see it go. */
+int
+adminwatchpoll(
+	struct pollfd *pfds
+)
+{
+	int i;
+
+	for (i = 0; i < nwatchers; i++) {
+		pfds[i].fd = watchers[i];
+		pfds[i].events = POLLIN;
+	}
+
+	return(nwatchers);
+}
+
+/*
+ * Drop the watchers that hung up; anything one sends is ignored. Runs
+ * before anything else can drop one, so pfds still lines up.
+ */
+void
+adminwatch(
+	struct pollfd *pfds
+)
+{
+	char buffer[64];
+	int  i, len;
+
+	for (i = nwatchers - 1; i >= 0; i--) {
+		if (pfds[i].revents == 0) continue;
+		if (!(pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) &&
+		    ((len = read(watchers[i], buffer, sizeof(buffer))) > 0 ||
+		     (len == -1 && errno == EAGAIN))) {
+			continue;
+		}
+		close(watchers[i]);
+		watchers[i] = watchers[--nwatchers];
+	}
+}
+
+/* Report a reload to whoever asked: the admin client, or the log. */
+void
+adminreply(
+	char *result
+)
+{
+	char line[600];
+	int  len;
+
+	if (strncmp(result, "ok", 2) != 0) {
+		fprintf(stderr, "reload %s\n", result);
+	}
+	else if (verbose == 1) {
+		logmsg("reload %s", result);
+	}
+
+	if (adminclient != -1) {
+		len = snprintf(line, sizeof(line), "%s\n", result);
+		write(adminclient, line, len);
+		close(adminclient);
+		adminclient = -1;
+	}
+}
+
+/*
+ * Ask the serve running on port to reload its config file, and print
+ * what it says.
+ */
+int
+reload(
+	char *progname
+)
+{
+	char line[600];
+	int  sock, len = 0, n;
+
+	if ((sock = adminconnect(progname)) == -1) return(EXIT_FAILURE);
+	write(sock, "reload\n", 7);
+	while (len < sizeof(line) - 1 &&
+	       (n = read(sock, line + len, sizeof(line) - 1 - len)) > 0) {
+		len += n;
+	}
+	close(sock);
+	line[len] = '\0';
+	printf("%s", line);
+
+	return(strncmp(line, "ok", 2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Connect to the admin socket of the serve on the port, or complain. */
+int
+adminconnect(
+	char *progname
+)
+{
+	struct sockaddr_un addr;
+	char               path[PATH_MAX];
+	int                sock;
+
+	adminpath(path, sizeof(path));
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path,
+			strerror(ENAMETOOLONG));
+		return(-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path));
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "%s: no serve on %s (%s: %s)\n", progname,
+			portname, path, strerror(errno));
+		if (sock != -1) close(sock);
+		return(-1);
+	}
+
+	return(sock);
+}
+
+/*
+ * Print the serve on the port's reply times against its slo lines, or
+ * with --watch, its alerts as they come until it or we stop.
+ */
+int
+slowatch(
+	char *progname,
+	int  argc,
+	char **argv
+)
+{
+	char buffer[4096];
+	int  sock, watch = 0, n;
+
+	if (argc == 1 && strcmp(argv[0], "--watch") == 0) {
+		watch = 1;
+	}
+	else if (argc > 0) {
+		fprintf(stderr, "%s: slo [ --watch ]\n", progname);
+		return(EXIT_FAILURE);
+	}
+
+	if ((sock = adminconnect(progname)) == -1) return(EXIT_FAILURE);
+	write(sock, watch ? "watch\n" : "slo\n", watch ? 6 : 4);
+	while ((n = read(sock, buffer, sizeof(buffer))) > 0) {
+		write(STDOUT_FILENO, buffer, n);
+	}
+	close(sock);
+
+	return(EXIT_SUCCESS);
+}
+
+/* Parse "[addr:]port" (addr defaults to loopback). Returns 0 if good. */
+int
+httpaddr(
+	char               *string,
+	struct sockaddr_in *addr
+)
+{
+	char host[64] = "127.0.0.1", *colon;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	if ((colon = strrchr(string, ':')) != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int) (colon - string), string);
+		addr->sin_port = htons(atoi(colon + 1));
+	}
+	else {
+		addr->sin_port = htons(atoi(string));
+	}
+
+	return(inet_pton(AF_INET, host, &addr->sin_addr) == 1 &&
+	       addr->sin_port != 0 ? 0 : -1);
+}
+
+int
+httplisten(
+	char *progname,
+	char *listen_on
+)
+{
+	struct sockaddr_in addr;
+	int                sock, on = 1;
+
+	if (httpaddr(listen_on, &addr) == -1) {
+		fprintf(stderr, "%s: bad http address '%s'\n", progname, listen_on);
+		return(-1);
+	}
+	/* Beyond this host anyone could send commands: not without a token. */
+	if (!httploopback(&addr) && strcmp(cfg.http_token, "") == 0) {
+		fprintf(stderr, "%s: http on %s needs an http-token\n", progname,
+			listen_on);
+		return(-1);
+	}
+
+	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1 ||
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(sock, 128) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, listen_on, strerror(errno));
+		return(-1);
+	}
+	httpbound = addr;
+
+	return(sock);
+}
+
+int
+httploopback(
+	struct sockaddr_in *addr
+)
+{
+	return((ntohl(addr->sin_addr.s_addr) >> 24) == 127);
+}
+
+/*
+ * Whether a request's Host names the address serve listens on, so a
+ * page from elsewhere can't reach it by rebinding its own name to ours.
+ * On a wildcard address (which needs a token) any name will do.
+ */
+int
+httphost(
+	char *host
+)
+{
+	struct in_addr named;
+	char           name[64], *colon;
+	int            port = 80;
+
+	if (httpbound.sin_addr.s_addr == htonl(INADDR_ANY)) return(1);
+
+	snprintf(name, sizeof(name), "%s", host);
+	if ((colon = strrchr(name, ':')) != NULL) {
+		*colon = '\0';
+		port = atoi(colon + 1);
+	}
+	if (htons(port) != httpbound.sin_port) return(0);
+	if (strcasecmp(name, "localhost") == 0) return(httploopback(&httpbound));
+
+	return(inet_pton(AF_INET, name, &named) == 1 &&
+	       named.s_addr == httpbound.sin_addr.s_addr);
+}
+
+/* A blocking connection to "[addr:]port", or -1. */
+int
+httpconnect(
+	char *string
+)
+{
+	struct sockaddr_in addr;
+	int                sock, on = 1;
+
+	if (httpaddr(string, &addr) == -1 ||
+	    (sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return(-1);
+	}
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(sock);
+		return(-1);
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return(sock);
+}
+
+void
+httpaccept(void)
+{
+	struct httpconn *c;
+	int             sock, on = 1;
+
+	while (nhttp < HTTP_CLIENTS &&
+	       (sock = accept4(httpfd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+		if ((c = calloc(1, sizeof(*c))) == NULL) {
+			close(sock);
+			return;
+		}
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		c->fd = sock;
+		httpconns[nhttp++] = c;
+	}
+}
+
+/* Fill in a pollfd per connection; returns how many. */
+int
+httppoll(
+	struct pollfd *pfds
+)
+{
+	struct httpconn *c;
+	int             i;
+
+	for (i = 0; i < nhttp; i++) {
+		c = httpconns[i];
+		pfds[i].fd = c->fd;
+		pfds[i].events = 0;
+		pfds[i].revents = 0;
+		/* Stop reading while the pipeline is full. */
+		if (!c->closing && c->nreq < HTTP_PIPELINE) pfds[i].events |= POLLIN;
+		/* Answers ready to go out: get straight back to them. */
+		if (c->outlen > 0 || (c->head != NULL && c->head->done))
+			pfds[i].events |= POLLOUT;
+	}
+
+	return(nhttp);
+}
+
+/*
+ * Read, parse and answer on every connection. Runs on each pass of the
+ * loop, since replies from the port complete requests at any time.
+ */
+void
+httprun(
+	struct pollfd *pfds
+)
+{
+	struct httpconn *c;
+	int             i, len, gone;
+
+	for (i = nhttp - 1; i >= 0; i--) {
+		c = httpconns[i];
+		gone = 0;
+
+		if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+			len = read(c->fd, c->in + c->inlen,
+				sizeof(c->in) - 1 - c->inlen);
+			if (len > 0) c->inlen += len;
+			else if (len == 0 || errno != EAGAIN) gone = 1;
+		}
+
+		if (!gone) {
+			httpparse(c);
+			gone = (httpflush(c) == -1);
+			if (c->closing && c->head == NULL && c->outlen == 0) gone = 1;
+		}
+
+		if (gone) {
+			httpclose(c);
+			httpconns[i] = httpconns[--nhttp];
+		}
+	}
+}
+
+/* Take complete requests off the front of c->in. */
+void
+httpparse(
+	struct httpconn *c
+)
+{
+	struct httpreq *req;
+	char           *end, *line, *next, *p, host[64];
+	int            headlen, bodylen, minor, keepalive, hashost, custom, bearer;
+
+	while (!c->closing && c->nreq < HTTP_PIPELINE) {
+		c->in[c->inlen] = '\0';
+		if ((end = strstr(c->in, "\r\n\r\n")) == NULL) {
+			if (c->inlen == sizeof(c->in) - 1) {
+				httpanswer(c, 431, "{\"error\": \"request too large\"}");
+				c->closing = 1;
+			}
+			return;
+		}
+		headlen = end + 4 - c->in;
+		*end = '\0';
+
+		/* Headers this server cares about. */
+		bodylen = 0;
+		keepalive = -1;
+		hashost = custom = bearer = 0;
+		for (line = strstr(c->in, "\r\n"); line != NULL; line = next) {
+			line += 2;
+			next = strstr(line, "\r\n");
+			if (next != NULL) *next = '\0';
+			if (strncasecmp(line, "Content-Length:", 15) == 0) {
+				bodylen = atoi(line + 15);
+			}
+			else if (strncasecmp(line, "Connection:", 11) == 0) {
+				for (p = line + 11; *p == ' '; p++)
+					;
+				if (strncasecmp(p, "close", 5) == 0) keepalive = 0;
+				else if (strncasecmp(p, "keep-alive", 10) == 0) keepalive = 1;
+			}
+			else if (strncasecmp(line, "Host:", 5) == 0) {
+				for (p = line + 5; *p == ' '; p++)
+					;
+				snprintf(host, sizeof(host), "%s", p);
+				hashost = 1;
+			}
+			else if (strncasecmp(line, "X-Aquosctl:", 11) == 0) {
+				custom = 1;
+			}
+			else if (strncasecmp(line, "Authorization:", 14) == 0) {
+				for (p = line + 14; *p == ' '; p++)
+					;
+				bearer = strcmp(cfg.http_token, "") != 0 &&
+				         strncasecmp(p, "Bearer ", 7) == 0 &&
+				         strcmp(p + 7, cfg.http_token) == 0;
+			}
+			if (next != NULL) *next = '\r';
+		}
+		if (bodylen < 0 || headlen + bodylen > sizeof(c->in) - 1) {
+			httpanswer(c, 413, "{\"error\": \"body too large\"}");
+			c->closing = 1;
+			return;
+		}
+		if (c->inlen < headlen + bodylen) {
+			*end = '\r';
+			return; /* body still coming */
+		}
+
+		if ((req = calloc(1, sizeof(*req))) == NULL) {
+			c->closing = 1;
+			return;
+		}
+		req->conn = c;
+		if (c->tail != NULL) c->tail->next = req;
+		else c->head = req;
+		c->tail = req;
+		c->nreq++;
+
+		/* "METHOD /target HTTP/1.x"; 1.0 closes unless asked not to. */
+		if ((p = strstr(c->in, "\r\n")) != NULL) *p = '\0';
+		if (sscanf(c->in, "%7s %255s HTTP/1.%d", req->method, req->target,
+		           &minor) != 3) {
+			httpfinish(req, 400, "{\"error\": \"bad request line\"}");
+			req->close = 1;
+			c->closing = 1;
+		}
+		else {
+			if (keepalive == 0 || (minor == 0 && keepalive != 1)) {
+				req->close = 1;
+				c->closing = 1;
+			}
+			req->http10 = (minor == 0);
+			req->hostok = hashost ? httphost(host) : req->http10;
+			req->allowed = strcmp(cfg.http_token, "") != 0 ? bearer : custom;
+			httpdispatch(req);
+		}
+
+		memmove(c->in, c->in + headlen + bodylen,
+			c->inlen - headlen - bodylen);
+		c->inlen -= headlen + bodylen;
+	}
+}
+
+/*
+ * Route a request:
+ *   GET /status                  gateway and link state
+ *   GET /commands                the command table
+ *   GET /query/CODE              TV state, e.g. /query/VOLM
+ *   POST /command[/arg[/arg2]]   as on the command line
+ * A command also needs the http-token as a bearer token, or without one
+ * an X-Aquosctl header: a browser can't add either to a page's request
+ * for another site without asking us first, and we never agree.
+ */
+void
+httpdispatch(
+	struct httpreq *req
+)
+{
+	char         part[3][16] = { "", "", "" }, *p, *q;
+	int          nparts = 0, opcode, n, i;
+
+	if ((p = strchr(req->target, '?')) != NULL) *p = '\0';
+
+	/* Split and %-decode up to three path segments. */
+	for (p = req->target; *p == '/' && nparts < 3; nparts++) {
+		for (p++, q = part[nparts];
+		     *p != '\0' && *p != '/' && q < part[nparts] + 15; p++) {
+			if (*p == '%' && isxdigit(p[1]) && isxdigit(p[2])) {
+				sscanf(p + 1, "%2x", &i);
+				*q++ = (char) i;
+				p += 2;
+			}
+			else {
+				*q++ = *p;
+			}
+		}
+		*q = '\0';
+		if (*p != '\0' && *p != '/') { /* no word or number is this long */
+			httpfinish(req, 400, "{\"error\": \"argument too long\"}");
+			return;
+		}
+	}
+	if (*p != '\0' || nparts == 0) {
+		httpfinish(req, 404, "{\"error\": \"no such resource\"}");
+		return;
+	}
+
+	if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "POST") != 0) {
+		httpfinish(req, 405, "{\"error\": \"use GET or POST\"}");
+		return;
+	}
+	if (!req->hostok) {
+		httpfinish(req, 403, "{\"error\": \"wrong host\"}");
+		return;
+	}
+
+	if (strcmp(part[0], "status") == 0 && nparts == 1) {
+		httpstatus(req);
+		return;
+	}
+	if (strcmp(part[0], "commands") == 0 && nparts == 1) {
+		httpcommands(req);
+		return;
+	}
+	if (strcmp(part[0], "query") == 0 && nparts == 2) {
+		if (strlen(part[1]) != 4) {
+			httpfinish(req, 400, "{\"error\": \"need a 4 character code\"}");
+			return;
+		}
+		snprintf(req->name, sizeof(req->name), "%s", part[1]);
+		addframe(req->frames, &req->nframes, part[1], "?   ");
+		req->query = 1;
+	}
+	else {
+		opcode = checkcmd(part[0]);
+		if (opcode == CMD_NONE || opcode >= CMD_LEARN) {
+			httpfinish(req, 404, "{\"error\": \"no such command\"}");
+			return;
+		}
+		if (strcmp(req->method, "POST") != 0) {
+			httpfinish(req, 405, "{\"error\": \"use POST for commands\"}");
+			return;
+		}
+		if (!req->allowed) {
+			httpfinish(req, 403, strcmp(cfg.http_token, "") != 0 ?
+				"{\"error\": \"need the http-token\"}" :
+				"{\"error\": \"need an X-Aquosctl header\"}");
+			return;
+		}
+		snprintf(req->name, sizeof(req->name), "%s", part[0]);
+		if ((n = encodecommand("serve", opcode, part[0], part[1], part[2],
+		                       req->frames)) < 0) {
+			httpfinish(req, 400, "{\"error\": \"invalid argument\"}");
+			return;
+		}
+		req->nframes = n;
+	}
+
+	/* %-decoding can produce anything; a CR or LF in a frame would make
+	   it two, and the replies would no longer line up with the jobs. */
+	for (i = 0; i < req->nframes; i++) {
+		memcpy(req->jobs[i].frame, req->frames[i].command, 4);
+		memcpy(req->jobs[i].frame + 4, req->frames[i].param, 4);
+		req->jobs[i].frame[8] = '\0';
+		if (badframe(req->jobs[i].frame)) {
+			req->nframes = 0;
+			httpfinish(req, 400, "{\"error\": \"need printable characters\"}");
+			return;
+		}
+	}
+
+	/* Queued back to back, so a two-frame command isn't split. */
+	for (i = 0; i < req->nframes; i++) {
+		req->jobs[i].owner = req;
+		req->jobs[i].index = i;
+		req->jobs[i].done = httpdone;
+		submitjob(&req->jobs[i]);
+	}
+	req->pending = req->nframes;
+	requests++;
+}
+
+/* A frame of req came back from the port. */
+void
+httpdone(
+	struct job *job,
+	int        resp,
+	char       *reply
+)
+{
+	struct httpreq *req = job->owner;
+	char           body[HTTP_BODY], *result = "ok";
+	int            len, i, status = 200;
+
+	req->resp[job->index] = resp;
+	snprintf(req->reply[job->index], sizeof(req->reply[0]), "%s", reply);
+	req->ms[job->index] = (monotime() - job->queued) / 1e6;
+	if (!req->query) noteframe(&req->frames[job->index], resp);
+
+	if (--req->pending > 0) return;
+
+	if (req->conn == NULL) { /* the client went away */
+		free(req);
+		return;
+	}
+
+	for (i = 0; i < req->nframes; i++) {
+		if (req->resp[i] == RESP_NONE) {
+			result = "timeout";
+			status = 504;
+		}
+		else if (req->resp[i] != RESP_OK && status == 200 &&
+		         !(req->query && req->resp[i] == RESP_UNKNOWN)) {
+			result = "err";
+			status = 502;
+		}
+	}
+
+	len = snprintf(body, sizeof(body), "{\"%s\": \"%s\", \"result\": \"%s\", "
+		"\"frames\": [", req->query ? "query" : "command", req->name, result);
+	for (i = 0; i < req->nframes; i++) {
+		len += snprintf(body + len, sizeof(body) - len,
+			"%s{\"frame\": \"%.4s%.4s\", \"reply\": \"", i > 0 ? ", " : "",
+			req->frames[i].command, req->frames[i].param);
+		len += jsonescape(body + len, sizeof(body) - len, req->reply[i]);
+		len += snprintf(body + len, sizeof(body) - len, "\", \"ms\": %.1f}",
+			req->ms[i]);
+	}
+	snprintf(body + len, sizeof(body) - len, "]}");
+
+	httpfinish(req, status, body);
+}
+
+void
+httpstatus(
+	struct httpreq *req
+)
+{
+	char body[HTTP_BODY];
+
+	loadhealth();
+	snprintf(body, sizeof(body),
+		"{\"port\": \"%s\", \"nosend\": %s, \"queued\": %d, "
+		"\"busy\": %s, \"inflight\": %d, \"window\": %d, "
+		"\"frames\": %lu, \"errors\": %lu, "
+		"\"timeouts\": %lu, \"requests\": %lu, \"connections\": %d, "
+		"\"health\": {\"score\": %.1f, \"level\": %d}}",
+		portname, nosend == 1 ? "true" : "false", engine.queued,
+		engine.inflight > 0 ? "true" : "false", engine.inflight,
+		engine.window, engine.frames,
+		engine.errors, engine.timeouts, requests, nhttp,
+		health.score, health.level);
+
+	httpfinish(req, 200, body);
+}
+
+void
+httpcommands(
+	struct httpreq *req
+)
+{
+	char body[HTTP_BODY];
+	int  len, i;
+
+	len = snprintf(body, sizeof(body), "{\"protocol\": \"%s\", "
+		"\"commands\": [", CMD_TABLE_VERSION);
+	for (i = 0; i < sizeof(cmdtab) / sizeof(cmdtab[0]) &&
+	            len < sizeof(body) - 1; i++) {
+		if (cmdtab[i].opcode >= CMD_LEARN) continue;
+		len += snprintf(body + len, sizeof(body) - len,
+			"%s{\"name\": \"", len > 40 ? ", " : "");
+		len += jsonescape(body + len, sizeof(body) - len, cmdtab[i].cmd);
+		len += snprintf(body + len, sizeof(body) - len, "\", \"args\": \"");
+		len += jsonescape(body + len, sizeof(body) - len, cmdargs(i));
+		len += snprintf(body + len, sizeof(body) - len, "\"}");
+	}
+	if (len >= sizeof(body) - 2) {
+		httpfinish(req, 500, "{\"error\": \"response too large\"}");
+		return;
+	}
+	snprintf(body + len, sizeof(body) - len, "]}");
+
+	httpfinish(req, 200, body);
+}
+
+/* Copy string into dest as the inside of a JSON string. */
+int
+jsonescape(
+	char *dest,
+	int  size,
+	char *string
+)
+{
+	int len = 0;
+
+	for (; *string != '\0' && len < size - 7; string++) {
+		if (*string == '"' || *string == '\\') {
+			dest[len++] = '\\';
+			dest[len++] = *string;
+		}
+		else if ((unsigned char) *string < ' ') {
+			len += sprintf(dest + len, "\\u%04x", *string);
+		}
+		else {
+			dest[len++] = *string;
+		}
+	}
+	if (size > 0) dest[len] = '\0';
+
+	return(len);
+}
+
+/*
+ * Attach the response to req; it goes out once those ahead of it have.
+ * A body that doesn't fit is a 500 rather than cut-off JSON.
+ */
+void
+httpfinish(
+	struct httpreq *req,
+	int            status,
+	char           *body
+)
+{
+	req->status = status;
+	if (snprintf(req->body, sizeof(req->body), "%s", body) >=
+	    (int) sizeof(req->body)) {
+		req->status = 500;
+		strcpy(req->body, "{\"error\": \"response too large\"}");
+	}
+	req->done = 1;
+}
+
+/* Answer a connection before (or instead of) any request on it. */
+void
+httpanswer(
+	struct httpconn *c,
+	int             status,
+	char            *body
+)
+{
+	struct httpreq *req;
+
+	if ((req = calloc(1, sizeof(*req))) == NULL) return;
+	req->conn = c;
+	req->close = 1;
+	if (c->tail != NULL) c->tail->next = req;
+	else c->head = req;
+	c->tail = req;
+	c->nreq++;
+	httpfinish(req, status, body);
+}
+
+/*
+ * Move finished responses, in request order, into the output buffer and
+ * write what the socket takes. Returns -1 if the connection is dead.
+ */
+int
+httpflush(
+	struct httpconn *c
+)
+{
+	struct httpreq *req;
+	char           *reason;
+	int            len, need;
+
+	while ((req = c->head) != NULL && req->done) {
+		need = strlen(req->body) + 160;
+		if (c->outlen + need > sizeof(c->out)) break;
+
+		switch (req->status) {
+			case 200: reason = "OK"; break;
+			case 400: reason = "Bad Request"; break;
+			case 403: reason = "Forbidden"; break;
+			case 404: reason = "Not Found"; break;
+			case 405: reason = "Method Not Allowed"; break;
+			case 413: reason = "Payload Too Large"; break;
+			case 431: reason = "Request Header Fields Too Large"; break;
+			case 500: reason = "Internal Server Error"; break;
+			case 502: reason = "Bad Gateway"; break;
+			case 504: reason = "Gateway Timeout"; break;
+			default:  reason = "Error"; break;
+		}
+		c->outlen += snprintf(c->out + c->outlen, sizeof(c->out) - c->outlen,
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %d\r\n"
+			"%s"
+			"\r\n%s",
+			req->status, reason, (int) strlen(req->body),
+			req->close ? "Connection: close\r\n" :
+			req->http10 ? "Connection: keep-alive\r\n" : "",
+			req->body);
+
+		if ((c->head = req->next) == NULL) c->tail = NULL;
+		c->nreq--;
+		if (req->close) c->closing = 1;
+		free(req);
+	}
+
+	if (c->outlen > 0) {
+		if ((len = write(c->fd, c->out, c->outlen)) < 0) {
+			return(errno == EAGAIN ? 0 : -1);
+		}
+		memmove(c->out, c->out + len, c->outlen - len);
+		c->outlen -= len;
+	}
+
+	return(0);
+}
+
+/* Drop a connection; requests still at the port are freed when done. */
+void
+httpclose(
+	struct httpconn *c
+)
+{
+	struct httpreq *req, *next;
+
+	for (req = c->head; req != NULL; req = next) {
+		next = req->next;
+		if (req->pending > 0) req->conn = NULL;
+		else free(req);
+	}
+	close(c->fd);
+	free(c);
+}
+
+/*
+ * Serve mode's MQTT 3.1.1 front end. Commands arrive on
+ * <prefix>/<name>/cmd/<command> (payload: the args) and status queries
+ * on <prefix>/<name>/query/<CODE>. Outcomes go to .../result, what the
+ * TV was last set to or reported to .../state/<command or CODE>
+ * (retained), and counters and timings to .../metrics. Publishes queue
+ * in mqtt.out and go out together once per pass of the loop. The
+ * server is resolved here, once, so reconnects don't stall the loop in
+ * getaddrinfo(); returns -1, changing nothing, if it can't be.
+ */
+int
+mqttstart(
+	char *server
+)
+{
+	struct addrinfo hints, *ai;
+	char            host[256], *colon, *slash;
+	int             err;
+
+	snprintf(host, sizeof(host), "%s", server);
+	if ((colon = strrchr(host, ':')) != NULL) *colon++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, colon != NULL ? colon : "1883", &hints,
+	                       &ai)) != 0) {
+		fprintf(stderr, "mqtt: can't resolve %s: %s\n", host,
+			gai_strerror(err));
+		return(-1);
+	}
+	if (mqtt.ai != NULL) freeaddrinfo(mqtt.ai);
+	mqtt.ai = ai;
+
+	snprintf(mqtt.server, sizeof(mqtt.server), "%s", server);
+	if (strcmp(cfg.mqtt_name, "") == 0) {
+		slash = strrchr(portname, '/');
+		snprintf(cfg.mqtt_name, sizeof(cfg.mqtt_name), "%.*s",
+			(int) sizeof(cfg.mqtt_name) - 1,
+			slash != NULL ? slash + 1 : portname); /* cut to fit */
+	}
+	snprintf(mqtt.base, sizeof(mqtt.base), "%s/%s", cfg.mqtt_prefix,
+		cfg.mqtt_name);
+	mqtt.fd = -1;
+	mqtt.retry = monotime();
+	mqtt.metrics = monotime() + cfg.mqtt_metrics * 1000000LL;
+
+	return(0);
+}
+
+/*
+ * Set up pfd for the broker connection, (re)connecting when it's time,
+ * and return how long (ms) poll may sleep before mqttrun() is due.
+ */
+int
+mqttpoll(
+	struct pollfd *pfd
+)
+{
+	long long now = monotime(), when;
+
+	if (mqtt.fd == -1 && now >= mqtt.retry) mqttconnect();
+
+	pfd->fd = mqtt.fd;
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+	if (mqtt.state == MQTT_CONNECTING || mqtt.outlen > 0) {
+		pfd->events |= POLLOUT;
+	}
+
+	if (mqtt.fd == -1) when = mqtt.retry;
+	else if (mqtt.state != MQTT_UP) return(-1);
+	else {
+		when = mqtt.metrics;
+		if (mqtt.lastsent + cfg.mqtt_keepalive * 500000000LL < when)
+			when = mqtt.lastsent + cfg.mqtt_keepalive * 500000000LL;
+		if (mqtt.pingsent != 0 &&
+		    mqtt.pingsent + cfg.mqtt_keepalive * 500000000LL < when)
+			when = mqtt.pingsent + cfg.mqtt_keepalive * 500000000LL;
+	}
+
+	return(when <= now ? 0 : (int) ((when - now + 999999) / 1000000));
+}
+
+/* Start a non-blocking connect to the broker. */
+void
+mqttconnect(void)
+{
+	struct addrinfo *ai = mqtt.ai;
+	int             on = 1;
+
+	mqtt.retry = monotime() + MQTT_RETRY * 1000000LL;
+
+	if ((mqtt.fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) !=
+	    -1) {
+		setsockopt(mqtt.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (connect(mqtt.fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+		    errno != EINPROGRESS) {
+			close(mqtt.fd);
+			mqtt.fd = -1;
+		}
+	}
+
+	mqtt.state = MQTT_CONNECTING;
+	mqtt.inlen = mqtt.outlen = 0;
+	mqtt.pingsent = 0;
+	mqtt.nqos2 = 0; /* clean session: the broker forgets them too */
+}
+
+void
+mqttrun(
+	int revents
+)
+{
+	char      topic[256];
+	long long now = monotime();
+	int       len, err = 0;
+	socklen_t errlen = sizeof(err);
+
+	if (mqtt.fd == -1) return;
+
+	if (mqtt.state == MQTT_CONNECTING && (revents & (POLLOUT | POLLERR))) {
+		getsockopt(mqtt.fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+		if (err != 0) {
+			if (verbose == 1) {
+				logmsg("mqtt: %s: %s", mqtt.server, strerror(err));
+			}
+			mqttdrop();
+			return;
+		}
+		/* Clean session; the broker says "offline" for us if we vanish. */
+		snprintf(topic, sizeof(topic), "%s/status", mqtt.base);
+		mqttconnectpacket(topic);
+		mqtt.state = MQTT_WAITACK;
+	}
+
+	/* Take all there is, so a burst is answered in one write. */
+	while (revents & (POLLIN | POLLHUP | POLLERR)) {
+		if (mqtt.inlen == sizeof(mqtt.in)) {  /* mqttparse() takes any that fit */
+			if (verbose == 1) logmsg("mqtt: %s: packet too big", mqtt.server);
+			mqttdrop();
+			return;
+		}
+		len = read(mqtt.fd, mqtt.in + mqtt.inlen, sizeof(mqtt.in) - mqtt.inlen);
+		if (len == 0 || (len < 0 && errno != EAGAIN)) {
+			if (verbose == 1) logmsg("mqtt: lost %s", mqtt.server);
+			mqttdrop();
+			return;
+		}
+		if (len > 0) mqtt.inlen += len;
+		if (mqttparse() == -1) {
+			mqttdrop();
+			return;
+		}
+		if (len < 0) break;
+	}
+
+	if (mqtt.state == MQTT_UP) {
+		/* A half-open connection only shows as a PINGRESP not coming. */
+		if (mqtt.pingsent != 0 &&
+		    now >= mqtt.pingsent + cfg.mqtt_keepalive * 500000000LL) {
+			if (verbose == 1) logmsg("mqtt: %s stopped answering", mqtt.server);
+			mqttdrop();
+			return;
+		}
+		if (now >= mqtt.metrics) {
+			mqttmetrics();
+			mqtt.metrics = now + cfg.mqtt_metrics * 1000000LL;
+		}
+		if (mqtt.pingsent == 0 &&
+		    now >= mqtt.lastsent + cfg.mqtt_keepalive * 500000000LL &&
+		    mqttbytes("\xc0\x00", 2) == 0) { /* PINGREQ */
+			mqtt.pingsent = now;
+		}
+	}
+}
+
+/* Write whatever publishes have queued up, in as few writes as it takes. */
+void
+mqttflush(void)
+{
+	int len;
+
+	if (mqtt.fd == -1 || mqtt.state == MQTT_CONNECTING || mqtt.outlen == 0)
+		return;
+
+	if ((len = write(mqtt.fd, mqtt.out, mqtt.outlen)) < 0) {
+		if (errno != EAGAIN) mqttdrop();
+		return;
+	}
+	mqtt.writes++;
+	memmove(mqtt.out, mqtt.out + len, mqtt.outlen - len);
+	mqtt.outlen -= len;
+	mqtt.lastsent = monotime();
+}
+
+/* Give up on the connection; commands still at the port finish quietly. */
+void
+mqttdrop(void)
+{
+	close(mqtt.fd);
+	mqtt.fd = -1;
+	mqtt.state = MQTT_DOWN;
+	mqtt.session++;
+	mqtt.inlen = mqtt.outlen = 0;
+	mqtt.retry = monotime() + MQTT_RETRY * 1000000LL;
+}
+
+/* Queue len bytes for the broker; returns -1 (and counts it) if full. */
+int
+mqttbytes(
+	char *bytes,
+	int  len
+)
+{
+	if (mqtt.outlen + len > sizeof(mqtt.out)) {
+		mqtt.dropped++;
+		return(-1);
+	}
+	memcpy(mqtt.out + mqtt.outlen, bytes, len);
+	mqtt.outlen += len;
+	mqtt.packets++;
+
+	return(0);
+}
+
+/* Fixed header: type and flags, then the remaining length (1-4 bytes). */
+int
+mqttheader(
+	char *buffer,
+	int  type,
+	int  remaining
+)
+{
+	int len = 0;
+
+	buffer[len++] = (char) type;
+	do {
+		buffer[len] = remaining % 128;
+		if ((remaining /= 128) > 0) buffer[len] |= 0x80;
+		len++;
+	} while (remaining > 0);
+
+	return(len);
+}
+
+/* A length-prefixed string, as MQTT puts topics and client ids. */
+int
+mqttstring(
+	char *buffer,
+	char *string,
+	int  len
+)
+{
+	buffer[0] = (char) (len >> 8);
+	buffer[1] = (char) (len & 0xff);
+	memcpy(buffer + 2, string, len);
+
+	return(2 + len);
+}
+
+void
+mqttconnectpacket(
+	char *willtopic
+)
+{
+	char packet[1024], body[1000], clientid[128];
+	int  len = 0, n;
+
+	snprintf(clientid, sizeof(clientid), "aquosctl-%s-%d", cfg.mqtt_name,
+		(int) getpid());
+
+	len += mqttstring(body + len, "MQTT", 4);
+	body[len++] = 4;    /* protocol level 3.1.1 */
+	body[len++] = 0x26; /* will retain, will flag, clean session */
+	body[len++] = (char) (cfg.mqtt_keepalive >> 8);
+	body[len++] = (char) (cfg.mqtt_keepalive & 0xff);
+	len += mqttstring(body + len, clientid, strlen(clientid));
+	len += mqttstring(body + len, willtopic, strlen(willtopic));
+	len += mqttstring(body + len, "offline", 7);
+
+	n = mqttheader(packet, 0x10, len);
+	memcpy(packet + n, body, len);
+	mqttbytes(packet, n + len);
+	mqttflush();
+}
+
+/* Queue a QoS 0 publish of payload (len bytes) to <base>/<sub>. */
+void
+mqttpublish(
+	char *sub,
+	char *payload,
+	int  len,
+	int  retain
+)
+{
+	char packet[MQTT_PACKET], topic[256];
+	int  tlen, n;
+
+	if (mqtt.state != MQTT_UP) return;
+
+	tlen = snprintf(topic, sizeof(topic), "%s/%s", mqtt.base, sub);
+	if (tlen >= sizeof(topic) || 2 + tlen + len + 5 > sizeof(packet)) {
+		mqtt.dropped++;
+		return;
+	}
+
+	n = mqttheader(packet, retain ? 0x31 : 0x30, 2 + tlen + len);
+	n += mqttstring(packet + n, topic, tlen);
+	memcpy(packet + n, payload, len);
+	if (mqttbytes(packet, n + len) == 0) mqtt.published++;
+}
+
+/*
+ * Handle whole packets at the front of mqtt.in. Returns -1 if the
+ * broker refused us or sent something unreadable.
+ */
+int
+mqttparse(void)
+{
+	unsigned char *p = (unsigned char *) mqtt.in;
+	char          subscribe[600], header[5], puback[4], topic[256];
+	int           type, remaining, mult, hlen, tlen, len, qos, n, i;
+	unsigned int  id;
+
+	for (;;) {
+		/* Fixed header and remaining length. */
+		if (mqtt.inlen < 2) return(0);
+		type = p[0] >> 4;
+		for (remaining = 0, mult = 1, hlen = 1; hlen < 5; hlen++, mult *= 128) {
+			if (hlen >= mqtt.inlen) return(0);
+			remaining += (p[hlen] & 0x7f) * mult;
+			if (!(p[hlen] & 0x80)) break;
+		}
+		if (hlen == 5) return(-1);
+		hlen++;
+		if (remaining + hlen > sizeof(mqtt.in)) return(-1);
+		if (mqtt.inlen < hlen + remaining) return(0);
+
+		switch (type) {
+			case 2: /* CONNACK */
+				if (remaining < 2 || p[hlen + 1] != 0) {
+					fprintf(stderr, "mqtt: %s refused the connection (%d)\n",
+						mqtt.server, remaining < 2 ? -1 : p[hlen + 1]);
+					return(-1);
+				}
+				mqtt.state = MQTT_UP;
+				if (verbose == 1) {
+					logmsg("mqtt: up on %s as %s", mqtt.server, mqtt.base);
+				}
+
+				/* SUBSCRIBE <base>/cmd/# at QoS 2, so a command isn't
+				   redelivered to the TV, and <base>/query/+ at QoS 1. */
+				len = 2;
+				subscribe[0] = 0;
+				subscribe[1] = 1; /* packet id */
+				tlen = snprintf(topic, sizeof(topic), "%s/cmd/#", mqtt.base);
+				len += mqttstring(subscribe + len, topic, tlen);
+				subscribe[len++] = 2;
+				tlen = snprintf(topic, sizeof(topic), "%s/query/+", mqtt.base);
+				len += mqttstring(subscribe + len, topic, tlen);
+				subscribe[len++] = 1;
+				n = mqttheader(header, 0x82, len);
+				mqttbytes(header, n);
+				mqttbytes(subscribe, len);
+
+				mqttpublish("status", "online", 6, 1);
+				break;
+
+			case 3: /* PUBLISH */
+				qos = (p[0] >> 1) & 3;
+				tlen = (p[hlen] << 8) | p[hlen + 1];
+				n = hlen + 2 + tlen + (qos > 0 ? 2 : 0);
+				if (n > hlen + remaining || tlen >= sizeof(topic)) return(-1);
+				memcpy(topic, p + hlen + 2, tlen);
+				topic[tlen] = '\0';
+				if (qos > 0) {
+					puback[0] = (qos == 1) ? 0x40 : 0x50; /* PUBACK/PUBREC */
+					puback[1] = 2;
+					puback[2] = p[hlen + 2 + tlen];
+					puback[3] = p[hlen + 3 + tlen];
+					mqttbytes(puback, 4);
+				}
+				mqtt.received++;
+
+				/* QoS 2 runs on the first PUBLISH; one redelivered
+				   before its PUBREL has already been to the TV. */
+				if (qos == 2) {
+					id = (p[hlen + 2 + tlen] << 8) | p[hlen + 3 + tlen];
+					for (i = 0; i < mqtt.nqos2 && mqtt.qos2[i] != id; i++)
+						;
+					if (i < mqtt.nqos2) break;
+					if (mqtt.nqos2 == MQTT_QOS2) {
+						memmove(mqtt.qos2, mqtt.qos2 + 1,
+							--mqtt.nqos2 * sizeof(mqtt.qos2[0]));
+					}
+					mqtt.qos2[mqtt.nqos2++] = id;
+				}
+				mqttmessage(topic, (char *) p + n, hlen + remaining - n);
+				break;
+
+			case 6: /* PUBREL (QoS 2): forget the id and complete it */
+				if (remaining >= 2) {
+					id = (p[hlen] << 8) | p[hlen + 1];
+					for (i = 0; i < mqtt.nqos2 && mqtt.qos2[i] != id; i++)
+						;
+					if (i < mqtt.nqos2) {
+						memmove(mqtt.qos2 + i, mqtt.qos2 + i + 1,
+							(--mqtt.nqos2 - i) * sizeof(mqtt.qos2[0]));
+					}
+					puback[0] = 0x70; /* PUBCOMP */
+					puback[1] = 2;
+					puback[2] = p[hlen];
+					puback[3] = p[hlen + 1];
+					mqttbytes(puback, 4);
+				}
+				break;
+
+			case 13: /* PINGRESP */
+				mqtt.pingsent = 0;
+				break;
+
+			default: /* SUBACK, ... */
+				break;
+		}
+
+		len = hlen + remaining;
+		memmove(mqtt.in, mqtt.in + len, mqtt.inlen - len);
+		mqtt.inlen -= len;
+	}
+}
+
+/* A message on one of our topics: queue the command or query it names. */
+void
+mqttmessage(
+	char *topic,
+	char *payload,
+	int  len
+)
+{
+	struct mqttcmd *cmd;
+	char           text[64], arg[2][16] = { "", "" }, *what, *p;
+	int            baselen = strlen(mqtt.base), opcode, n, i, nargs = 0;
+
+	if (strncmp(topic, mqtt.base, baselen) != 0 || topic[baselen] != '/')
+		return;
+	what = topic + baselen + 1;
+
+	/* At most two arguments, each no longer than a word can be. */
+	snprintf(text, sizeof(text), "%.*s", len, payload);
+	for (p = text + strspn(text, " \t\r\n"); *p != '\0' && nargs <= 2;
+	     p += strspn(p, " \t\r\n")) {
+		n = strcspn(p, " \t\r\n");
+		if (nargs == 2 || n >= sizeof(arg[0])) {
+			nargs = 3;
+			break;
+		}
+		memcpy(arg[nargs], p, n);
+		arg[nargs++][n] = '\0';
+		p += n;
+	}
+
+	if ((cmd = calloc(1, sizeof(*cmd))) == NULL) return;
+	cmd->session = mqtt.session;
+
+	if (strncmp(what, "query/", 6) == 0 && strlen(what + 6) == 4) {
+		snprintf(cmd->name, sizeof(cmd->name), "%s", what + 6);
+		addframe(cmd->frames, &cmd->nframes, what + 6, "?   ");
+		cmd->query = 1;
+	}
+	else if (strncmp(what, "cmd/", 4) == 0 &&
+	         (opcode = checkcmd(what + 4)) != CMD_NONE && opcode < CMD_LEARN) {
+		snprintf(cmd->name, sizeof(cmd->name), "%s", what + 4);
+		snprintf(cmd->args, sizeof(cmd->args), "%s", text);
+		if (nargs > 2 ||
+		    (n = encodecommand("serve", opcode, what + 4, arg[0], arg[1],
+		                       cmd->frames)) < 0) {
+			mqttresult(cmd, "invalid argument");
+			free(cmd);
+			return;
+		}
+		cmd->nframes = n;
+	}
+	else {
+		snprintf(cmd->name, sizeof(cmd->name), "%.15s", what);
+		mqttresult(cmd, "no such command");
+		free(cmd);
+		return;
+	}
+
+	/* As for HTTP: nothing but printable characters reaches the TV. */
+	for (i = 0; i < cmd->nframes; i++) {
+		memcpy(cmd->jobs[i].frame, cmd->frames[i].command, 4);
+		memcpy(cmd->jobs[i].frame + 4, cmd->frames[i].param, 4);
+		cmd->jobs[i].frame[8] = '\0';
+		if (badframe(cmd->jobs[i].frame)) {
+			mqttresult(cmd, "need printable characters");
+			free(cmd);
+			return;
+		}
+	}
+
+	for (i = 0; i < cmd->nframes; i++) {
+		cmd->jobs[i].owner = cmd;
+		cmd->jobs[i].index = i;
+		cmd->jobs[i].done = mqttdone;
+		submitjob(&cmd->jobs[i]);
+	}
+	cmd->pending = cmd->nframes;
+}
+
+/* A frame of an MQTT command came back from the port. */
+void
+mqttdone(
+	struct job *job,
+	int        resp,
+	char       *reply
+)
+{
+	struct mqttcmd *cmd = job->owner;
+	char           *result = "ok";
+	int            i;
+
+	cmd->resp[job->index] = resp;
+	snprintf(cmd->reply, sizeof(cmd->reply), "%s", reply);
+	if (!cmd->query) noteframe(&cmd->frames[job->index], resp);
+	if (--cmd->pending > 0) return;
+
+	cmd->ms = (monotime() - job->queued) / 1e6;
+	for (i = 0; i < cmd->nframes; i++) {
+		if (cmd->resp[i] == RESP_NONE) result = "timeout";
+		else if (cmd->resp[i] == RESP_ERR ||
+		         (cmd->resp[i] == RESP_UNKNOWN && !cmd->query))
+			result = (strcmp(result, "ok") == 0) ? "err" : result;
+	}
+
+	/* Answers for a connection that has since dropped are let go. */
+	if (cmd->session == mqtt.session) {
+		mqttresult(cmd, result);
+		if (strcmp(result, "ok") == 0) mqttstate(cmd);
+	}
+	free(cmd);
+}
+
+/* Publish the outcome of cmd to <base>/result. */
+void
+mqttresult(
+	struct mqttcmd *cmd,
+	char           *result
+)
+{
+	char payload[512];
+	int  len;
+
+	len = snprintf(payload, sizeof(payload), "{\"%s\": \"",
+		cmd->query ? "query" : "command");
+	len += jsonescape(payload + len, sizeof(payload) - len, cmd->name);
+	len += snprintf(payload + len, sizeof(payload) - len, "\", \"args\": \"");
+	len += jsonescape(payload + len, sizeof(payload) - len, cmd->args);
+	len += snprintf(payload + len, sizeof(payload) - len, "\", \"result\": "
+		"\"%s\", \"reply\": \"", result);
+	len += jsonescape(payload + len, sizeof(payload) - len, cmd->reply);
+	len += snprintf(payload + len, sizeof(payload) - len, "\", \"ms\": %.1f}",
+		cmd->ms);
+
+	mqttpublish("result", payload, len, 0);
+}
+
+/* Retain what the TV now is: the args set, or the query's answer. */
+void
+mqttstate(
+	struct mqttcmd *cmd
+)
+{
+	char sub[64];
+
+	snprintf(sub, sizeof(sub), "state/%s", cmd->name);
+	if (cmd->query) mqttpublish(sub, cmd->reply, strlen(cmd->reply), 1);
+	else mqttpublish(sub, cmd->args, strlen(cmd->args), 1);
+}
+
+/* Publish counters and timings to <base>/metrics. */
+void
+mqttmetrics(void)
+{
+	char payload[512];
+	int  len;
+
+	loadhealth();
+	len = snprintf(payload, sizeof(payload),
+		"{\"frames\": %lu, \"errors\": %lu, \"timeouts\": %lu, "
+		"\"queued\": %d, \"wire_p50_us\": %lld, \"wire_p99_us\": %lld, "
+		"\"reply_p50_us\": %lld, \"reply_p99_us\": %lld, "
+		"\"received\": %lu, \"published\": %lu, \"packets\": %lu, "
+		"\"writes\": %lu, \"dropped\": %lu, \"health\": %.1f}",
+		engine.frames, engine.errors, engine.timeouts, engine.queued,
+		timingpercentile(&engine.wire, 50), timingpercentile(&engine.wire, 99),
+		timingpercentile(&engine.turn, 50), timingpercentile(&engine.turn, 99),
+		mqtt.received, mqtt.published, mqtt.packets, mqtt.writes,
+		mqtt.dropped, health.score);
+
+	mqttpublish("metrics", payload, len, 0);
+}
+
+/*
+ * Point the log writer at cfg.log: "stderr", "syslog" or a file name
+ * (appended to). Falls back to stderr if the file can't be opened.
+ */
+void
+logopen(
+	char *progname
+)
+{
+	int lfd;
+
+	if (strcmp(cfg.log, "stderr") == 0) {
+		logdest = LOGTO_STDERR;
+		logfd = STDERR_FILENO;
+	}
+	else if (strcmp(cfg.log, "syslog") == 0) {
+		logdest = LOGTO_SYSLOG;
+		openlog("aquosctl", LOG_PID, LOG_USER);
+	}
+	else if ((lfd = open(cfg.log, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+		fprintf(stderr, "%s: %s: %s (logging to stderr)\n", progname,
+			cfg.log, strerror(errno));
+	}
+	else {
+		logdest = LOGTO_FILE;
+		logfd = lfd;
+	}
+}
+
+/*
+ * Format a log record into the calling thread's ring. Never blocks: if
+ * the writer has fallen LOG_SLOTS records behind, the record is counted
+ * as dropped and the writer reports the count once it catches up.
+ */
+void
+logmsg(
+	const char *fmt,
+	...
+)
+{
+	struct logring  *ring = logown;
+	struct logrec   *rec;
+	struct timespec ts;
+	unsigned int    head;
+	va_list         ap;
+	int             len;
+
+	if (ring == NULL && (ring = logring()) == NULL) return;
+
+	/* Only touch the writer's cache line when the ring looks full. */
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - ring->tailseen == LOG_SLOTS &&
+	    head - (ring->tailseen = atomic_load_explicit(&ring->tail,
+	                             memory_order_acquire)) == LOG_SLOTS) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	rec = &ring->slot[head & (LOG_SLOTS - 1)];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->when = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	va_start(ap, fmt);
+	len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+	rec->len = len < 0 ? 0 : (len >= LOG_TEXT ? LOG_TEXT - 1 : len);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	/* Wake the writer if it has gone to sleep on empty rings. The fence
+	   pairs with logwriter()'s: either it sees this record or we see
+	   it sleeping. */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&logsleeping, memory_order_relaxed) &&
+	    atomic_exchange(&logsleeping, 0)) {
+		logwake();
+	}
+}
+
+/* Kick the writer out of its wait. */
+void
+logwake(void)
+{
+	uint64_t one = 1;
+
+	if (logevent != -1) write(logevent, &one, sizeof(one));
+}
+
+/*
+ * Give the calling thread a ring and link it onto logrings, starting the
+ * writer with the first one. Rings live until exit.
+ */
+struct logring *
+logring(void)
+{
+	struct logring *ring;
+
+	if ((ring = calloc(1, sizeof(*ring))) == NULL) return(NULL);
+
+	ring->next = atomic_load(&logrings);
+	while (!atomic_compare_exchange_weak(&logrings, &ring->next, ring))
+		;
+	logown = ring;
+
+	pthread_once(&logonce, logstart);
+
+	return(ring);
+}
+
+void
+logstart(void)
+{
+	sigset_t all, old;
+
+	/* Signals are for the main thread; the writer inherits this mask. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	logevent = eventfd(0, EFD_CLOEXEC);
+	logstarted = (pthread_create(&logthread, NULL, logwriter, NULL) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	atexit(logstop);
+}
+
+/*
+ * Drain the rings until logstop(). While records keep coming the writer
+ * looks every LOG_IDLE ms, so a burst costs its producers nothing; once
+ * a look finds nothing it sleeps on logevent until a logmsg() wakes it,
+ * and an idle process costs no wakeups at all.
+ */
+void *
+logwriter(
+	void *unused
+)
+{
+	struct timespec idle = { 0, LOG_IDLE * 1000000L };
+	struct pollfd   pfd;
+	uint64_t        count;
+	int             stopping, busy = 0;
+
+	pfd.fd = logevent;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* Read first: once set, an empty pass means everything is out. */
+		stopping = atomic_load(&logstopping);
+		if (logdrain() > 0) {
+			busy = 1;
+			continue;
+		}
+		if (stopping) break;
+		if (busy || logevent == -1) {
+			busy = 0;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		/* Say we're going to sleep, then look once more for records
+		   published before a producer could have seen that. */
+		atomic_store(&logsleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (logdrain() > 0 || atomic_load(&logstopping)) {
+			atomic_store(&logsleeping, 0);
+			continue;
+		}
+		if (poll(&pfd, 1, -1) > 0) read(logevent, &count, sizeof(count));
+		atomic_store(&logsleeping, 0);
+	}
+
+	return(NULL);
+}
+
+/*
+ * Write out whatever the rings hold, batching lines for stderr and files
+ * into as few writes as possible. Returns the number of records written.
+ */
+int
+logdrain(void)
+{
+	struct logring *ring;
+	struct logrec  *rec;
+	struct tm      tm;
+	time_t         sec, lastsec = -1;
+	unsigned int   head, tail;
+	unsigned long  dropped;
+	char           buffer[65536], stamp[16] = "";
+	int            len = 0, n = 0, dest = atomic_load(&logdest),
+	               out = atomic_load(&logfd);
+
+	for (ring = atomic_load(&logrings); ring != NULL; ring = ring->next) {
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		for (; tail != head; tail++, n++) {
+			rec = &ring->slot[tail & (LOG_SLOTS - 1)];
+
+			if (dest == LOGTO_SYSLOG) {
+				syslog(LOG_INFO, "%.*s", rec->len, rec->text);
+			}
+			else {
+				if ((sec = rec->when / 1000000000LL) != lastsec) {
+					localtime_r(&sec, &tm);
+					strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+					lastsec = sec;
+				}
+				if (len > sizeof(buffer) - LOG_TEXT - 32) {
+					write(out, buffer, len);
+					len = 0;
+				}
+				len += sprintf(buffer + len, "%s.%06lld %.*s\n", stamp,
+					rec->when % 1000000000LL / 1000, rec->len, rec->text);
+			}
+		}
+		/* The records are copied out, so their slots can be reused. */
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+		dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if (dropped != ring->reported) {
+			if (dest == LOGTO_SYSLOG) {
+				syslog(LOG_WARNING, "%lu log records dropped",
+					dropped - ring->reported);
+			}
+			else {
+				len += sprintf(buffer + len, "%lu log records dropped\n",
+					dropped - ring->reported);
+			}
+			ring->reported = dropped;
+		}
+	}
+
+	if (len > 0) write(out, buffer, len);
+
+	return(n);
+}
+
+/* At exit: let the writer empty the rings, then stop it. */
+void
+logstop(void)
+{
+	atomic_store(&logstopping, 1);
+	if (logstarted) {
+		logwake();
+		pthread_join(logthread, NULL);
+	}
+	else {
+		logdrain();
+	}
+}
+
+static struct benchtab {
+	char *name;
+	void (*run)(void);
+} benchtab[] = {
+	{"log",    benchlog},
+	{"jitter", benchjitter},
+	{"http",   benchhttp},
+	{"window", benchwindow},
+	{"encode", benchencode},
+	{"parse",  benchparse},
+	{"script", benchscript},
+	{"fleet",  benchfleet},
+	{"submit", benchsubmit},
+	{"slo",    benchslo},
+};
+
+/*
+ * Run the named micro-benchmarks, or all of them. Each prints one line
+ * per variant it measures.
+ */
+int
+bench(
+	char *progname,
+	int  argc,
+	char *argv[]
+)
+{
+	int i, j;
+
+	for (i = 0; i < sizeof(benchtab) / sizeof(benchtab[0]); i++) {
+		for (j = 0; j < argc && strcmp(argv[j], benchtab[i].name) != 0; j++)
+			;
+		if (argc == 0 || j < argc) benchtab[i].run();
+	}
+
+	for (j = 0; j < argc; j++) {
+		for (i = 0; i < sizeof(benchtab) / sizeof(benchtab[0]) &&
+		            strcmp(argv[j], benchtab[i].name) != 0; i++)
+			;
+		if (i == sizeof(benchtab) / sizeof(benchtab[0])) {
+			fprintf(stderr, "%s: no benchmark '%s'\n", progname, argv[j]);
+			return(EXIT_FAILURE);
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/*
+ * Cost to the caller of one verbose record: formatted and written on the
+ * spot, as -v used to, against queued with logmsg(), both when the
+ * writer keeps up and when it is flooded. Output goes to /dev/null so
+ * only the logging itself is measured.
+ */
+void
+benchlog(void)
+{
+	struct timespec pause = { 0, 5 * 1000000L };
+	long long       start, elapsed;
+	unsigned long   dropped;
+	char            buffer[LOG_TEXT];
+	int             nullfd, savefd, savedest, i, len;
+	const int       count = 200000;
+
+	if ((nullfd = open("/dev/null", O_WRONLY)) == -1) return;
+	savefd = logfd;
+	savedest = logdest;
+
+	start = monotime();
+	for (i = 0; i < count; i++) {
+		len = snprintf(buffer, sizeof(buffer),
+			"command='%s', parameter='%-4d'\n", "VOLM", i % 61);
+		write(nullfd, buffer, len);
+	}
+	elapsed = monotime() - start;
+	printf("log    write(2)         %6.1f ns/record\n",
+		(double) elapsed / count);
+
+	/* Make sure the ring and writer exist before timing anything. */
+	usleep(20000);
+	logfd = nullfd;
+	logdest = LOGTO_FILE;
+	logmsg("bench");
+	usleep(20000);
+
+	/* Paced: stop short of a full ring and let the writer catch up. */
+	dropped = atomic_load(&logown->dropped);
+	elapsed = 0;
+	start = monotime();
+	for (i = 0; i < count; i++) {
+		if (i % (LOG_SLOTS / 2) == 0) {
+			elapsed -= monotime();
+			nanosleep(&pause, NULL);
+			elapsed += monotime();
+		}
+		logmsg("command='%s', parameter='%-4d'", "VOLM", i % 61);
+	}
+	elapsed = monotime() - start - elapsed;
+	printf("log    logmsg, paced    %6.1f ns/record, %lu dropped\n",
+		(double) elapsed / count,
+		atomic_load(&logown->dropped) - dropped);
+	usleep(20000);
+
+	/* Flooded: the ring fills and the rest are counted, not waited on. */
+	dropped = atomic_load(&logown->dropped);
+	start = monotime();
+	for (i = 0; i < count; i++) {
+		logmsg("command='%s', parameter='%-4d'", "VOLM", i % 61);
+	}
+	elapsed = monotime() - start;
+	printf("log    logmsg, flooded  %6.1f ns/record, %lu dropped\n",
+		(double) elapsed / count, atomic_load(&logown->dropped) - dropped);
+
+	usleep(20000);
+	logfd = savefd;
+	logdest = savedest;
+	close(nullfd);
+}
+
+/*
+ * Timed writes to /dev/null every millisecond, as play and --at make
+ * them; run under load, with and without --realtime.
+ */
+void
+benchjitter(void)
+{
+	long long start;
+	int       nullfd, i;
+	const int count = 2000;
+
+	if ((nullfd = open("/dev/null", O_WRONLY)) == -1) return;
+
+	memset(&jitter, 0, sizeof(jitter));
+	start = monotime() + 1000000LL;
+	for (i = 0; i < count; i++) {
+		writedue = start + i * 1000000LL;
+		awaitdue();
+		write(nullfd, "POWR1   \r", 9);
+	}
+	close(nullfd);
+
+	printf("jitter 1 ms deadlines    p50 <%lld us, p99 <%lld us, max %.1f us\n",
+		timingpercentile(&jitter, 50), timingpercentile(&jitter, 99),
+		jitter.worst / 1e3);
+	memset(&jitter, 0, sizeof(jitter));
+}
+
+/*
+ * Load generator for serve's HTTP side, at http-listen: four keep-alive
+ * connections each keep depth requests in flight for a second. Commands
+ * are only sent to a server started with -n, so no TV is touched.
+ */
+void
+benchhttp(void)
+{
+	static struct {
+		char *path;
+		int  depth;
+	} runs[] = {
+		{ "/status", 1 }, { "/status", 16 },
+		{ "/power/on", 1 }, { "/power/on", 16 },
+	};
+	struct pollfd      pfds[4];
+	struct {
+		char      in[65536];
+		int       inlen;
+		long long sent[64]; /* ring of send times, one per request */
+		int       first, inflight;
+	}                  *conn;
+	struct timings     lat;
+	struct sockaddr_in addr;
+	uint32_t           errors;
+	char               request[256], probe[1024], host[INET_ADDRSTRLEN + 8],
+	                   *end, *cl;
+	long long          start, stop, now;
+	int                r, i, j, len, headlen, bodylen, nosendserver;
+
+	/* Is anyone there, and does it have a TV behind it? */
+	if ((pfds[0].fd = httpconnect(cfg.http_listen)) == -1) {
+		printf("http   no server on %s (start 'aquosctl -n serve')\n",
+			cfg.http_listen);
+		return;
+	}
+	httpaddr(cfg.http_listen, &addr);
+	inet_ntop(AF_INET, &addr.sin_addr, host, INET_ADDRSTRLEN);
+	sprintf(host + strlen(host), ":%d", ntohs(addr.sin_port));
+	len = snprintf(request, sizeof(request), "GET /status HTTP/1.1\r\n"
+		"Host: %s\r\nConnection: close\r\n\r\n", host);
+	write(pfds[0].fd, request, len);
+	for (len = 0; len < sizeof(probe) - 1 &&
+	              (i = read(pfds[0].fd, probe + len, sizeof(probe) - 1 - len)) > 0;
+	     len += i)
+		;
+	probe[len] = '\0';
+	close(pfds[0].fd);
+	nosendserver = (strstr(probe, "\"nosend\": true") != NULL);
+
+	if ((conn = calloc(4, sizeof(*conn))) == NULL) return;
+
+	for (r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+		if (strcmp(runs[r].path, "/status") != 0 && !nosendserver) continue;
+
+		if (strcmp(runs[r].path, "/status") == 0) {
+			len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n"
+				"Host: %s\r\n\r\n", runs[r].path, host);
+		}
+		else if (strcmp(cfg.http_token, "") != 0) {
+			len = snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\n"
+				"Host: %s\r\nAuthorization: Bearer %s\r\n\r\n",
+				runs[r].path, host, cfg.http_token);
+		}
+		else {
+			len = snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\n"
+				"Host: %s\r\nX-Aquosctl: 1\r\n\r\n", runs[r].path, host);
+		}
+		memset(&lat, 0, sizeof(lat));
+		errors = 0;
+
+		for (i = 0; i < 4; i++) {
+			if ((pfds[i].fd = httpconnect(cfg.http_listen)) == -1) {
+				printf("http   lost the server on %s\n", cfg.http_listen);
+				free(conn);
+				return;
+			}
+			fcntl(pfds[i].fd, F_SETFL, O_NONBLOCK);
+			conn[i].inlen = conn[i].first = conn[i].inflight = 0;
+		}
+
+		start = monotime();
+		stop = start + 1000000000LL;
+		for (;;) {
+			now = monotime();
+			for (i = 0, j = 0; i < 4; i++) {
+				/* Top up the pipeline until time is up. */
+				while (now < stop && conn[i].inflight < runs[r].depth &&
+				       write(pfds[i].fd, request, len) == len) {
+					conn[i].sent[(conn[i].first + conn[i].inflight++) % 64] =
+						now;
+				}
+				j += conn[i].inflight;
+				pfds[i].events = POLLIN;
+			}
+			if (j == 0 || now > stop + 2000000000LL) break;
+			if (poll(pfds, 4, 100) <= 0) continue;
+
+			for (i = 0; i < 4; i++) {
+				if (!(pfds[i].revents & POLLIN)) continue;
+				if ((j = read(pfds[i].fd, conn[i].in + conn[i].inlen,
+				              sizeof(conn[i].in) - 1 - conn[i].inlen)) <= 0) {
+					conn[i].inflight = 0; /* closed on us */
+					errors++;
+					continue;
+				}
+				conn[i].inlen += j;
+				conn[i].in[conn[i].inlen] = '\0';
+
+				/* Count off every complete response. */
+				while ((end = strstr(conn[i].in, "\r\n\r\n")) != NULL) {
+					headlen = end + 4 - conn[i].in;
+					cl = strcasestr(conn[i].in, "Content-Length:");
+					bodylen = (cl != NULL && cl < end) ? atoi(cl + 15) : 0;
+					if (conn[i].inlen < headlen + bodylen) break;
+
+					if (strncmp(conn[i].in, "HTTP/1.1 200", 12) != 0) errors++;
+					now = monotime();
+					addtiming(&lat, now - conn[i].sent[conn[i].first]);
+					conn[i].first = (conn[i].first + 1) % 64;
+					conn[i].inflight--;
+
+					memmove(conn[i].in, conn[i].in + headlen + bodylen,
+						conn[i].inlen - headlen - bodylen + 1);
+					conn[i].inlen -= headlen + bodylen;
+				}
+			}
+		}
+		now = monotime();
+		for (i = 0; i < 4; i++) close(pfds[i].fd);
+
+		printf("http   %-10s x4x%-3d %8.0f req/s, p50 <%lld us, p99 <%lld us, "
+			"%u errors\n", runs[r].path, runs[r].depth,
+			lat.total / ((now - start) / 1e9), timingpercentile(&lat, 50),
+			timingpercentile(&lat, 99), errors);
+	}
+
+	free(conn);
+}
+
+/*
+ * Time a run of power queries, which change nothing, at each window on
+ * the TV at -p, to find how many frames in flight the model takes. The
+ * largest window that answers cleanly and still gains is suggested for
+ * the config file.
+ */
+void
+benchwindow(void)
+{
+	static struct job jobs[48];
+	static int        windows[] = { 1, 2, 3, 4, 6, 8, 12, 16 };
+	const int         count = sizeof(jobs) / sizeof(jobs[0]);
+	long long         elapsed, last = 0;
+	unsigned long     errors, timeouts;
+	int               i, w, best = 1;
 
-	/* Set the baud rates to 9600,8,N,1. */
-	cfsetispeed(&options, B9600);
-	cfsetospeed(&options, B9600);
-	options.c_cflag &= ~PARENB;
-	options.c_cflag &= ~CSTOPB;
-	options.c_cflag &= ~CSIZE;
-	options.c_cflag |= CS8;
+	if (nosend == 1 || access(portname, R_OK | W_OK) != 0) {
+		printf("window  needs the TV on %s, without -n; skipped\n", portname);
+		return;
+	}
+	openport(portname);
+	loadhealth();
 
-	options.c_cflag &= ~CRTSCTS; /* No hardware flow control. */
+	for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+		cfg.window = engine.window = windows[w];
+		errors = engine.errors;
+		timeouts = engine.timeouts;
+		elapsed = monotime();
 
-	options.c_cflag |= (CLOCAL | CREAD); /* Enable receiver, set local mode. */
-	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); /* Raw input. */
+		/* No more than the window outstanding, and none after an ERR
+		   or timeout: a dead port costs one window of timeouts. */
+		for (i = 0; i < count; i++) {
+			enginedrain(windows[w] - 1);
+			if (engine.errors != errors || engine.timeouts != timeouts)
+				break;
+			snprintf(jobs[i].frame, sizeof(jobs[i].frame), "POWR?   ");
+			jobs[i].done = benchdone;
+			submitjob(&jobs[i]);
+		}
+		enginedrain(0);
+		elapsed = monotime() - elapsed;
+		errors = engine.errors - errors;
+		timeouts = engine.timeouts - timeouts;
 
-	options.c_iflag &= ~(IXON | IXOFF | IXANY); /* No software flow control. */
-	options.c_oflag &= ~OPOST; /* Raw output. */
+		printf("window %-2d %d queries    %.1f ms/frame, %lu ERR, "
+			"%lu timeouts\n", windows[w], i, elapsed / 1e6 / i,
+			errors, timeouts);
+		if (errors > 0 || timeouts > 0) break;
+		if (last == 0 || elapsed < last * 0.95) best = windows[w];
+		if (last == 0 || elapsed < last) last = elapsed;
+	}
+	printf("window    suggested: 'window %d %s' in the config file\n",
+		best, model);
+}
 
-	tcsetattr(fd, TCSANOW, &options); /* Set options for the new port. */
+void
+benchdone(
+	struct job *job,
+	int        resp,
+	char       *reply
+)
+{
+}
 
-	return;
+/*
+ * Frames per second encoding a fleet-sized batch of numeric settings:
+ * through encodecommand() from their argument strings plus a sprintf
+ * per frame, as a command line does, and through encodebulk(). The two
+ * outputs are compared byte for byte.
+ */
+void
+benchencode(void)
+{
+	static struct bulkitem items[50000];
+	static char            args[50000][8], slow[50000 * 18], fast[50000 * 18];
+	static int             opcodes[] = { CMD_VOLUME, CMD_INPUT, CMD_ACHAN,
+	                                     CMD_DCHAN, CMD_DCABL1, CMD_DCABL2 };
+	struct frame           frames[MAX_FRAMES];
+	const int              count = sizeof(items) / sizeof(items[0]);
+	long long              start, elapsed;
+	long                   len, slowlen = 0, frames_out = 0;
+	int                    i, j, n, bad;
+	char                   *names[] = { "vol", "input", "achan", "dchan",
+	                                    "dcabl1", "dcabl2" };
+
+	for (i = 0; i < count; i++) {
+		j = i % (sizeof(opcodes) / sizeof(opcodes[0]));
+		items[i].opcode = opcodes[j];
+		items[i].sub = 0;
+		switch (opcodes[j]) {
+			case CMD_VOLUME: items[i].value = i % 61; break;
+			case CMD_INPUT:  items[i].value = 1 + i % 7; break;
+			case CMD_ACHAN:  items[i].value = 1 + i % 135; break;
+			case CMD_DCHAN:  items[i].value = 1 + i % 99;
+			                 items[i].sub = i % 10; break;
+			case CMD_DCABL1: items[i].value = 1 + i % 999;
+			                 items[i].sub = i % 1000; break;
+			case CMD_DCABL2: items[i].value = i % 16384; break;
+		}
+		if (items[i].opcode == CMD_DCHAN || items[i].opcode == CMD_DCABL1) {
+			snprintf(args[i], sizeof(args[i]), "%d.%d", items[i].value,
+				items[i].sub);
+		}
+		else {
+			snprintf(args[i], sizeof(args[i]), "%d", items[i].value);
+		}
+	}
+
+	start = monotime();
+	for (i = 0; i < count; i++) {
+		n = encodecommand("bench", items[i].opcode,
+			names[i % (sizeof(opcodes) / sizeof(opcodes[0]))], args[i], "",
+			frames);
+		for (j = 0; j < n; j++) {
+			slowlen += sprintf(slow + slowlen, "%s%s\r", frames[j].command,
+				frames[j].param);
+		}
+		frames_out += n;
+	}
+	elapsed = monotime() - start;
+	printf("encode encodecommand     %.0f frames/s\n", frames_out / (elapsed / 1e9));
+
+	start = monotime();
+	len = encodebulk(items, count, fast, sizeof(fast), &bad);
+	elapsed = monotime() - start;
+	printf("encode encodebulk        %.0f frames/s\n", frames_out / (elapsed / 1e9));
+
+	if (len != slowlen || memcmp(slow, fast, len) != 0)
+		printf("encode outputs differ (%ld and %ld bytes)\n", slowlen, len);
+}
+
+/*
+ * Keyword arguments parsed per second by encodecommand(): every word
+ * this revision has, then only button's, the longest run to search.
+ */
+void
+benchparse(void)
+{
+	struct frame frames[MAX_FRAMES];
+	long long    start, elapsed;
+	long         parsed;
+	int          i, pass, only;
+
+	for (only = CMD_NONE; only <= CMD_BUTTON; only += CMD_BUTTON) {
+		parsed = 0;
+		start = monotime();
+		for (pass = 0; pass < 20000; pass++) {
+			for (i = 0; i < sizeof(wordtab) / sizeof(wordtab[0]); i++) {
+				if ((wordtab[i].proto & PROTO_THIS) == 0 ||
+				    (only != CMD_NONE && wordtab[i].opcode != only))
+					continue;
+				encodecommand("bench", wordtab[i].opcode, "bench",
+					wordtab[i].word, "", frames);
+				parsed++;
+			}
+		}
+		elapsed = monotime() - start;
+		if (parsed == 0) continue; /* no button before 12/17/10 */
+		printf("parse   %-6s %4ld words  %.0f ns/word\n",
+			only == CMD_NONE ? "all" : "button", parsed / 20000,
+			(double)elapsed / parsed);
+	}
+}
+
+/*
+ * What serve's latency objectives cost: slorecord() per reply, spread
+ * over 8 opcodes, and slotick() judging their windows against 4 slo
+ * lines and dropping a slice. Shifts it may flag aren't reported.
+ */
+void
+benchslo(void)
+{
+	static long long ns[65536];
+	static char      *codes[] = { "VOLM", "POWR", "IAVD", "DCCH",
+	                              "AVMD", "WIDE", "MUTE", "ACSU" };
+	struct config    saved = cfg;
+	long long        start, elapsed;
+	uint64_t         x = 88172645463325252ULL;
+	const int        n = 2000000, ticks = 2000;
+	int              i;
+
+	for (i = 0; i < 65536; i++) {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		ns[i] = 10000000 + (x * 2685821657736338717ULL >> 40) % 10000000;
+	}
+	memset(&slo, 0, sizeof(slo));
+	cfg.nslo = 0;
+	sloline(&cfg, "slo VOLM 99 1000");
+	sloline(&cfg, "slo POWR 99 1000");
+	sloline(&cfg, "slo * 99 5000");
+	sloline(&cfg, "slo * 50 1000");
+
+	start = monotime();
+	for (i = 0; i < n; i++) slorecord(codes[i & 7], ns[i & 65535]);
+	elapsed = monotime() - start;
+	printf("slo     record %6.1f ns/reply\n", (double) elapsed / n);
+
+	start = monotime();
+	for (i = 0; i < ticks; i++) {
+		slo.flagged = 0;
+		slo.rotate = 0;
+		slotick(monotime());
+	}
+	elapsed = monotime() - start;
+	printf("slo     judge  %6.1f us/slice (%d opcodes, %d slo lines)\n",
+		elapsed / 1e3 / ticks, slo.ncodes, cfg.nslo);
+
+	memset(&slo, 0, sizeof(slo));
+	cfg = saved;
+}
+
+/*
+ * Split a generated 200000 line script into fields, as compile used to
+ * (fgets and sscanf into fixed buffers) and with scriptline().
+ */
+void
+benchscript(void)
+{
+	struct script script;
+	FILE          *fp;
+	char          path[] = "/tmp/aquosctl.bench.XXXXXX", line[256],
+	              oparg[16], arg[16], arg2[16], *field[SCRIPT_FIELDS];
+	int           scriptfd, i, lines = 0, column[SCRIPT_FIELDS];
+	long long     start, elapsed;
+	off_t         size;
+
+	if ((scriptfd = mkstemp(path)) == -1 ||
+	    (fp = fdopen(scriptfd, "w")) == NULL) {
+		printf("script  can't create %s: %s\n", path, strerror(errno));
+		return;
+	}
+	for (i = 0; i < 200000; i++) {
+		switch (i % 4) {
+			case 0: fprintf(fp, "vol %d\n", i % 61); break;
+			case 1: fprintf(fp, "input %d   # room %d\n", 1 + i % 7, i); break;
+			case 2: fprintf(fp, "dchan %d.%d\n", 1 + i % 99, i % 10); break;
+			case 3: fprintf(fp, "wait 20ms\n"); break;
+		}
+	}
+	size = ftello(fp);
+	fclose(fp);
+
+	start = monotime();
+	if ((fp = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			oparg[0] = arg[0] = arg2[0] = '\0';
+			if (strchr(line, '#') != NULL) *strchr(line, '#') = '\0';
+			if (sscanf(line, "%15s %15s %15s", oparg, arg, arg2) >= 1) lines++;
+		}
+		fclose(fp);
+	}
+	elapsed = monotime() - start;
+	printf("script fgets+sscanf      %.1f MB/s, %d lines\n",
+		size / (elapsed / 1e3), lines);
+
+	lines = 0;
+	start = monotime();
+	if (openscript(path, &script) == 0) {
+		while (scriptline(&script, field, column) > 0) lines++;
+		closescript(&script);
+	}
+	elapsed = monotime() - start;
+	printf("script mmap+scriptline   %.1f MB/s, %d lines\n",
+		size / (elapsed / 1e3), lines);
+
+	unlink(path);
+}
+
+/*
+ * Selector resolution over a made-up inventory of 10000 TVs: the
+ * compiled bitset evaluation against checking each TV's tag text, for
+ * a few selectors. Both must pick the same TVs.
+ */
+void
+benchfleet(void)
+{
+	static char *selectors[] = {
+		"floor=3",
+		"floor=3 & type=lobby & !maintenance",
+		"(floor=1 | floor=2 | floor=3) & !(type=room | maintenance) & zone=2",
+		"!(type=bar | type=gym) & (model=LC-52D64U | model=LC-60LE847U) & "
+		    "!maintenance & (floor=10 | floor=11 | floor=12 | floor=13)",
+	};
+	static char *types[] = { "lobby", "bar", "room", "gym", "office" },
+	            *models[] = { "LC-42D64U", "LC-52D64U", "LC-60LE847U" };
+	struct fleet   f;
+	struct fleetop ops[FLEET_OPS];
+	uint64_t       *set;
+	char           port[32], tags[128], error[64], label[16], *p, *save;
+	int            i, j, k, nops, count, scanned, rounds = 1000, hit;
+	long long      start, compile, resolve, scan;
+
+	memset(&f, 0, sizeof(f));
+	for (i = 0; i < 10000; i++) {
+		snprintf(port, sizeof(port), "/dev/ttyFLEET%05d", i);
+		snprintf(tags, sizeof(tags), "floor=%d type=%s zone=%d model=%s%s",
+			1 + i % 20, types[i / 7 % 5], i % 50, models[i / 3 % 3],
+			i % 19 == 0 ? " maintenance" : "");
+		if (fleetadd(&f, port, tags) == -1) return;
+	}
+	if ((set = calloc(f.alloc / 64, sizeof(uint64_t))) == NULL) return;
+
+	for (k = 0; k < sizeof(selectors) / sizeof(selectors[0]); k++) {
+		start = monotime();
+		for (i = 0; i < rounds; i++) {
+			nops = compileselector(&f, selectors[k], ops, error,
+				sizeof(error));
+		}
+		compile = (monotime() - start) / rounds;
+
+		start = monotime();
+		for (i = 0; i < rounds; i++)
+			count = resolveselector(&f, ops, nops, set);
+		resolve = (monotime() - start) / rounds;
+
+		/*
+		 * The scan: every TV's tags against every tag the compiled
+		 * selector names, then the same ops over single bits.
+		 */
+		start = monotime();
+		for (j = 0, scanned = 0; j < f.count; j++) {
+			uint64_t stack[FLEET_DEPTH];
+			int      sp = 0;
+
+			for (i = 0; i < nops; i++) {
+				switch (ops[i].op) {
+					case FLEET_TAG:
+						hit = 0;
+						snprintf(tags, sizeof(tags), "%s", f.tagtext[j]);
+						for (p = strtok_r(tags, " ", &save); p != NULL && !hit;
+						     p = strtok_r(NULL, " ", &save)) {
+							hit = strcmp(p, f.tags[ops[i].tag]) == 0;
+						}
+						stack[sp++] = hit;
+						break;
+					case FLEET_NONE: stack[sp++] = 0; break;
+					case FLEET_ALL:  stack[sp++] = 1; break;
+					case FLEET_NOT:  stack[sp - 1] = !stack[sp - 1]; break;
+					case FLEET_AND:  sp--; stack[sp - 1] &= stack[sp]; break;
+					case FLEET_OR:   sp--; stack[sp - 1] |= stack[sp]; break;
+				}
+			}
+			if (stack[0] != ((set[j / 64] >> (j % 64)) & 1)) break;
+			scanned += stack[0];
+		}
+		scan = monotime() - start;
+
+		snprintf(label, sizeof(label), "%d ops", nops);
+		printf("fleet  %-7s %5d of %d TVs: compile %.1f us, bitsets %.1f us, "
+			"scan %.0f us%s\n", label, count, f.count, compile / 1e3,
+			resolve / 1e3, scan / 1e3,
+			j < f.count || scanned != count ? " (MISMATCH)" : "");
+	}
+	free(set);
+}
+
+/* A submitting thread of benchsubmit(), and what it saw. */
+struct benchthread {
+	struct aquos  *h;
+	int           count;
+	long long     total;       /* ns in aquossubmit(), over count calls */
+	unsigned long full;        /* calls that found the queue full */
+	unsigned int  log2ns[64];  /* calls taking under 2^i ns */
+	pthread_t     thread;
+};
+
+/*
+ * Cost of aquossubmit() with 1 to 32 threads submitting to one handle
+ * at once. The TV is a socket pair answering every frame as it comes,
+ * and the window is opened all the way, so the handle's thread drains
+ * the queue as fast as it can. Only calls that queue a frame are timed;
+ * a full queue is counted and retried after a yield.
+ */
+void
+benchsubmit(void)
+{
+	static int         threads[] = { 1, 2, 4, 8, 16, 32 };
+	struct benchthread t[32];
+	_Atomic unsigned long completed;
+	pthread_t          responder;
+	unsigned int       log2ns[64];
+	unsigned long      full, calls, seen;
+	long long          start, elapsed, total;
+	const int          count = 200000;
+	int                sv[2], n, i, b, p50, p99;
+	struct aquos       *h;
+
+	for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) return;
+		if ((h = aquosattach(sv[0], -1)) == NULL) return;
+		h->window = WINDOW_MAX;
+		pthread_create(&responder, NULL, benchresponder, &sv[1]);
+		atomic_init(&completed, 0);
+
+		start = monotime();
+		for (i = 0; i < threads[n]; i++) {
+			memset(&t[i], 0, sizeof(t[i]));
+			t[i].h = h;
+			t[i].count = count / threads[n];
+			pthread_create(&t[i].thread, NULL, benchproducer, &t[i]);
+		}
+		for (i = 0; i < threads[n]; i++) pthread_join(t[i].thread, NULL);
+		aquosclose(h);
+		elapsed = monotime() - start;
+		pthread_join(responder, NULL);
+		close(sv[1]);
+
+		memset(log2ns, 0, sizeof(log2ns));
+		for (i = 0, full = calls = 0, total = 0; i < threads[n]; i++) {
+			for (b = 0; b < 64; b++) log2ns[b] += t[i].log2ns[b];
+			full += t[i].full;
+			calls += t[i].count;
+			total += t[i].total;
+		}
+		for (b = 0, seen = 0, p50 = p99 = -1; b < 64; b++) {
+			seen += log2ns[b];
+			if (p50 == -1 && seen * 2 >= calls) p50 = b;
+			if (p99 == -1 && seen * 100 >= calls * 99) p99 = b;
+		}
+
+		printf("submit %2d threads  %5.0f ns/frame, p50 <%lld ns, "
+			"p99 <%lld ns, %lu full; %.0f frames/s through\n", threads[n],
+			(double) total / calls, 1LL << p50, 1LL << p99, full,
+			calls / (elapsed / 1e9));
+	}
+}
+
+void *
+benchproducer(
+	void *arg
+)
+{
+	struct benchthread *t = arg;
+	long long          start, ns;
+	int                i, b;
+
+	for (i = 0; i < t->count; i++) {
+		start = monotime();
+		while (aquossubmit(t->h, "VOLM20  ", NULL, NULL) == -1) {
+			t->full++;
+			sched_yield();
+			start = monotime();
+		}
+		ns = monotime() - start;
+		t->total += ns;
+		for (b = 0; b < 63 && (1LL << b) <= ns; b++)
+			;
+		t->log2ns[b]++;
+	}
+
+	return(NULL);
+}
+
+/* The TV for benchsubmit(): OK to every frame, until the handle goes. */
+void *
+benchresponder(
+	void *arg
+)
+{
+	char buffer[4096], replies[4096 * 3];
+	int  fd = *(int *) arg, len, i, n;
+
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (i = n = 0; i < len; i++) {
+			if (buffer[i] == '\r') {
+				memcpy(replies + n, "OK\r", 3);
+				n += 3;
+			}
+		}
+		if (n > 0) write(fd, replies, n);
+	}
+
+	return(NULL);
 }
+#else /* AQUOS_TINY */
+char *tinyoptarg = NULL;
+int  tinyoptind = 1;
 
+/*
+ * Format into buffer (always terminated, truncating at size) for the
+ * conversions aquosctl uses: %d %u %x %c %s and %%, with the -, 0,
+ * width, .precision and l/ll modifiers. Returns the untruncated length.
+ */
 int
-sendcommand(
-	char *command,
-	char *parameter
+tinyformat(
+	char       buffer[],
+	size_t     size,
+	const char *fmt,
+	va_list    ap
 )
 {
-	int  nbytes;
-	char buffer[255];
-	char *buffptr;
+	char      digits[24], *s;
+	size_t    len = 0;
+	int       left, zero, width, prec, longs, n, neg;
+	unsigned long long u;
+	long long v;
 
-	if (verbose == 1 || nosend == 1) {
-		printf("command='%s', parameter='%s'\n", command, parameter);
+#define TINYPUT(c) do { if (len + 1 < size) buffer[len] = (c); len++; } while (0)
+	for (; *fmt != '\0'; fmt++) {
+		if (*fmt != '%') {
+			TINYPUT(*fmt);
+			continue;
+		}
+		for (left = zero = 0; *++fmt == '-' || *fmt == '0'; ) {
+			if (*fmt == '-') left = 1; else zero = 1;
+		}
+		for (width = 0; *fmt >= '0' && *fmt <= '9'; fmt++)
+			width = width * 10 + *fmt - '0';
+		prec = -1;
+		if (*fmt == '.') {
+			for (prec = 0, fmt++; *fmt >= '0' && *fmt <= '9'; fmt++)
+				prec = prec * 10 + *fmt - '0';
+		}
+		for (longs = 0; *fmt == 'l'; fmt++) longs++;
+
+		neg = 0;
+		switch (*fmt) {
+			case 's':
+				if ((s = va_arg(ap, char *)) == NULL) s = "(null)";
+				for (n = 0; s[n] != '\0' && (prec < 0 || n < prec); n++);
+				zero = 0;
+				break;
+			case 'c':
+				digits[0] = (char) va_arg(ap, int);
+				s = digits;
+				n = 1;
+				zero = 0;
+				break;
+			case 'd':
+			case 'u':
+			case 'x':
+				if (*fmt == 'd') {
+					v = longs > 1 ? va_arg(ap, long long) :
+					    longs ? va_arg(ap, long) : va_arg(ap, int);
+					if ((neg = v < 0)) u = -(unsigned long long) v;
+					else u = v;
+				}
+				else {
+					u = longs > 1 ? va_arg(ap, unsigned long long) :
+					    longs ? va_arg(ap, unsigned long) :
+					    va_arg(ap, unsigned int);
+				}
+				s = digits + sizeof(digits);
+				do {
+					*--s = "0123456789abcdef"[u % (*fmt == 'x' ? 16 : 10)];
+					u /= *fmt == 'x' ? 16 : 10;
+				} while (u != 0);
+				n = digits + sizeof(digits) - s;
+				break;
+			case '\0':
+				fmt--;
+				continue;
+			default: /* %% and anything we don't know go out as is */
+				TINYPUT(*fmt);
+				continue;
+		}
+
+		width -= n + neg;
+		if (neg && zero) TINYPUT('-');
+		for (; !left && width > 0; width--) TINYPUT(zero ? '0' : ' ');
+		if (neg && !zero) TINYPUT('-');
+		while (n-- > 0) TINYPUT(*s++);
+		for (; width > 0; width--) TINYPUT(' ');
 	}
+#undef TINYPUT
+	if (size > 0) buffer[len < size ? len : size - 1] = '\0';
 
-	if (nosend == 1) return(EXIT_SUCCESS);
+	return((int) len);
+}
 
-	write(fd, command, strlen(command));
-	write(fd, parameter, strlen(parameter));
-	write(fd, "\r", 1);
+int
+tinyprintf(
+	int        out,
+	const char *fmt,
+	...
+)
+{
+	char    buffer[1024];
+	va_list ap;
+	int     len;
 
-	/* Some commands (CHUP, CHDW) don't issue a response, so timeout after
-	 * one second and just exit. This may cause problems with 
-	 * multi-command functions such as Digital Cable tuning options 
-	 * since the first sequence may succeeed on the TV side, but not be 
-	 * reported at 'OK' by the TV, thereby causing the second half of 
-	 * the tuning command not to be sent, but this is just a hypothesis.
-	 */
+	va_start(ap, fmt);
+	len = tinyformat(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	if (len >= (int) sizeof(buffer)) len = sizeof(buffer) - 1;
 
-	alarm(1);
+	return(write(out, buffer, len));
+}
 
-	buffptr = buffer;
-	while ((nbytes = read(fd, buffptr, buffer+sizeof(buffer)-buffptr-1)) > 0) {
-		buffptr += nbytes;
-		if (buffptr[-1] == '\n' || buffptr[-1] == '\r')
+int
+tinysnprintf(
+	char       buffer[],
+	size_t     size,
+	const char *fmt,
+	...
+)
+{
+	va_list ap;
+	int     len;
+
+	va_start(ap, fmt);
+	len = tinyformat(buffer, size, fmt, ap);
+	va_end(ap);
+
+	return(len);
+}
+
+/*
+ * Just enough sscanf for the replies we parse: %d (with optional sign)
+ * and literal characters, whitespace in fmt matching any run of it.
+ */
+int
+tinysscanf(
+	const char *str,
+	const char *fmt,
+	...
+)
+{
+	va_list ap;
+	int     matched = 0, neg, v;
+
+	va_start(ap, fmt);
+	for (; *fmt != '\0'; fmt++) {
+		if (*fmt == ' ') {
+			while (*str == ' ' || *str == '\t' || *str == '\n') str++;
+		}
+		else if (fmt[0] == '%' && fmt[1] == 'd') {
+			fmt++;
+			while (*str == ' ') str++;
+			if ((neg = *str == '-') || *str == '+') str++;
+			if (*str < '0' || *str > '9') break;
+			for (v = 0; *str >= '0' && *str <= '9'; str++)
+				v = v * 10 + *str - '0';
+			*va_arg(ap, int *) = neg ? -v : v;
+			matched++;
+		}
+		else if (*str++ != *fmt) {
 			break;
+		}
 	}
+	va_end(ap);
 
-	/* NULL terminate and chop cr/nl. */
-	buffptr[-1] = '\0';
+	return(matched);
+}
 
-	if (strncmp(buffer, "OK", 2) == 0) {
-		if (verbose == 1) puts("Success.");
-		return(EXIT_SUCCESS);
+/*
+ * The logging thread isn't built in; verbose lines go straight out.
+ */
+void
+logmsg(
+	const char *fmt,
+	...
+)
+{
+	char    buffer[256];
+	va_list ap;
+	int     len;
+
+	va_start(ap, fmt);
+	len = tinyformat(buffer, sizeof(buffer) - 1, fmt, ap);
+	va_end(ap);
+	if (len > (int) sizeof(buffer) - 2) len = sizeof(buffer) - 2;
+	buffer[len++] = '\n';
+	write(STDERR_FILENO, buffer, len);
+}
+
+/*
+ * Short options only, each on its own or with its argument attached or
+ * following; stops at the first operand (optstring's '+' is implied).
+ */
+int
+tinygetopt(
+	int        argc,
+	char       *argv[],
+	const char *optstring
+)
+{
+	const char *o;
+	char       *arg;
+
+	if (tinyoptind >= argc || argv[tinyoptind][0] != '-' ||
+	    argv[tinyoptind][1] == '\0') {
+		return(-1);
 	}
-	else if (strncmp(buffer, "ERR", 3) == 0) {
-		fprintf(stderr, "Error: command/param '%s%s'\n", command, parameter);
-		return(EXIT_FAILURE);
+	arg = argv[tinyoptind++];
+	if (strcmp(arg, "--") == 0) return(-1);
+	if ((o = strchr(optstring, arg[1])) == NULL || arg[1] == '+' ||
+	    arg[1] == ':') {
+		return('?');
 	}
-	else {
-		fprintf(stderr,
-			"Error: unexpected response '%s' to command/param '%s%s'\n",
-			buffer, command, parameter
-		);
-		return(EXIT_FAILURE);
+	tinyoptarg = NULL;
+	if (o[1] == ':') {
+		if (arg[2] != '\0') tinyoptarg = arg + 2;
+		else if (tinyoptind < argc) tinyoptarg = argv[tinyoptind++];
+		else return('?');
 	}
+	else if (arg[2] != '\0') {
+		return('?');
+	}
+
+	return(arg[1]);
 }
+#endif /* AQUOS_TINY */
 
+/*
+ * How many words of argv, starting at argv[i], make up one of the global
+ * options: 0 when it is not one, 2 when its value is the next word.
+ */
 int
-checkcmd(
-	char	*string
+globalwords(
+	int                 argc,
+	char                *argv[],
+	int                 i,
+	const char          *optstring,
+	const struct option *longopts
 )
 {
-	int i;
-	for(i = 0; i < sizeof(cmdtab) / sizeof(cmdtab[0]); i++)
-	if (strcmp(cmdtab[i].cmd, string) == 0) {
-		return cmdtab[i].opcode;
+	const char *o, *arg = argv[i];
+	size_t     len;
+	int        j;
+
+	if (arg[0] != '-' || arg[1] == '\0') return(0);
+	if (arg[1] == '-') {
+		len = strcspn(arg + 2, "=");
+		for (; longopts != NULL && longopts->name != NULL; longopts++) {
+			if (strlen(longopts->name) != len ||
+			    strncmp(longopts->name, arg + 2, len) != 0) continue;
+			if (longopts->has_arg == required_argument &&
+			    arg[2 + len] == '\0' && i + 1 < argc) return(2);
+			return(1);
+		}
+		return(0);
+	}
+	for (j = 1; arg[j] != '\0'; j++) {
+		if (arg[j] == ':' || arg[j] == '+' ||
+		    (o = strchr(optstring, arg[j])) == NULL) {
+			return(0);
+		}
+		if (o[1] == ':') {
+			return(arg[j + 1] == '\0' && i + 1 < argc ? 2 : 1);
+		}
 	}
 
-	return CMD_NONE;
+	return(1);
+}
+
+/*
+ * Move the global options, with their values, ahead of the first
+ * operand, keeping both groups in order, so that getopt can stop at the
+ * command and leave it its own options. Stops at "--".
+ */
+void
+globalsfirst(
+	int                 argc,
+	char                *argv[],
+	const char          *optstring,
+	const struct option *longopts
+)
+{
+	char *hold[2];
+	int  i, n, dest = 1;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i += n) {
+		if ((n = globalwords(argc, argv, i, optstring, longopts)) == 0) {
+			n = 1;
+			continue;
+		}
+		if (i > dest) {
+			memcpy(hold, argv + i, n * sizeof(*hold));
+			memmove(argv + dest + n, argv + dest,
+			        (i - dest) * sizeof(*argv));
+			memcpy(argv + dest, hold, n * sizeof(*hold));
+		}
+		dest += n;
+	}
 }
 
 void
@@ -1074,8 +10659,9 @@ usage(
 )
 {
 	int i;
+#ifdef AQUOS_TINY
 	fprintf(stderr,
-			"aquosctl (command protocol revision %s)\n"
+			"aquosctl (command protocol revision %s, tiny build)\n"
 	        "usage: %s [ -h | -n | -p {port} | -v ] {command} [arg]\n",
 			CMD_TABLE_VERSION, progname
 	);
@@ -1087,12 +10673,73 @@ usage(
 		"command    args\n--------------------",
 		DEFAULT_PORT
 	);
+#else
+	fprintf(stderr,
+			"aquosctl (command protocol revision %s)\n"
+	        "usage: %s [ -c | -h | -L {log} | -m {model} | -n | -p {port} | "
+	        "-v | -w {ms} ]\n"
+	        "       [ --at {time} | --realtime[={cpu}] ] {command} [arg]\n",
+			CMD_TABLE_VERSION, progname
+	);
+	fprintf(stderr,
+		"\t-c\tClamp positions to learned ranges instead of failing.\n"
+		"\t-h\tHelp\n"
+		"\t-L\tWhere -v logs go: stderr, syslog or a file (default is stderr).\n"
+		"\t-m\tModel name to key learned ranges by (default is any).\n"
+		"\t-n\tShow commands being sent, but don't send them (No-send).\n"
+		"\t-p\tSerial Port to use (default is %s).\n"
+		"\t-v\tVerbose mode.\n"
+		"\t-w\tHow long to wait for a port in use (default 30000 ms).\n"
+		"\t--at\tSend at a time of day (HH:MM[:SS.sss]) or after a +delay.\n"
+		"\t--realtime\tLock memory and run SCHED_FIFO, pinned to cpu if given.\n\n"
+		"command    args\n--------------------",
+		DEFAULT_PORT
+	);
+#endif /* AQUOS_TINY */
 	for(i = 0; i < sizeof(cmdtab) / sizeof(cmdtab[0]); i++) {
 		fprintf(stderr,
 			"\n%-10s %s\n           %s\n", 
-			cmdtab[i].cmd, cmdtab[i].args, cmdtab[i].desc
+			cmdtab[i].cmd, cmdargs(i), cmdtab[i].desc
 		);
 	}
 
 	exit(EXIT_FAILURE);
 }
+
+/*
+ * cmdtab[i]'s argument synopsis: its own, or its words in this revision
+ * and its range from bulktab ("[ tv | 1 - 8 ]", brackets when it can be
+ * left blank).
+ */
+char *
+cmdargs(
+	int i
+)
+{
+	static char    args[512];
+	struct wordtab *w;
+	struct bulktab *t;
+	int            j, words, len = 1, blank = 0;
+
+	if (cmdtab[i].args != NULL) return(cmdtab[i].args);
+
+	w = findwords(cmdtab[i].opcode, &words);
+	for (j = 0; j < words; j++) {
+		if ((w[j].proto & PROTO_THIS) == 0) continue;
+		if (w[j].word[0] == '*') return("<none>");
+		if (w[j].word[0] == '\0') {
+			blank = 1;
+			continue;
+		}
+		len += snprintf(args + len, sizeof(args) - len, "%s %s",
+			len > 1 ? " |" : "", w[j].word);
+	}
+	if ((t = findbulk(cmdtab[i].opcode)) != NULL) {
+		len += snprintf(args + len, sizeof(args) - len, "%s %d - %d",
+			len > 1 ? " |" : "", t->min, t->max);
+	}
+	snprintf(args + len, sizeof(args) - len, " %c", blank ? ']' : '}');
+	args[0] = blank ? '[' : '{';
+
+	return(args);
+}